@@ -0,0 +1,18 @@
+
+FIND_PATH(FLAC_INCLUDE_DIR FLAC/stream_encoder.h /usr/include /usr/local/include)
+FIND_LIBRARY(FLAC_LIBRARY NAMES FLAC PATH /usr/lib /usr/local/lib)
+
+IF (FLAC_INCLUDE_DIR AND FLAC_LIBRARY)
+	SET(FLAC_FOUND TRUE)
+ENDIF (FLAC_INCLUDE_DIR AND FLAC_LIBRARY)
+
+IF (FLAC_FOUND)
+	IF (NOT FLAC_FIND_QUIETLY)
+		MESSAGE(STATUS "Found FLAC: ${FLAC_INCLUDE_DIR}/FLAC/stream_encoder.h ${FLAC_LIBRARY}")
+	ENDIF (NOT FLAC_FIND_QUIETLY)
+ELSE (FLAC_FOUND)
+	IF (FLAC_FIND_REQUIRED)
+		MESSAGE(FATAL_ERROR "Could not find FLAC")
+	ENDIF (FLAC_FIND_REQUIRED)
+ENDIF (FLAC_FOUND)
+
@@ -0,0 +1,17 @@
+
+FIND_PATH(LIBURING_INCLUDE_DIR liburing.h /usr/include /usr/local/include)
+FIND_LIBRARY(LIBURING_LIBRARY NAMES uring PATH /usr/lib /usr/local/lib)
+
+IF (LIBURING_INCLUDE_DIR AND LIBURING_LIBRARY)
+	SET(LIBURING_FOUND TRUE)
+ENDIF (LIBURING_INCLUDE_DIR AND LIBURING_LIBRARY)
+
+IF (LIBURING_FOUND)
+	IF (NOT liburing_FIND_QUIETLY)
+		MESSAGE(STATUS "Found liburing: ${LIBURING_INCLUDE_DIR}/liburing.h ${LIBURING_LIBRARY}")
+	ENDIF (NOT liburing_FIND_QUIETLY)
+ELSE (LIBURING_FOUND)
+	IF (liburing_FIND_REQUIRED)
+		MESSAGE(FATAL_ERROR "Could not find liburing")
+	ENDIF (liburing_FIND_REQUIRED)
+ENDIF (LIBURING_FOUND)
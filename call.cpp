@@ -23,9 +23,14 @@
 
 #include <QStringList>
 #include <QList>
+#include <QtAlgorithms>
 #include <QTcpServer>
 #include <QTcpSocket>
 #include <QMessageBox>
+#include <QDir>
+#include <QFileInfo>
+#include <QFuture>
+#include <QtConcurrentRun>
 #include <cstdlib>
 #include <cmath>
 #include <cstring>
@@ -33,11 +38,12 @@
 #include "call.h"
 #include "common.h"
 #include "skype.h"
-#include "wavewriter.h"
-#include "mp3writer.h"
-#include "vorbiswriter.h"
+#include "writer.h"
+#include "segmentedwriter.h"
 #include "preferences.h"
 #include "gui.h"
+#include "transcoder.h"
+#include "recovery.h"
 
 // AutoSync - automatic resynchronization of the two streams.  this class has a
 // circular buffer that keeps track of the delay between the two streams.  it
@@ -90,15 +96,25 @@ void AutoSync::reset() {
 
 // Call class
 
+namespace {
+bool writeSamples(AudioFileWriter *writer, QByteArray left, QByteArray right, long samples, bool flush) {
+	// the writer removes the samples from the arrays, which is why they
+	// are passed by value here
+	return writer->timedWrite(left, right, samples, flush);
+}
+}
+
 Call::Call(CallHandler *h, Skype *sk, CallID i) :
 	QObject(h),
 	skype(sk),
 	handler(h),
 	id(i),
 	status("UNKNOWN"),
-	writer(NULL),
+	streams(NULL),
 	isRecording(false),
 	shouldRecord(1),
+	deferEncoding(false),
+	segmented(false),
 	sync(100 * 2 * 3, 320) // approx 3 seconds
 {
 	debug(QString("Call %1: Call object contructed").arg(id));
@@ -132,8 +148,9 @@ Call::Call(CallHandler *h, Skype *sk, CallID i) :
 Call::~Call() {
 	debug(QString("Call %1: Call object destructed").arg(id));
 
+	// this only happens when the program quits during the call
 	if (isRecording)
-		stopRecording();
+		stopRecording(true, true);
 
 	delete confirmation;
 
@@ -271,8 +288,40 @@ void Call::denyRecording() {
 }
 
 void Call::removeFile() {
-	debug(QString("Removing '%1'").arg(fileName));
-	QFile::remove(fileName);
+	for (int i = 0; i < fileNames.size(); i++) {
+		if (deferEncoding)
+			handler->getTranscodeQueue()->cancel(fileNames.at(i));
+
+		debug(QString("Removing '%1'").arg(fileNames.at(i)));
+		OutputFile::remove(fileNames.at(i));
+	}
+
+	// spools that have already been transcoded left their outputs and
+	// manifests behind.  that includes the spool of the whole recording,
+	// since the confirmation may outlive the call.  the names depend on
+	// the output formats, so look for anything with the job's base name,
+	// along with the WAV file a pipe output may have fallen back to
+	QStringList baseNames = segmentBaseNames;
+	if (deferEncoding && !segmented)
+		baseNames.append(baseFileName);
+	for (int i = 0; i < baseNames.size(); i++) {
+		removeFilesMatching(baseNames.at(i) + ".*");
+		removeFilesMatching(baseNames.at(i) + "-unencoded.*");
+	}
+	if (!segmentBaseNames.isEmpty())
+		removeFilesMatching(baseFileName + ".*.m3u");
+}
+
+void Call::removeFilesMatching(const QString &pattern) {
+	QFileInfo info(pattern);
+	QDir dir = info.dir();
+	QStringList list = dir.entryList(QStringList(info.fileName()), QDir::Files);
+
+	for (int i = 0; i < list.size(); i++) {
+		QString fn = dir.filePath(list.at(i));
+		debug(QString("Removing '%1'").arg(fn));
+		QFile::remove(fn);
+	}
 }
 
 void Call::startRecording(bool force) {
@@ -287,7 +336,12 @@ void Call::startRecording(bool force) {
 		return;
 	}
 
-	if (force) {
+	// if this program has been restarted during the call, the user has
+	// already decided to record it
+	JournaledCall journaled;
+	bool resuming = findResumableCall(journaled);
+
+	if (force || resuming) {
 		emit showLegalInformation();
 	} else {
 		setShouldRecord();
@@ -301,38 +355,59 @@ void Call::startRecording(bool force) {
 
 	debug(QString("Call %1: start recording").arg(id));
 
-	// set up encoder for appropriate format
-
-	timeStartRecording = QDateTime::currentDateTime();
-	QString fn = constructFileName();
-
-	stereo = preferences.get(Pref::OutputStereo).toBool();
+	bool stereo = preferences.get(Pref::OutputStereo).toBool();
 	stereoMix = preferences.get(Pref::OutputStereoMix).toInt();
+	saveTags = preferences.get(Pref::OutputSaveTags).toBool();
+
+	// continue the files of the earlier run, if possible
+	bool resumed = resuming && resumeRecording(journaled);
+	if (!resumed) {
+		// set up encoder for appropriate format
+
+		timeStartRecording = QDateTime::currentDateTime();
+		QString fn = constructFileName();
+
+		// the main output, followed by any additional outputs.  all of them
+		// are fed from the same mixed data
+		outputs.clear();
+		outputs.append(preferences.get(Pref::OutputFormat).toString() + (stereo ? ":stereo" : ":mono"));
+		outputs += preferences.get(Pref::OutputExtraFormats).toList();
+
+		bool anyExpensive = false;
+		const int spoolCost = findWriterFormat(preferences.get(Pref::OutputSpoolFormat).toString())->cost;
+		for (int i = 0; i < outputs.size(); i++) {
+			QString format;
+			bool s;
+			parseOutputSpec(outputs.at(i), format, s, stereo);
+			outputs[i] = format + (s ? ":stereo" : ":mono");
+			anyExpensive |= findWriterFormat(format)->cost > spoolCost;
+		}
 
-	QString format = preferences.get(Pref::OutputFormat).toString();
-
-	if (format == "wav")
-		writer = new WaveWriter;
-	else if (format == "mp3")
-		writer = new Mp3Writer;
-	else /*if (format == "vorbis")*/
-		writer = new VorbisWriter;
-
-	if (preferences.get(Pref::OutputSaveTags).toBool())
-		writer->setTags(constructCommentTag(), timeStartRecording);
-
-	bool b = writer->open(fn, skypeSamplingRate, stereo);
-	fileName = writer->fileName();
+		// in deferred mode, we only write a cheap lossless spool during the
+		// call and leave the actual encoding to the transcode queue.  that's
+		// pointless if nothing costs more than the spool itself
+		deferEncoding = anyExpensive && preferences.get(Pref::OutputDeferEncoding).toBool();
+		baseFileName = fn;
+		fileNames.clear();
+		segmentBaseNames.clear();
+
+		// long recordings may be split into several files
+		long segmentSeconds = preferences.get(Pref::OutputSegmentMinutes).toInt() * 60;
+		qint64 segmentBytes = (qint64)preferences.get(Pref::OutputSegmentMegabytes).toInt() * 1024 * 1024;
+		segmented = segmentSeconds > 0 || segmentBytes > 0;
+
+		if (!openWriters(segmentSeconds, segmentBytes, false)) {
+			openFailed(writers.last());
+			return;
+		}
+	}
 
-	if (!b) {
-		QMessageBox *box = new QMessageBox(QMessageBox::Critical, PROGRAM_NAME " - Error",
-			QString(PROGRAM_NAME " could not open the file %1.  Please verify the output file pattern.").arg(fileName));
-		box->setWindowModality(Qt::NonModal);
-		box->setAttribute(Qt::WA_DeleteOnClose);
-		box->show();
-		removeFile();
-		delete writer;
-		return;
+	needMono = needStereo = false;
+	for (int i = 0; i < writers.size(); i++) {
+		if (writers.at(i)->isStereo())
+			needStereo = true;
+		else
+			needMono = true;
 	}
 
 	serverLocal = new QTcpServer(this);
@@ -352,23 +427,221 @@ void Call::startRecording(bool force) {
 		box->setWindowModality(Qt::NonModal);
 		box->setAttribute(Qt::WA_DeleteOnClose);
 		box->show();
-		removeFile();
-		delete writer;
+		if (resumed) {
+			// what has been recorded before the restart is kept
+			for (int i = 0; i < writers.size(); i++)
+				writers.at(i)->close();
+			deleteWriters();
+			if (deferEncoding)
+				queueTranscodeJob(fileNames.at(0), baseFileName, QString());
+			journalCallFinished(id);
+		} else {
+			deleteWriters();
+			removeFile();
+		}
 		delete serverRemote;
 		delete serverLocal;
 		return;
 	}
 
 	if (preferences.get(Pref::DebugWriteSyncFile).toBool()) {
-		syncFile.setFileName(fn + ".sync");
+		syncFile.setFileName(baseFileName + ".sync");
 		syncFile.open(QIODevice::WriteOnly);
 		syncTime.start();
 	}
 
+	// the streams as they come from Skype, so that the call can be mixed
+	// differently later, see remix.h
+	if (preferences.get(Pref::OutputKeepStreams).toBool())
+		openStreams(resumed);
+
+	if (!segmented) {
+		JournaledCall call;
+		call.id = id;
+		call.started = timeStartRecording;
+		call.baseName = baseFileName;
+		call.deferred = deferEncoding;
+		call.outputs = outputs;
+		journalCallStarted(call);
+	}
+
 	isRecording = true;
 	emit startedRecording(id);
 }
 
+bool Call::openWriters(long segmentSeconds, qint64 segmentBytes, bool resume) {
+	// outputs carry their channel layout by now
+	QString fn = baseFileName;
+	bool anyStereo = false;
+	for (int i = 0; i < outputs.size(); i++)
+		anyStereo |= outputs.at(i).endsWith(":stereo");
+
+	if (deferEncoding) {
+		// mono outputs can be derived from a stereo spool, but not the
+		// other way round.  when segmenting, each spool segment is queued
+		// for transcoding as soon as it's complete
+		QString spoolFormat = preferences.get(Pref::OutputSpoolFormat).toString();
+		AudioFileWriter *writer;
+		if (segmented) {
+			writer = new SegmentedWriter(spoolFormat, segmentSeconds, segmentBytes, ".spool", false);
+		} else {
+			writer = createAudioFileWriter(spoolFormat);
+			fn += ".spool";
+		}
+		writers.append(writer);
+
+		if (resume)
+			return writer->resume(fn, skypeSamplingRate, anyStereo);
+		return writer->open(fn, skypeSamplingRate, anyStereo);
+	}
+
+	for (int i = 0; i < outputs.size(); i++) {
+		QString format;
+		bool s;
+		parseOutputSpec(outputs.at(i), format, s, false);
+
+		int capabilities = findWriterFormat(format)->capabilities;
+		AudioFileWriter *writer;
+		if (segmented && (capabilities & WriterSegmentable))
+			writer = new SegmentedWriter(format, segmentSeconds, segmentBytes);
+		else
+			writer = createAudioFileWriter(format);
+		writers.append(writer);
+		if (saveTags && (capabilities & WriterTags))
+			writer->setTags(constructCommentTag(), timeStartRecording);
+
+		bool b = resume ? writer->resume(fn, skypeSamplingRate, s) : writer->open(fn, skypeSamplingRate, s);
+		if (!b)
+			return false;
+	}
+
+	return true;
+}
+
+void Call::openStreams(bool resume) {
+	// local left and remote right, whatever the stereo mix
+	QString fn = baseFileName + ".streams";
+	streams = createAudioFileWriter("packed");
+	bool b = resume ? streams->resume(fn, skypeSamplingRate, true) : streams->open(fn, skypeSamplingRate, true);
+	if (!b) {
+		// not worth giving up the recording for
+		debug(QString("Call %1: cannot keep the separate streams in '%2'").arg(id).arg(streams->fileName()));
+		delete streams;
+		streams = NULL;
+	}
+}
+
+bool Call::findResumableCall(JournaledCall &journaled) {
+	if (!findJournaledCall(id, journaled))
+		return false;
+
+	// Skype may reuse call IDs after it has been restarted itself, so
+	// make sure this is the same call.  the recording can't have started
+	// before the call, give or take the rounding of the duration
+	int duration = skype->getObject(QString("CALL %1 DURATION").arg(id)).toInt();
+	QDateTime callStarted = QDateTime::currentDateTime().addSecs(-duration - 5);
+	if (journaled.started < callStarted) {
+		debug(QString("Call %1: the journal lists an earlier call with the same ID").arg(id));
+		journalCallFinished(id);
+		return false;
+	}
+
+	// a format may have gone away since, see registerWriterFormat()
+	for (int i = 0; i < journaled.outputs.size(); i++) {
+		QString format;
+		bool s;
+		if (!parseOutputSpec(journaled.outputs.at(i), format, s, false))
+			return false;
+	}
+
+	return !journaled.outputs.isEmpty();
+}
+
+bool Call::resumeRecording(const JournaledCall &journaled) {
+	debug(QString("Call %1: continuing the recording started at %2").arg(id).arg(journaled.started.toString()));
+
+	timeStartRecording = journaled.started;
+	baseFileName = journaled.baseName;
+	outputs = journaled.outputs;
+	deferEncoding = journaled.deferred;
+	segmented = false;
+	fileNames.clear();
+	segmentBaseNames.clear();
+
+	// when the program quit during the call, the spool has been queued
+	// for transcoding, which the queue has picked up again.  a spool in
+	// another format than the current one can't be continued and is left
+	// to the queue
+	if (deferEncoding)
+		handler->getTranscodeQueue()->cancel(baseFileName + ".spool" +
+			findWriterFormat(preferences.get(Pref::OutputSpoolFormat).toString())->extension);
+
+	if (openWriters(0, 0, true))
+		return true;
+
+	// the writer that failed has left its file alone, the others have
+	// been continued and are complete when closed
+	debug(QString("Call %1: cannot continue the recording, starting a new one").arg(id));
+	for (int i = 0; i < writers.size() - 1; i++)
+		writers.at(i)->close();
+	deleteWriters();
+	fileNames.clear();
+	return false;
+}
+
+void Call::openFailed(AudioFileWriter *writer) {
+	QString reason = writer->errorString();
+	if (reason.isEmpty())
+		reason = "Please verify the output file pattern.";
+	QMessageBox *box = new QMessageBox(QMessageBox::Critical, PROGRAM_NAME " - Error",
+		QString(PROGRAM_NAME " could not open the file %1.  %2").arg(writer->fileNames().last()).arg(reason));
+	box->setWindowModality(Qt::NonModal);
+	box->setAttribute(Qt::WA_DeleteOnClose);
+	box->show();
+	deleteWriters();
+	removeFile();
+}
+
+void Call::deleteWriters() {
+	// remember what has been written, for removeFile()
+	fileNames.clear();
+	for (int i = 0; i < writers.size(); i++) {
+		fileNames += writers.at(i)->fileNames();
+		delete writers.at(i);
+	}
+	if (streams) {
+		fileNames += streams->fileNames();
+		delete streams;
+		streams = NULL;
+	}
+	fileNames.removeAll(QString());
+	writers.clear();
+}
+
+void Call::queueTranscodeJob(const QString &spoolName, const QString &baseName, const QString &manifestBase) {
+	TranscodeJob job;
+	job.spoolName = spoolName;
+	job.baseName = baseName;
+	job.manifestBase = manifestBase;
+	job.outputs = outputs;
+	job.saveTags = saveTags;
+	if (saveTags)
+		job.comment = constructCommentTag();
+	job.time = timeStartRecording;
+	handler->getTranscodeQueue()->add(job);
+}
+
+void Call::queueSpoolSegments() {
+	SegmentedWriter *spool = static_cast<SegmentedWriter *>(writers.at(0));
+	QList<int> list = spool->takeFinishedSegments();
+
+	for (int i = 0; i < list.size(); i++) {
+		QString baseName = spool->segmentBaseName(list.at(i));
+		segmentBaseNames.append(baseName);
+		queueTranscodeJob(spool->segmentFileName(list.at(i)), baseName, baseFileName);
+	}
+}
+
 void Call::acceptLocal() {
 	socketLocal = serverLocal->nextPendingConnection();
 	serverLocal->close();
@@ -404,29 +677,6 @@ void Call::checkConnections() {
 	}
 }
 
-void Call::mixToMono(long samples) {
-	qint16 *localData = reinterpret_cast<qint16 *>(bufferLocal.data());
-	qint16 *remoteData = reinterpret_cast<qint16 *>(bufferRemote.data());
-
-	for (long i = 0; i < samples; i++)
-		localData[i] = ((qint32)localData[i] + (qint32)remoteData[i]) / (qint32)2;
-}
-
-void Call::mixToStereo(long samples, int pan) {
-	qint16 *localData = reinterpret_cast<qint16 *>(bufferLocal.data());
-	qint16 *remoteData = reinterpret_cast<qint16 *>(bufferRemote.data());
-
-	qint32 fl = 100 - pan;
-	qint32 fr = pan;
-
-	for (long i = 0; i < samples; i++) {
-		qint16 newLocal = ((qint32)localData[i] * fl + (qint32)remoteData[i] * fr + (qint32)50) / (qint32)100;
-		qint16 newRemote = ((qint32)localData[i] * fr + (qint32)remoteData[i] * fl + (qint32)50) / (qint32)100;
-		localData[i] = newLocal;
-		remoteData[i] = newRemote;
-	}
-}
-
 long Call::padBuffers() {
 	// pads the shorter buffer with silence, so they are both the same
 	// length afterwards.  returns the new number of samples in each buffer
@@ -510,25 +760,75 @@ void Call::tryToWrite(bool flush) {
 	// got new samples to write to file, or have to flush.  note that we
 	// have to flush even if samples == 0
 
-	bool success;
-
-	if (!stereo) {
-		// mono
-		mixToMono(samples);
-		QByteArray dummy;
-		success = writer->write(bufferLocal, dummy, samples, flush);
-		bufferRemote.remove(0, samples * 2);
-	} else if (stereoMix == 0) {
-		// local left, remote right
-		success = writer->write(bufferLocal, bufferRemote, samples, flush);
-	} else if (stereoMix == 100) {
-		// local right, remote left
-		success = writer->write(bufferRemote, bufferLocal, samples, flush);
-	} else {
-		mixToStereo(samples, stereoMix);
-		success = writer->write(bufferLocal, bufferRemote, samples, flush);
+	// the separate streams are written before anything is mixed.  this is
+	// cheap enough to be done here
+	if (streams) {
+		QByteArray local = bufferLocal.left(samples * 2);
+		QByteArray remote = bufferRemote.left(samples * 2);
+		if (!streams->write(local, remote, samples, flush)) {
+			debug(QString("Call %1: error while writing the separate streams, not keeping them anymore").arg(id));
+			streams->close();
+			delete streams;
+			streams = NULL;
+		}
+	}
+
+	// mix once for all outputs.  whatever the stereo mix is, the sum of
+	// both stereo channels is the sum of both streams, so mono outputs
+	// always get the plain average of local and remote
+
+	QByteArray mono, left, right;
+
+	if (needMono)
+		downmixToMono(bufferLocal, bufferRemote, mono, samples);
+
+	if (needStereo) {
+		if (stereoMix == 100) {
+			// local right, remote left
+			left = bufferRemote.left(samples * 2);
+			right = bufferLocal.left(samples * 2);
+		} else {
+			// stereoMix == 0 is local left, remote right
+			if (stereoMix != 0)
+				mixToStereo(bufferLocal, bufferRemote, samples, stereoMix);
+			left = bufferLocal.left(samples * 2);
+			right = bufferRemote.left(samples * 2);
+		}
+	}
+
+	bufferLocal.remove(0, samples * 2);
+	bufferRemote.remove(0, samples * 2);
+
+	// the first output is encoded here, the others run in parallel on
+	// Qt's global thread pool.  whatever files the writes need are opened
+	// here beforehand, since that reads the preferences
+
+	bool success = true;
+	for (int i = 0; success && i < writers.size(); i++)
+		success = writers.at(i)->prepareWrite(samples);
+
+	if (success) {
+		QList<QFuture<bool> > futures;
+		for (int i = 1; i < writers.size(); i++) {
+			AudioFileWriter *w = writers.at(i);
+			futures.append(QtConcurrent::run(writeSamples, w, w->isStereo() ? left : mono, right, samples, flush));
+		}
+
+		AudioFileWriter *w = writers.at(0);
+		success = writeSamples(w, w->isStereo() ? left : mono, right, samples, flush);
+
+		for (int i = 0; i < futures.size(); i++)
+			success &= futures[i].result();
 	}
 
+	// finished spool segments can be encoded while the call goes on
+	if (deferEncoding && segmented)
+		queueSpoolSegments();
+
+	// a spool is cheap to write, so there's nothing to adapt then
+	if (!deferEncoding)
+		adaptEncoderLoad(writers, samples);
+
 	if (!success) {
 		QMessageBox *box = new QMessageBox(QMessageBox::Critical, PROGRAM_NAME " - Error",
 			QString(PROGRAM_NAME " encountered an error while writing this call to disk.  Recording terminated."));
@@ -539,7 +839,6 @@ void Call::tryToWrite(bool flush) {
 		return;
 	}
 
-	// the writer will remove the samples from the buffers
 	//debug(QString("Call %1: wrote %2 samples").arg(id).arg(samples));
 
 	// TODO: handle the case where the two streams get out of sync (buffers
@@ -550,7 +849,7 @@ void Call::tryToWrite(bool flush) {
 	// ahead.
 }
 
-void Call::stopRecording(bool flush) {
+void Call::stopRecording(bool flush, bool keepJournaled) {
 	if (!isRecording)
 		return;
 
@@ -568,12 +867,25 @@ void Call::stopRecording(bool flush) {
 	// flush data to writer
 	if (flush)
 		tryToWrite(true);
-	writer->close();
-	delete writer;
+	for (int i = 0; i < writers.size(); i++)
+		writers.at(i)->close();
+	if (streams)
+		streams->close();
+
+	if (deferEncoding && segmented)
+		queueSpoolSegments();
+
+	deleteWriters();
+
+	if (deferEncoding && !segmented)
+		queueTranscodeJob(fileNames.at(0), baseFileName, QString());
 
 	if (syncFile.isOpen())
 		syncFile.close();
 
+	if (!keepJournaled)
+		journalCallFinished(id);
+
 	// we must disconnect all signals from the sockets first, so that upon
 	// closing them it won't call checkConnections() and we don't land here
 	// recursively again
@@ -589,6 +901,7 @@ void Call::stopRecording(bool flush) {
 // ---- CallHandler ----
 
 CallHandler::CallHandler(QObject *parent, Skype *s) : QObject(parent), skype(s) {
+	transcodeQueue = new TranscodeQueue(this);
 }
 
 CallHandler::~CallHandler() {
@@ -603,6 +916,12 @@ CallHandler::~CallHandler() {
 		}
 	}
 
+	// QT would only delete the calls after the transcode queue, but
+	// stopping their recordings may still queue transcode jobs
+	qDeleteAll(list);
+	calls.clear();
+	delete transcodeQueue;
+
 	delete legalInformationDialog;
 }
 
@@ -33,15 +33,18 @@
 #include <QDateTime>
 #include <QTime>
 #include <QFile>
+#include <QList>
+#include <QStringList>
 
 #include "common.h"
 
-class QStringList;
 class Skype;
 class AudioFileWriter;
 class QTcpServer;
 class QTcpSocket;
 class LegalInformationDialog;
+class TranscodeQueue;
+struct JournaledCall;
 
 class CallHandler;
 
@@ -73,7 +76,9 @@ public:
 	Call(CallHandler *, Skype *, CallID);
 	~Call();
 	void startRecording(bool = false);
-	void stopRecording(bool = true);
+	// the second argument keeps the call in the journal, so that its
+	// recording is continued if this program is started again
+	void stopRecording(bool = true, bool = false);
 	void updateConfID();
 	bool okToDelete() const;
 	void setStatus(const QString &);
@@ -96,8 +101,15 @@ signals:
 private:
 	QString constructFileName() const;
 	QString constructCommentTag() const;
-	void mixToMono(long);
-	void mixToStereo(long, int);
+	bool openWriters(long, qint64, bool);
+	void openStreams(bool);
+	bool findResumableCall(JournaledCall &);
+	bool resumeRecording(const JournaledCall &);
+	void openFailed(AudioFileWriter *);
+	void deleteWriters();
+	void queueTranscodeJob(const QString &, const QString &, const QString &);
+	void queueSpoolSegments();
+	void removeFilesMatching(const QString &);
 	void setShouldRecord();
 	void ask();
 	void doSync(long);
@@ -110,12 +122,21 @@ private:
 	QString skypeName;
 	QString displayName;
 	CallID confID;
-	AudioFileWriter *writer;
+	QList<AudioFileWriter *> writers;
+	// the unmixed local and remote streams, or NULL
+	AudioFileWriter *streams;
 	bool isRecording;
-	int stereo;
 	int stereoMix;
+	bool needMono;
+	bool needStereo;
 	int shouldRecord;
-	QString fileName;
+	QStringList outputs;
+	bool saveTags;
+	bool deferEncoding;
+	bool segmented;
+	QStringList fileNames;
+	QStringList segmentBaseNames;
+	QString baseFileName;
 	QPointer<QObject> confirmation;
 	QDateTime timeStartRecording;
 
@@ -150,6 +171,7 @@ public:
 	void updateConfIDs();
 	bool isConferenceRecording(CallID) const;
 	void callCmd(const QStringList &);
+	TranscodeQueue *getTranscodeQueue() const { return transcodeQueue; }
 
 signals:
 	// note that {start,stop}Recording signals are not guaranteed to always
@@ -179,6 +201,7 @@ private:
 	CallSet ignore;
 	Skype *skype;
 	QPointer<LegalInformationDialog> legalInformationDialog;
+	TranscodeQueue *transcodeQueue;
 
 	DISABLE_COPY_AND_ASSIGNMENT(CallHandler);
 };
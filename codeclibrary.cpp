@@ -0,0 +1,85 @@
+/*
+	Skype Call Recorder
+	Copyright 2008 - 2009 by jlh (jlh at gmx dot ch)
+
+	This program is free software; you can redistribute it and/or modify it
+	under the terms of the GNU General Public License as published by the
+	Free Software Foundation; either version 2 of the License, version 3 of
+	the License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful, but
+	WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+	General Public License for more details.
+
+	You should have received a copy of the GNU General Public License along
+	with this program; if not, write to the Free Software Foundation, Inc.,
+	51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+	The GNU General Public License version 2 is included with the source of
+	this program under the file name COPYING.  You can also get a copy on
+	http://www.fsf.org/
+*/
+
+#include <QLibrary>
+#include <QMutexLocker>
+
+#include "codeclibrary.h"
+#include "common.h"
+
+CodecLibrary::CodecLibrary(const char *n, const int *v) :
+	name(n),
+	versions(v),
+	library(NULL),
+	tried(false),
+	loaded(false)
+{
+}
+
+bool CodecLibrary::load(bool (*resolveAll)(CodecLibrary *)) {
+#ifdef DLOPEN_CODECS
+	QMutexLocker locker(&mutex);
+	if (tried)
+		return loaded;
+	tried = true;
+
+	// this is never unloaded, the library stays until the program exits
+	library = new QLibrary;
+	for (int i = 0; !library->isLoaded(); i++) {
+		if (versions[i] < 0) {
+			library->setFileName(name);
+			library->load();
+			break;
+		}
+		library->setFileNameAndVersion(name, versions[i]);
+		library->load();
+	}
+
+	// if resolving fails, resolveSymbol() sets the error
+	if (!library->isLoaded())
+		error = QString("The library lib%1 could not be loaded: %2").arg(name).arg(library->errorString());
+	else
+		loaded = resolveAll(this);
+
+	if (loaded)
+		debug(QString("Loaded codec library '%1'").arg(library->fileName()));
+	else
+		debug(error);
+	return loaded;
+#else
+	Q_UNUSED(resolveAll);
+	return true;
+#endif
+}
+
+QString CodecLibrary::errorString() const {
+	return error;
+}
+
+void *CodecLibrary::resolveSymbol(const char *symbol) {
+	void *p = library->resolve(symbol);
+	if (!p)
+		error = QString("The library lib%1 is too old, it lacks the function %2()").arg(name).arg(symbol);
+	return p;
+}
+
@@ -0,0 +1,89 @@
+/*
+	Skype Call Recorder
+	Copyright 2008 - 2009 by jlh (jlh at gmx dot ch)
+
+	This program is free software; you can redistribute it and/or modify it
+	under the terms of the GNU General Public License as published by the
+	Free Software Foundation; either version 2 of the License, version 3 of
+	the License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful, but
+	WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+	General Public License for more details.
+
+	You should have received a copy of the GNU General Public License along
+	with this program; if not, write to the Free Software Foundation, Inc.,
+	51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+	The GNU General Public License version 2 is included with the source of
+	this program under the file name COPYING.  You can also get a copy on
+	http://www.fsf.org/
+*/
+
+#ifndef CODECLIBRARY_H
+#define CODECLIBRARY_H
+
+#include <QMutex>
+#include <QString>
+
+#include "common.h"
+
+class QLibrary;
+
+// the codec libraries are not linked to the program, but loaded when a
+// writer needs them for the first time, so that formats that aren't used
+// cost neither startup time nor memory.  each writer keeps pointers to the
+// library functions it uses, and macros that make calls go through them:
+//
+//   #define LAME_FUNCTIONS(X) X(lame_init) X(lame_close)
+//   LAME_FUNCTIONS(CODEC_FUNCTION_POINTER)
+//   #define lame_init (*lame_init_ptr)
+//
+// with DLOPEN_CODECS undefined, as for static builds, the libraries are
+// linked as usual and all of this does nothing
+
+#ifdef DLOPEN_CODECS
+#define CODEC_FUNCTION_POINTER(f) __typeof__(&::f) f##_ptr = NULL;
+#define CODEC_FUNCTION_RESOLVE(f) if (!library->resolve(#f, f##_ptr)) return false;
+#else
+#define CODEC_FUNCTION_POINTER(f)
+#define CODEC_FUNCTION_RESOLVE(f)
+#endif
+
+class CodecLibrary {
+public:
+	// the name of the library as for QLibrary, without "lib" and suffix,
+	// and the major versions to try, terminated by -1.  the versionless
+	// name is tried last, which only exists where the development package
+	// is installed
+	CodecLibrary(const char *, const int *);
+
+	// loads the library and resolves its functions with the given
+	// function, unless that has been done before.  returns false, and
+	// logs why, if the library or any of the functions are missing
+	bool load(bool (*)(CodecLibrary *));
+	QString errorString() const;
+
+	template <typename T> bool resolve(const char *name, T &pointer) {
+		pointer = reinterpret_cast<T>(resolveSymbol(name));
+		return pointer != NULL;
+	}
+
+private:
+	void *resolveSymbol(const char *);
+
+private:
+	const char *name;
+	const int *versions;
+	QMutex mutex;
+	QLibrary *library;
+	bool tried;
+	bool loaded;
+	QString error;
+
+	DISABLE_COPY_AND_ASSIGNMENT(CodecLibrary);
+};
+
+#endif
+
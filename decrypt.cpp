@@ -0,0 +1,142 @@
+/*
+	Skype Call Recorder
+	Copyright 2008 - 2009 by jlh (jlh at gmx dot ch)
+
+	This program is free software; you can redistribute it and/or modify it
+	under the terms of the GNU General Public License as published by the
+	Free Software Foundation; either version 2 of the License, version 3 of
+	the License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful, but
+	WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+	General Public License for more details.
+
+	You should have received a copy of the GNU General Public License along
+	with this program; if not, write to the Free Software Foundation, Inc.,
+	51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+	The GNU General Public License version 2 is included with the source of
+	this program under the file name COPYING.  You can also get a copy on
+	http://www.fsf.org/
+*/
+
+// skype-call-recorder-decrypt, decrypts recordings written with
+// Pref::OutputEncryption.  any range of a file can be decrypted without
+// touching the segments before it
+
+#include <QByteArray>
+#include <QDir>
+#include <QFile>
+#include <QString>
+#include <QStringList>
+#include <cstdio>
+#include <cstdlib>
+
+#include "encryption.h"
+
+namespace {
+void usage() {
+	fprintf(stderr,
+		"Usage: skype-call-recorder-decrypt [options] input [output]\n"
+		"\n"
+		"Decrypts a recording to the output file, or to standard output.\n"
+		"\n"
+		"  -k file    the key file, ~/.skypecallrecorder.key by default\n"
+		"  -o offset  start at this byte of the decrypted data\n"
+		"  -l length  decrypt at most this many bytes\n"
+		"  -t         also decrypt files that have been cut off, as far as\n"
+		"             they go\n"
+		"  -i         only show information about the file\n");
+	exit(2);
+}
+
+void fail(const QString &message) {
+	fprintf(stderr, "skype-call-recorder-decrypt: %s\n", message.toLocal8Bit().constData());
+	exit(1);
+}
+
+qint64 number(const QString &s) {
+	bool ok;
+	qint64 n = s.toLongLong(&ok);
+	if (!ok || n < 0)
+		usage();
+	return n;
+}
+}
+
+int main(int argc, char **argv) {
+	QString keyFile = QDir::homePath() + "/.skypecallrecorder.key";
+	qint64 offset = 0;
+	qint64 length = -1;
+	bool allowTruncated = false;
+	bool info = false;
+	QStringList files;
+
+	for (int i = 1; i < argc; i++) {
+		QString arg = QString::fromLocal8Bit(argv[i]);
+		bool hasValue = i + 1 < argc;
+		if (arg == "-k" && hasValue)
+			keyFile = QString::fromLocal8Bit(argv[++i]);
+		else if (arg == "-o" && hasValue)
+			offset = number(QString::fromLocal8Bit(argv[++i]));
+		else if (arg == "-l" && hasValue)
+			length = number(QString::fromLocal8Bit(argv[++i]));
+		else if (arg == "-t")
+			allowTruncated = true;
+		else if (arg == "-i")
+			info = true;
+		else if (arg.startsWith('-') && arg != "-")
+			usage();
+		else
+			files.append(arg);
+	}
+
+	if (files.size() < 1 || files.size() > 2)
+		usage();
+
+	QByteArray key;
+	QString error;
+	if (!Encryption::loadKey(keyFile, key, error))
+		fail(error);
+
+	DecryptingReader reader;
+	if (!reader.open(files.at(0), key, allowTruncated))
+		fail(reader.errorString());
+
+	if (info) {
+		printf("segment size: %d\nsegments: %lld\ndecrypted size: %lld\ncomplete: %s\n",
+			reader.segmentSize(), (long long)reader.segmentCount(), (long long)reader.size(),
+			reader.isComplete() ? "yes" : "no, it has been cut off");
+		return 0;
+	}
+
+	if (!reader.seek(offset))
+		fail(QString("The offset is beyond the end of the file, which has %1 bytes").arg(reader.size()));
+	qint64 left = reader.size() - offset;
+	if (length >= 0 && length < left)
+		left = length;
+
+	QFile output;
+	bool b;
+	if (files.size() == 2 && files.at(1) != "-") {
+		output.setFileName(files.at(1));
+		b = output.open(QIODevice::WriteOnly | QIODevice::Truncate);
+	} else {
+		b = output.open(stdout, QIODevice::WriteOnly);
+	}
+	if (!b)
+		fail("Cannot open the output file");
+
+	while (left > 0) {
+		QByteArray data = reader.read(qMin<qint64>(left, reader.segmentSize()));
+		if (data.isEmpty())
+			fail(reader.errorString());
+		if (output.write(data) != data.size())
+			fail("Cannot write the output file");
+		left -= data.size();
+	}
+
+	return output.flush() ? 0 : 1;
+}
+
@@ -0,0 +1,283 @@
+/*
+	Skype Call Recorder
+	Copyright 2008 - 2009 by jlh (jlh at gmx dot ch)
+
+	This program is free software; you can redistribute it and/or modify it
+	under the terms of the GNU General Public License as published by the
+	Free Software Foundation; either version 2 of the License, version 3 of
+	the License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful, but
+	WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+	General Public License for more details.
+
+	You should have received a copy of the GNU General Public License along
+	with this program; if not, write to the Free Software Foundation, Inc.,
+	51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+	The GNU General Public License version 2 is included with the source of
+	this program under the file name COPYING.  You can also get a copy on
+	http://www.fsf.org/
+*/
+
+#include <QByteArray>
+#include <QString>
+#include <cstring>
+
+#ifdef HAVE_OPENSSL
+#include <openssl/evp.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#define HAVE_SSE42_CRC
+#endif
+
+#include "digest.h"
+
+namespace {
+// the beginning of the file, where writers patch their headers
+const qint64 headSize = 1024 * 1024;
+// how far behind the end of the file data is considered final.  this covers
+// the last segment of an encrypted file, which is sealed again on each sync
+const qint64 settleDistance = 256 * 1024;
+
+quint32 crcTable[256];
+
+void makeCrcTable() {
+	for (quint32 i = 0; i < 256; i++) {
+		quint32 c = i;
+		for (int k = 0; k < 8; k++)
+			c = c & 1 ? (c >> 1) ^ 0x82f63b78 : c >> 1;
+		crcTable[i] = c;
+	}
+}
+
+quint32 crc32cSoftware(quint32 crc, const uchar *p, qint64 size) {
+	while (size-- > 0)
+		crc = crcTable[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	return crc;
+}
+
+#ifdef HAVE_SSE42_CRC
+__attribute__((target("sse4.2")))
+quint32 crc32cHardware(quint32 crc, const uchar *p, qint64 size) {
+#ifdef __x86_64__
+	quint64 c = crc;
+	for (; size >= 8; size -= 8, p += 8) {
+		quint64 v;
+		memcpy(&v, p, 8);
+		c = _mm_crc32_u64(c, v);
+	}
+	crc = c;
+#endif
+	for (; size >= 4; size -= 4, p += 4) {
+		quint32 v;
+		memcpy(&v, p, 4);
+		crc = _mm_crc32_u32(crc, v);
+	}
+	while (size-- > 0)
+		crc = _mm_crc32_u8(crc, *p++);
+	return crc;
+}
+#endif
+
+typedef quint32 (*CrcFunction)(quint32, const uchar *, qint64);
+
+CrcFunction pickCrcFunction() {
+#ifdef HAVE_SSE42_CRC
+	if (__builtin_cpu_supports("sse4.2"))
+		return crc32cHardware;
+#endif
+	makeCrcTable();
+	return crc32cSoftware;
+}
+
+QString hexCrc(quint32 crc) {
+	return QString("%1").arg(crc, 8, 16, QChar('0'));
+}
+}
+
+quint32 crc32c(quint32 crc, const char *data, qint64 size) {
+	static CrcFunction function = pickCrcFunction();
+	return ~function(~crc, reinterpret_cast<const uchar *>(data), size);
+}
+
+// Sha256
+
+#ifdef HAVE_OPENSSL
+
+Sha256::Sha256() :
+	context(EVP_MD_CTX_new())
+{
+	if (context && EVP_DigestInit_ex(context, EVP_sha256(), NULL) != 1) {
+		EVP_MD_CTX_free(context);
+		context = NULL;
+	}
+}
+
+Sha256::~Sha256() {
+	if (context)
+		EVP_MD_CTX_free(context);
+}
+
+void Sha256::add(const char *data, qint64 size) {
+	if (context && size > 0)
+		EVP_DigestUpdate(context, data, size);
+}
+
+QString Sha256::result() {
+	unsigned char digest[EVP_MAX_MD_SIZE];
+	unsigned int length = 0;
+	if (!context || EVP_DigestFinal_ex(context, digest, &length) != 1)
+		return QString();
+	EVP_MD_CTX_free(context);
+	context = NULL;
+	return QByteArray(reinterpret_cast<const char *>(digest), length).toHex();
+}
+
+#else
+
+Sha256::Sha256() :
+	context(NULL)
+{
+}
+
+Sha256::~Sha256() {
+}
+
+void Sha256::add(const char *, qint64) {
+}
+
+QString Sha256::result() {
+	return QString();
+}
+
+#endif
+
+// DigestBackend
+
+DigestBackend::DigestBackend(OutputBackend *b) :
+	inner(b),
+	end(0),
+	hashed(headSize),
+	broken(false),
+	restCrc(0)
+{
+}
+
+DigestBackend::~DigestBackend() {
+	delete inner;
+}
+
+bool DigestBackend::open(const QString &fn) {
+	return inner->open(fn);
+}
+
+bool DigestBackend::write(qint64 pos, const QByteArray &data, bool overwrite) {
+	apply(pos, data.constData(), data.size());
+	return inner->write(pos, data, overwrite);
+}
+
+bool DigestBackend::sync() {
+	return inner->sync();
+}
+
+bool DigestBackend::reserve(qint64 offset, qint64 length) {
+	return inner->reserve(offset, length);
+}
+
+bool DigestBackend::truncate(qint64 size) {
+	if (size < hashed && hashed > headSize)
+		broken = true;
+	if (size < head.size())
+		head.truncate(size);
+	if (size - hashed < unsettled.size())
+		unsettled.truncate(qMax<qint64>(size - hashed, 0));
+	// growing the file adds zeros, which are hashed as they settle
+	if (size > end)
+		apply(size, NULL, 0);
+	end = size;
+	return inner->truncate(size);
+}
+
+void DigestBackend::apply(qint64 pos, const char *data, qint64 size) {
+	// what lands in a gap is preceded by zeros, like in the file
+	if (pos < headSize) {
+		qint64 n = qMin(size, headSize - pos);
+		if (head.size() < pos)
+			head.append(QByteArray(pos - head.size(), 0));
+		if (head.size() < pos + n)
+			head.resize(pos + n);
+		if (n > 0)
+			memcpy(head.data() + pos, data, n);
+		pos += n;
+		data += n;
+		size -= n;
+	}
+
+	if (pos >= headSize && (size > 0 || pos > hashed + unsettled.size())) {
+		if (pos < hashed) {
+			// the data that has been hashed has been rewritten
+			if (!broken)
+				debug(QString("Cannot compute digests, offset %1 has been changed after it was hashed").arg(pos));
+			broken = true;
+		} else {
+			qint64 offset = pos - hashed;
+			if (unsettled.size() < offset)
+				unsettled.append(QByteArray(offset - unsettled.size(), 0));
+			if (unsettled.size() < offset + size)
+				unsettled.resize(offset + size);
+			if (size > 0)
+				memcpy(unsettled.data() + offset, data, size);
+		}
+	}
+
+	end = qMax(end, pos + size);
+	settle(false);
+}
+
+void DigestBackend::settle(bool all) {
+	// hashing is done in large pieces, so the buffer isn't moved around
+	// for each write
+	qint64 n = all ? unsettled.size() : unsettled.size() - settleDistance;
+	if (n <= 0 || (!all && n < settleDistance))
+		return;
+
+	restCrc = crc32c(restCrc, unsettled.constData(), n);
+	restSha.add(unsettled.constData(), n);
+	unsettled.remove(0, n);
+	hashed += n;
+}
+
+bool DigestBackend::close() {
+	bool b = inner->close();
+
+	settle(true);
+	Sha256 headSha;
+	headSha.add(head.constData(), head.size());
+	headDigests = QString("offset 0 length %1 crc32c %2 sha256 %3").arg(head.size())
+		.arg(hexCrc(crc32c(0, head.constData(), head.size()))).arg(headSha.result());
+
+	if (end > headSize && !broken)
+		restDigests = QString("offset %1 length %2 crc32c %3 sha256 %4").arg(headSize).arg(end - headSize)
+			.arg(hexCrc(restCrc)).arg(restSha.result());
+	else if (end > headSize)
+		restDigests = QString("offset %1 length %2 unknown").arg(headSize).arg(end - headSize);
+
+	return b;
+}
+
+QString DigestBackend::report(const QString &fn) const {
+	QString out = QString("# digests of %1, computed while it was written.  the\n"
+		"# first %2 bytes and the rest have separate digests, for example\n"
+		"#   head -c %2 FILE | sha256sum\n"
+		"#   tail -c +%3 FILE | sha256sum\n").arg(fn).arg(headSize).arg(headSize + 1);
+	out += QString("size %1\n").arg(end);
+	out += headDigests + "\n";
+	if (!restDigests.isEmpty())
+		out += restDigests + "\n";
+	return out;
+}
+
@@ -0,0 +1,103 @@
+/*
+	Skype Call Recorder
+	Copyright 2008 - 2009 by jlh (jlh at gmx dot ch)
+
+	This program is free software; you can redistribute it and/or modify it
+	under the terms of the GNU General Public License as published by the
+	Free Software Foundation; either version 2 of the License, version 3 of
+	the License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful, but
+	WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+	General Public License for more details.
+
+	You should have received a copy of the GNU General Public License along
+	with this program; if not, write to the Free Software Foundation, Inc.,
+	51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+	The GNU General Public License version 2 is included with the source of
+	this program under the file name COPYING.  You can also get a copy on
+	http://www.fsf.org/
+*/
+
+#ifndef DIGEST_H
+#define DIGEST_H
+
+#include <QByteArray>
+#include <QString>
+
+#include "common.h"
+#include "outputfile.h"
+
+struct evp_md_ctx_st;
+
+// CRC-32C (Castagnoli) of the data, continuing from the given CRC, which is
+// 0 for the start.  uses the SSE 4.2 instruction where the CPU has it
+
+quint32 crc32c(quint32, const char *, qint64);
+
+// SHA-256 of data handed in piece by piece.  empty if the program has been
+// built without OpenSSL
+
+class Sha256 {
+public:
+	Sha256();
+	~Sha256();
+
+	void add(const char *, qint64);
+	// the digest in hex.  no more data can be added afterwards
+	QString result();
+
+private:
+	struct evp_md_ctx_st *context;
+
+	DISABLE_COPY_AND_ASSIGNMENT(Sha256);
+};
+
+// wraps a backend and computes digests of what ends up in the file, from the
+// data passing through, so that nothing has to be read back.  as writers go
+// back to patch their headers, the beginning of the file is kept in memory
+// and hashed when the file is closed, and the rest is hashed a little behind
+// the end of the file, where nothing changes anymore.  the two parts get
+// their own digests, which is what report() lists
+
+class DigestBackend : public OutputBackend {
+public:
+	DigestBackend(OutputBackend *);
+	~DigestBackend();
+
+	bool open(const QString &);
+	bool write(qint64, const QByteArray &, bool);
+	bool sync();
+	bool reserve(qint64, qint64);
+	bool truncate(qint64);
+	bool close();
+
+	// the contents of the digest file for the given file name, only
+	// valid after close()
+	QString report(const QString &) const;
+
+private:
+	void apply(qint64, const char *, qint64);
+	void settle(bool);
+
+private:
+	OutputBackend *inner;
+	qint64 end;
+	QByteArray head;
+	// the rest of the file has been hashed up to here, and the data after
+	// that is in unsettled
+	qint64 hashed;
+	QByteArray unsettled;
+	bool broken;
+	quint32 restCrc;
+	Sha256 restSha;
+	QString headDigests;
+	QString restDigests;
+
+	DISABLE_COPY_AND_ASSIGNMENT(DigestBackend);
+};
+
+#endif
+
@@ -0,0 +1,179 @@
+/*
+	Skype Call Recorder
+	Copyright 2008 - 2009 by jlh (jlh at gmx dot ch)
+
+	This program is free software; you can redistribute it and/or modify it
+	under the terms of the GNU General Public License as published by the
+	Free Software Foundation; either version 2 of the License, version 3 of
+	the License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful, but
+	WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+	General Public License for more details.
+
+	You should have received a copy of the GNU General Public License along
+	with this program; if not, write to the Free Software Foundation, Inc.,
+	51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+	The GNU General Public License version 2 is included with the source of
+	this program under the file name COPYING.  You can also get a copy on
+	http://www.fsf.org/
+*/
+
+#include <QList>
+#include <QtAlgorithms>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QString>
+#include <QStringList>
+#include <QtConcurrentRun>
+
+#include "encoderpool.h"
+#include "common.h"
+#include "preferences.h"
+#include "writer.h"
+
+namespace {
+// how many encoders are kept ready for each kind
+const int poolDepth = 2;
+
+struct Slot {
+	QString format;
+	long sampleRate;
+	bool stereo;
+	QList<PreparedEncoder *> ready;
+	bool filling;
+};
+
+QMutex poolMutex;
+QList<Slot *> allSlots;
+// bumped whenever the preferences change, so that encoders being prepared
+// with the old ones are thrown away
+int generation = 0;
+QString poolSettings;
+// what the encoders are prepared with, read by warmUpEncoderPool()
+EncoderSettings poolEncoderSettings;
+
+// must be called with poolMutex held
+Slot *findSlot(const QString &format, long sampleRate, bool stereo) {
+	for (int i = 0; i < allSlots.size(); i++) {
+		Slot *slot = allSlots.at(i);
+		if (slot->format == format && slot->sampleRate == sampleRate && slot->stereo == stereo)
+			return slot;
+	}
+
+	Slot *slot = new Slot;
+	slot->format = format;
+	slot->sampleRate = sampleRate;
+	slot->stereo = stereo;
+	slot->filling = false;
+	allSlots.append(slot);
+	return slot;
+}
+
+void fillSlot(int gen, const QString &format, long sampleRate, bool stereo, const EncoderSettings &settings) {
+	for (;;) {
+		PreparedEncoder *encoder = prepareEncoder(format, sampleRate, stereo, settings);
+
+		QMutexLocker locker(&poolMutex);
+		if (gen != generation) {
+			delete encoder;
+			return;
+		}
+		Slot *slot = findSlot(format, sampleRate, stereo);
+		if (!encoder) {
+			slot->filling = false;
+			return;
+		}
+		slot->ready.append(encoder);
+		if (slot->ready.size() >= poolDepth) {
+			slot->filling = false;
+			return;
+		}
+	}
+}
+
+// must be called with poolMutex held
+void startFilling(Slot *slot) {
+	// the settings are only known once warmUpEncoderPool() has run
+	if (poolSettings.isEmpty() || slot->filling || slot->ready.size() >= poolDepth)
+		return;
+	slot->filling = true;
+	QtConcurrent::run(fillSlot, generation, slot->format, slot->sampleRate, slot->stereo, poolEncoderSettings);
+}
+
+// everything the prepared encoders depend on
+QString currentSettings() {
+	QStringList list;
+	const char * const names[] = {
+		Pref::OutputFormat, Pref::OutputExtraFormats, Pref::OutputStereo, Pref::OutputDeferEncoding,
+		Pref::OutputFormatMp3Mode, Pref::OutputFormatMp3Bitrate, Pref::OutputFormatMp3VbrQuality,
+		Pref::OutputFormatVorbisQuality
+	};
+	for (unsigned i = 0; i < sizeof(names) / sizeof(names[0]); i++)
+		list.append(preferences.get(names[i]).toString());
+	list.append(QString::number(encoderLoadStep()));
+	return list.join("\t");
+}
+}
+
+EncoderSettings currentEncoderSettings() {
+	EncoderSettings settings;
+	settings.mp3Mode = preferences.get(Pref::OutputFormatMp3Mode).toString();
+	settings.mp3Bitrate = preferences.get(Pref::OutputFormatMp3Bitrate).toInt();
+	settings.mp3VbrQuality = preferences.get(Pref::OutputFormatMp3VbrQuality).toInt();
+	settings.vorbisQuality = preferences.get(Pref::OutputFormatVorbisQuality).toInt();
+	settings.loadStep = encoderLoadStep();
+	return settings;
+}
+
+PreparedEncoder *takePreparedEncoder(const QString &format, long sampleRate, bool stereo) {
+	QMutexLocker locker(&poolMutex);
+	Slot *slot = findSlot(format, sampleRate, stereo);
+	PreparedEncoder *encoder = slot->ready.isEmpty() ? NULL : slot->ready.takeFirst();
+	startFilling(slot);
+
+	if (!encoder)
+		debug(QString("No prepared %1 encoder ready, setting one up now").arg(format));
+	return encoder;
+}
+
+void warmUpEncoderPool() {
+	QString settings = currentSettings();
+	EncoderSettings encoderSettings = currentEncoderSettings();
+
+	QMutexLocker locker(&poolMutex);
+	if (settings != poolSettings) {
+		if (!poolSettings.isEmpty())
+			debug("Encoder settings have changed, dropping prepared encoders");
+		poolSettings = settings;
+		poolEncoderSettings = encoderSettings;
+		generation++;
+		for (int i = 0; i < allSlots.size(); i++) {
+			qDeleteAll(allSlots.at(i)->ready);
+			delete allSlots.at(i);
+		}
+		allSlots.clear();
+	}
+
+	// in deferred mode, encoders are only used by the transcoder, where
+	// a little delay doesn't matter
+	if (preferences.get(Pref::OutputDeferEncoding).toBool())
+		return;
+
+	QStringList specs = preferences.get(Pref::OutputExtraFormats).toList();
+	specs.prepend(preferences.get(Pref::OutputFormat).toString());
+	bool defaultStereo = preferences.get(Pref::OutputStereo).toBool();
+
+	for (int i = 0; i < specs.size(); i++) {
+		QString format;
+		bool stereo;
+		if (!parseOutputSpec(specs.at(i), format, stereo, defaultStereo))
+			continue;
+		const WriterFormat *f = findWriterFormat(format);
+		if (f->prepare)
+			startFilling(findSlot(format, skypeSamplingRate, stereo));
+	}
+}
+
@@ -0,0 +1,74 @@
+/*
+	Skype Call Recorder
+	Copyright 2008 - 2009 by jlh (jlh at gmx dot ch)
+
+	This program is free software; you can redistribute it and/or modify it
+	under the terms of the GNU General Public License as published by the
+	Free Software Foundation; either version 2 of the License, version 3 of
+	the License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful, but
+	WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+	General Public License for more details.
+
+	You should have received a copy of the GNU General Public License along
+	with this program; if not, write to the Free Software Foundation, Inc.,
+	51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+	The GNU General Public License version 2 is included with the source of
+	this program under the file name COPYING.  You can also get a copy on
+	http://www.fsf.org/
+*/
+
+#ifndef ENCODERPOOL_H
+#define ENCODERPOOL_H
+
+#include <QString>
+
+#include "common.h"
+
+// an encoder that has been fully set up for a format, sample rate and channel
+// layout, but hasn't been given any data yet.  each writer that supports this
+// subclasses it to hold its own encoder state
+
+class PreparedEncoder {
+public:
+	PreparedEncoder() { }
+	virtual ~PreparedEncoder() { }
+
+	DISABLE_COPY_AND_ASSIGNMENT(PreparedEncoder);
+};
+
+// the preferences encoders are set up with.  the preferences may only be used
+// on the GUI thread, so they are read there and handed to whoever prepares an
+// encoder
+
+struct EncoderSettings {
+	QString mp3Mode;
+	int mp3Bitrate;
+	int mp3VbrQuality;
+	int vorbisQuality;
+	int loadStep; // see encoderLoadStep()
+};
+
+// must be called on the GUI thread
+EncoderSettings currentEncoderSettings();
+
+// setting up an encoder takes long enough to delay the start of a recording
+// noticeably.  the pool keeps a few prepared encoders ready for each format,
+// sample rate and channel layout that is in use, and refills itself in the
+// background
+
+// returns a prepared encoder, or NULL if none is ready, in which case the
+// caller has to set one up itself.  either way, a refill is started
+PreparedEncoder *takePreparedEncoder(const QString &, long, bool);
+
+// prepares encoders for the outputs configured in the preferences.  if the
+// preferences have changed since the last call, all encoders prepared with
+// the old ones are dropped first.  nothing is prepared before the first call,
+// which must happen on the GUI thread
+void warmUpEncoderPool();
+
+#endif
+
@@ -0,0 +1,287 @@
+/*
+	Skype Call Recorder
+	Copyright 2008 - 2009 by jlh (jlh at gmx dot ch)
+
+	This program is free software; you can redistribute it and/or modify it
+	under the terms of the GNU General Public License as published by the
+	Free Software Foundation; either version 2 of the License, version 3 of
+	the License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful, but
+	WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+	General Public License for more details.
+
+	You should have received a copy of the GNU General Public License along
+	with this program; if not, write to the Free Software Foundation, Inc.,
+	51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+	The GNU General Public License version 2 is included with the source of
+	this program under the file name COPYING.  You can also get a copy on
+	http://www.fsf.org/
+*/
+
+#include <QByteArray>
+#include <QDir>
+#include <QFile>
+#include <QMap>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QString>
+#include <cstring>
+
+#include "encryptingbackend.h"
+#include "encryption.h"
+#include "outputfile.h"
+#include "common.h"
+#include "preferences.h"
+
+namespace {
+// writers go back to patch their headers, so the plaintext of the first few
+// segments is kept around.  nothing else is ever rewritten
+const qint64 keptSegments = 4;
+
+// the last segment is kept in memory until it is full, or until the file is
+// synced or closed, so that each segment is sealed about once
+class EncryptingBackend : public OutputBackend {
+public:
+	EncryptingBackend(OutputBackend *b, const QByteArray &k) :
+		inner(b), key(k), segmentSize(0), tailIndex(0), tailSealed(false) { }
+	~EncryptingBackend() { delete inner; }
+
+	bool open(const QString &fn) {
+		if (!cipher.create(key, Encryption::defaultSegmentSize)) {
+			debug(QString("Cannot encrypt '%1': %2").arg(fn, cipher.errorString()));
+			return false;
+		}
+		segmentSize = cipher.segmentSize();
+		tailIndex = 0;
+		tail.clear();
+		tailSealed = false;
+		kept.clear();
+
+		return inner->open(fn) && inner->write(0, cipher.header(), false);
+	}
+
+	bool write(qint64 pos, const QByteArray &data, bool) {
+		const char *p = data.constData();
+		qint64 left = data.size();
+		bool b = true;
+
+		while (left > 0) {
+			qint64 index = pos / segmentSize;
+			int offset = pos % segmentSize;
+			int n = qMin<qint64>(left, segmentSize - offset);
+
+			if (index > tailIndex)
+				b = moveTail(index) && b;
+
+			if (index == tailIndex) {
+				// a gap left by seeking ahead reads as zeros
+				if (tail.size() < offset)
+					tail.append(QByteArray(offset - tail.size(), 0));
+				if (tail.size() < offset + n)
+					tail.resize(offset + n);
+				memcpy(tail.data() + offset, p, n);
+			} else {
+				b = patch(index, offset, p, n) && b;
+			}
+
+			pos += n;
+			p += n;
+			left -= n;
+		}
+
+		return b;
+	}
+
+	bool sync() {
+		// the tail is sealed as it is, and sealed again once it has grown
+		bool b = true;
+		if (!tail.isEmpty()) {
+			b = seal(tailIndex, tail, false, tailSealed);
+			tailSealed = true;
+		}
+		return inner->sync() && b;
+	}
+
+	bool reserve(qint64 offset, qint64 length) {
+		qint64 start = cipherPos(offset);
+		return inner->reserve(start, cipherPos(offset + length) - start);
+	}
+
+	bool truncate(qint64 size) {
+		// the segment the new end falls into becomes the tail
+		qint64 index = size > 0 ? (size - 1) / segmentSize : 0;
+		int length = size - index * segmentSize;
+
+		if (index > tailIndex) {
+			if (!moveTail(index))
+				return false;
+		} else if (index < tailIndex) {
+			if (!kept.contains(index)) {
+				debug("Cannot truncate an encrypted file that far");
+				return false;
+			}
+			tail = kept.value(index);
+			tailIndex = index;
+			for (qint64 i = index; i < keptSegments; i++)
+				kept.remove(i);
+		}
+
+		if (tail.size() < length)
+			tail.append(QByteArray(length - tail.size(), 0));
+		tail.truncate(length);
+		tailSealed = false;
+		return inner->truncate(cipher.segmentOffset(tailIndex));
+	}
+
+	bool close() {
+		// the last segment is marked as such, so that cutting the file
+		// short can be detected.  an empty file still has one
+		bool b = seal(tailIndex, tail, true, tailSealed);
+		return inner->close() && b;
+	}
+
+private:
+	qint64 cipherPos(qint64 pos) const {
+		return cipher.segmentOffset(pos / segmentSize) + Encryption::nonceSize + pos % segmentSize;
+	}
+
+	bool seal(qint64 index, const QByteArray &plain, bool last, bool overwrite) {
+		QByteArray sealed;
+		if (!cipher.seal(index, last, plain.constData(), plain.size(), sealed)) {
+			debug(QString("Cannot encrypt segment %1").arg(index));
+			return false;
+		}
+		return inner->write(cipher.segmentOffset(index), sealed, overwrite);
+	}
+
+	void keep(qint64 index, const QByteArray &plain) {
+		if (index < keptSegments)
+			kept.insert(index, plain);
+	}
+
+	// the tail is complete once something is written past it.  segments
+	// that are skipped over entirely hold zeros
+	bool moveTail(qint64 index) {
+		if (tail.size() < segmentSize)
+			tail.append(QByteArray(segmentSize - tail.size(), 0));
+		bool b = seal(tailIndex, tail, false, tailSealed);
+		keep(tailIndex, tail);
+
+		QByteArray zeros(segmentSize, 0);
+		for (qint64 i = tailIndex + 1; i < index; i++) {
+			b = seal(i, zeros, false, false) && b;
+			keep(i, zeros);
+		}
+
+		tailIndex = index;
+		tail.clear();
+		tailSealed = false;
+		return b;
+	}
+
+	bool patch(qint64 index, int offset, const char *p, int n) {
+		if (!kept.contains(index)) {
+			debug(QString("Cannot update segment %1 of an encrypted file, only the first %2 can be").arg(index).arg(keptSegments));
+			return false;
+		}
+
+		QByteArray &plain = kept[index];
+		memcpy(plain.data() + offset, p, n);
+		return seal(index, plain, false, true);
+	}
+
+private:
+	OutputBackend *inner;
+	QByteArray key;
+	SegmentCipher cipher;
+	int segmentSize;
+	qint64 tailIndex;
+	QByteArray tail;
+	bool tailSealed;
+	QMap<qint64, QByteArray> kept;
+};
+
+QMutex keyMutex;
+QString keyFileName;
+QByteArray key;
+}
+
+bool recordingKey(QByteArray &out, QString &error) {
+	QString fn = preferences.get(Pref::OutputEncryptionKeyFile).toString();
+	if (fn.startsWith("~/"))
+		fn.replace(0, 1, QDir::homePath());
+
+	// the key is read once, but files are opened from several threads
+	QMutexLocker locker(&keyMutex);
+	if (fn != keyFileName) {
+		if (!QFile::exists(fn)) {
+			if (!Encryption::createKey(fn, error))
+				return false;
+			debug(QString("Created the encryption key '%1'.  Recordings can't be decrypted without it").arg(fn));
+		}
+
+		if (!Encryption::loadKey(fn, key, error))
+			return false;
+		keyFileName = fn;
+	}
+
+	out = key;
+	return true;
+}
+
+OutputBackend *createEncryptingBackend(OutputBackend *backend, QString &error) {
+	QByteArray key;
+	if (!recordingKey(key, error))
+		return NULL;
+	return new EncryptingBackend(backend, key);
+}
+
+
+// InputFile
+
+InputFile::InputFile() :
+	encrypted(false)
+{
+}
+
+bool InputFile::open(const QString &fn) {
+	file.setFileName(fn);
+	if (!file.open(QIODevice::ReadOnly))
+		return false;
+
+	encrypted = Encryption::isEncrypted(file.read(Encryption::headerSize));
+	if (!encrypted)
+		return file.seek(0);
+
+	file.close();
+	QByteArray key;
+	QString error;
+	if (!recordingKey(key, error) || !decrypter.open(fn, key, true)) {
+		debug(QString("Cannot decrypt '%1': %2").arg(fn, error.isEmpty() ? decrypter.errorString() : error));
+		return false;
+	}
+
+	return true;
+}
+
+void InputFile::close() {
+	if (encrypted)
+		decrypter.close();
+	else
+		file.close();
+}
+
+qint64 InputFile::pos() const {
+	return encrypted ? decrypter.pos() : file.pos();
+}
+
+bool InputFile::seek(qint64 pos) {
+	return encrypted ? decrypter.seek(pos) : file.seek(pos);
+}
+
+QByteArray InputFile::read(qint64 size) {
+	return encrypted ? decrypter.read(size) : file.read(size);
+}
@@ -0,0 +1,71 @@
+/*
+	Skype Call Recorder
+	Copyright 2008 - 2009 by jlh (jlh at gmx dot ch)
+
+	This program is free software; you can redistribute it and/or modify it
+	under the terms of the GNU General Public License as published by the
+	Free Software Foundation; either version 2 of the License, version 3 of
+	the License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful, but
+	WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+	General Public License for more details.
+
+	You should have received a copy of the GNU General Public License along
+	with this program; if not, write to the Free Software Foundation, Inc.,
+	51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+	The GNU General Public License version 2 is included with the source of
+	this program under the file name COPYING.  You can also get a copy on
+	http://www.fsf.org/
+*/
+
+#ifndef ENCRYPTINGBACKEND_H
+#define ENCRYPTINGBACKEND_H
+
+#include <QFile>
+
+#include "common.h"
+#include "encryption.h"
+
+class OutputBackend;
+class QByteArray;
+class QString;
+
+// wraps a backend so that everything written through it is encrypted on the
+// way, in the format described in encryption.h.  returns NULL with an error
+// message if the key can't be loaded, in which case the given backend is
+// left alone
+
+OutputBackend *createEncryptingBackend(OutputBackend *, QString &);
+
+// the key from Pref::OutputEncryptionKeyFile.  a new key file is created if
+// there is none yet
+
+bool recordingKey(QByteArray &, QString &);
+
+// reads a file that may or may not have been encrypted on the way, like a
+// spool file.  if we crashed while writing it, it is read as far as it goes
+
+class InputFile {
+public:
+	InputFile();
+
+	bool open(const QString &);
+	void close();
+	qint64 pos() const;
+	bool seek(qint64);
+	// returns less than requested at the end of the file
+	QByteArray read(qint64);
+
+private:
+	QFile file;
+	DecryptingReader decrypter;
+	bool encrypted;
+
+	DISABLE_COPY_AND_ASSIGNMENT(InputFile);
+};
+
+#endif
+
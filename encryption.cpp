@@ -0,0 +1,425 @@
+/*
+	Skype Call Recorder
+	Copyright 2008 - 2009 by jlh (jlh at gmx dot ch)
+
+	This program is free software; you can redistribute it and/or modify it
+	under the terms of the GNU General Public License as published by the
+	Free Software Foundation; either version 2 of the License, version 3 of
+	the License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful, but
+	WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+	General Public License for more details.
+
+	You should have received a copy of the GNU General Public License along
+	with this program; if not, write to the Free Software Foundation, Inc.,
+	51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+	The GNU General Public License version 2 is included with the source of
+	this program under the file name COPYING.  You can also get a copy on
+	http://www.fsf.org/
+*/
+
+#include <QByteArray>
+#include <QFile>
+#include <QString>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <cstring>
+
+#ifdef HAVE_OPENSSL
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+#include <openssl/crypto.h>
+#endif
+
+#include "encryption.h"
+
+namespace {
+const char magic[] = "SCRCRYPT";
+const int formatVersion = 1;
+// more than that is surely a damaged header
+const int maxSegmentSize = 64 * 1024 * 1024;
+
+bool isHexDigit(char c) {
+	return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F');
+}
+
+bool randomBytes(char *buffer, int size) {
+	int fd = ::open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return false;
+
+	int done = 0;
+	while (done < size) {
+		ssize_t n = ::read(fd, buffer + done, size - done);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+		done += n;
+	}
+
+	::close(fd);
+	return done == size;
+}
+}
+
+bool Encryption::isEncrypted(const QByteArray &data) {
+	return data.startsWith(magic);
+}
+
+bool Encryption::loadKey(const QString &fn, QByteArray &key, QString &error) {
+	QFile file(fn);
+	if (!file.open(QIODevice::ReadOnly)) {
+		error = QString("Cannot read the key file '%1'").arg(fn);
+		return false;
+	}
+
+	QByteArray hex = file.readAll().trimmed();
+	bool valid = hex.size() == keySize * 2;
+	for (int i = 0; valid && i < hex.size(); i++)
+		valid = isHexDigit(hex.at(i));
+	if (!valid) {
+		error = QString("The key file '%1' does not hold a key of %2 hex digits").arg(fn).arg(keySize * 2);
+		return false;
+	}
+
+	key = QByteArray::fromHex(hex);
+	return true;
+}
+
+bool Encryption::createKey(const QString &fn, QString &error) {
+	QByteArray key(keySize, 0);
+	if (!randomBytes(key.data(), keySize)) {
+		error = "Cannot read random data for a new key";
+		return false;
+	}
+
+	// never overwrite a key, the recordings made with it would be lost
+	int fd = ::open(QFile::encodeName(fn).constData(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+	if (fd < 0) {
+		error = QString("Cannot create the key file '%1'").arg(fn);
+		return false;
+	}
+
+	QByteArray hex = key.toHex() + "\n";
+	bool b = ::write(fd, hex.constData(), hex.size()) == hex.size();
+	b = fsync(fd) == 0 && b;
+	b = ::close(fd) == 0 && b;
+	if (!b) {
+		error = QString("Cannot write the key file '%1'").arg(fn);
+		::unlink(QFile::encodeName(fn).constData());
+	}
+	return b;
+}
+
+#ifndef HAVE_OPENSSL
+
+SegmentCipher::SegmentCipher() :
+	encryptContext(NULL),
+	decryptContext(NULL),
+	plainSegmentSize(0)
+{
+}
+
+SegmentCipher::~SegmentCipher() {
+}
+
+bool SegmentCipher::create(const QByteArray &, int) {
+	error = "Encryption is not available, the program has been built without OpenSSL";
+	return false;
+}
+
+bool SegmentCipher::load(const QByteArray &, const QByteArray &) {
+	error = "Encryption is not available, the program has been built without OpenSSL";
+	return false;
+}
+
+bool SegmentCipher::seal(qint64, bool, const char *, int, QByteArray &) {
+	return false;
+}
+
+bool SegmentCipher::open(qint64, bool, const QByteArray &, QByteArray &) {
+	return false;
+}
+
+#else
+
+SegmentCipher::SegmentCipher() :
+	encryptContext(NULL),
+	decryptContext(NULL),
+	plainSegmentSize(0)
+{
+}
+
+SegmentCipher::~SegmentCipher() {
+	if (encryptContext)
+		EVP_CIPHER_CTX_free(encryptContext);
+	if (decryptContext)
+		EVP_CIPHER_CTX_free(decryptContext);
+}
+
+bool SegmentCipher::create(const QByteArray &masterKey, int segmentSize) {
+	QByteArray id(16, 0);
+	if (RAND_bytes(reinterpret_cast<unsigned char *>(id.data()), id.size()) != 1) {
+		error = "Cannot generate a file id";
+		return false;
+	}
+
+	QByteArray header(magic);
+	header.append((char)formatVersion);
+	header.append(QByteArray(3, 0));
+	for (int shift = 24; shift >= 0; shift -= 8)
+		header.append((char)(segmentSize >> shift));
+	header.append(id);
+
+	return load(masterKey, header);
+}
+
+bool SegmentCipher::load(const QByteArray &masterKey, const QByteArray &header) {
+	if (header.size() != Encryption::headerSize || !Encryption::isEncrypted(header)) {
+		error = "Not an encrypted recording";
+		return false;
+	}
+
+	const uchar *h = reinterpret_cast<const uchar *>(header.constData());
+	if (h[8] != formatVersion) {
+		error = QString("Unknown format version %1").arg(h[8]);
+		return false;
+	}
+
+	int segmentSize = (h[12] << 24) | (h[13] << 16) | (h[14] << 8) | h[15];
+	if (segmentSize <= 0 || segmentSize > maxSegmentSize) {
+		error = "Damaged header";
+		return false;
+	}
+
+	fileHeader = header;
+	plainSegmentSize = segmentSize;
+	return setKey(masterKey);
+}
+
+bool SegmentCipher::setKey(const QByteArray &masterKey) {
+	// each file gets its own key, so that nonces only need to be unique
+	// within a file
+	QByteArray info = QByteArray("skype-call-recorder file key ") + fileHeader.mid(16);
+	unsigned char fileKey[EVP_MAX_MD_SIZE];
+	unsigned int length = 0;
+	if (masterKey.size() != Encryption::keySize ||
+			!HMAC(EVP_sha256(), masterKey.constData(), masterKey.size(),
+			reinterpret_cast<const unsigned char *>(info.constData()), info.size(), fileKey, &length)) {
+		error = "Cannot derive the file key";
+		return false;
+	}
+
+	if (!encryptContext)
+		encryptContext = EVP_CIPHER_CTX_new();
+	if (!decryptContext)
+		decryptContext = EVP_CIPHER_CTX_new();
+
+	// the key schedule is set up once, each segment only sets its nonce
+	bool b = encryptContext && decryptContext &&
+		EVP_EncryptInit_ex(encryptContext, EVP_aes_256_gcm(), NULL, fileKey, NULL) == 1 &&
+		EVP_DecryptInit_ex(decryptContext, EVP_aes_256_gcm(), NULL, fileKey, NULL) == 1;
+	OPENSSL_cleanse(fileKey, sizeof(fileKey));
+
+	if (!b)
+		error = "Cannot set up AES-256-GCM";
+	return b;
+}
+
+QByteArray SegmentCipher::associatedData(qint64 index, bool last) const {
+	QByteArray data = fileHeader;
+	for (int shift = 56; shift >= 0; shift -= 8)
+		data.append((char)(index >> shift));
+	data.append((char)(last ? 1 : 0));
+	return data;
+}
+
+bool SegmentCipher::seal(qint64 index, bool last, const char *data, int size, QByteArray &out) {
+	out.resize(Encryption::nonceSize + size + Encryption::tagSize);
+	unsigned char *nonce = reinterpret_cast<unsigned char *>(out.data());
+	unsigned char *cipherText = nonce + Encryption::nonceSize;
+
+	// segments may be sealed more than once as they grow or get patched,
+	// so the nonce can't be derived from the index
+	if (RAND_bytes(nonce, Encryption::nonceSize) != 1)
+		return false;
+
+	QByteArray aad = associatedData(index, last);
+	int n;
+	if (EVP_EncryptInit_ex(encryptContext, NULL, NULL, NULL, nonce) != 1 ||
+			EVP_EncryptUpdate(encryptContext, NULL, &n, reinterpret_cast<const unsigned char *>(aad.constData()), aad.size()) != 1)
+		return false;
+	if (size > 0 && EVP_EncryptUpdate(encryptContext, cipherText, &n,
+			reinterpret_cast<const unsigned char *>(data), size) != 1)
+		return false;
+	return EVP_EncryptFinal_ex(encryptContext, cipherText + size, &n) == 1 &&
+		EVP_CIPHER_CTX_ctrl(encryptContext, EVP_CTRL_GCM_GET_TAG, Encryption::tagSize, cipherText + size) == 1;
+}
+
+bool SegmentCipher::open(qint64 index, bool last, const QByteArray &in, QByteArray &out) {
+	int size = in.size() - Encryption::overhead;
+	if (size < 0)
+		return false;
+
+	const unsigned char *nonce = reinterpret_cast<const unsigned char *>(in.constData());
+	const unsigned char *cipherText = nonce + Encryption::nonceSize;
+	unsigned char tag[Encryption::tagSize];
+	memcpy(tag, cipherText + size, Encryption::tagSize);
+
+	out.resize(size);
+	unsigned char *plainText = reinterpret_cast<unsigned char *>(out.data());
+
+	QByteArray aad = associatedData(index, last);
+	int n;
+	if (EVP_DecryptInit_ex(decryptContext, NULL, NULL, NULL, nonce) != 1 ||
+			EVP_DecryptUpdate(decryptContext, NULL, &n, reinterpret_cast<const unsigned char *>(aad.constData()), aad.size()) != 1)
+		return false;
+	if (size > 0 && EVP_DecryptUpdate(decryptContext, plainText, &n, cipherText, size) != 1)
+		return false;
+	// the plaintext must not be used unless the tag matches
+	if (EVP_CIPHER_CTX_ctrl(decryptContext, EVP_CTRL_GCM_SET_TAG, Encryption::tagSize, tag) != 1 ||
+			EVP_DecryptFinal_ex(decryptContext, plainText + size, &n) != 1) {
+		out.fill(0);
+		out.clear();
+		return false;
+	}
+	return true;
+}
+
+#endif
+
+// DecryptingReader
+
+DecryptingReader::DecryptingReader() :
+	segments(0),
+	complete(false),
+	plainSize(0),
+	position(0),
+	currentIndex(-1)
+{
+}
+
+bool DecryptingReader::open(const QString &fn, const QByteArray &key, bool allowTruncated) {
+	file.setFileName(fn);
+	if (!file.open(QIODevice::ReadOnly)) {
+		error = QString("Cannot open '%1'").arg(fn);
+		return false;
+	}
+
+	if (!cipher.load(key, file.read(Encryption::headerSize))) {
+		error = cipher.errorString();
+		close();
+		return false;
+	}
+
+	// all segments but the last are full, so the file size says how many
+	// there are.  a few bytes at the end that can't even hold an empty
+	// segment are left over from a cut off write
+	qint64 fullSize = segmentSize() + Encryption::overhead;
+	qint64 body = file.size() - Encryption::headerSize;
+	segments = body / fullSize;
+	qint64 rest = body % fullSize;
+	if (rest >= Encryption::overhead)
+		segments++;
+	else if (rest > 0 && !allowTruncated)
+		segments = -1;
+
+	position = 0;
+	currentIndex = -1;
+
+	// normally the last segment is marked as the last one.  in a cut off
+	// file, it isn't, or it may be damaged, in which case it's dropped
+	while (segments > 0) {
+		if (tryLastSegment(true)) {
+			complete = true;
+			return true;
+		}
+		if (!allowTruncated)
+			break;
+		if (tryLastSegment(false)) {
+			complete = false;
+			return true;
+		}
+		segments--;
+	}
+
+	if (segments == 0 && allowTruncated) {
+		plainSize = 0;
+		complete = false;
+		return true;
+	}
+
+	error = QString("'%1' has been cut off or is damaged").arg(fn);
+	close();
+	return false;
+}
+
+bool DecryptingReader::tryLastSegment(bool marked) {
+	complete = marked;
+	if (!loadSegment(segments - 1))
+		return false;
+	plainSize = (segments - 1) * segmentSize() + current.size();
+	return true;
+}
+
+void DecryptingReader::close() {
+	file.close();
+	current.clear();
+	currentIndex = -1;
+	segments = 0;
+	plainSize = 0;
+}
+
+bool DecryptingReader::seek(qint64 pos) {
+	if (pos < 0 || pos > plainSize)
+		return false;
+	position = pos;
+	return true;
+}
+
+QByteArray DecryptingReader::read(qint64 size) {
+	QByteArray out;
+	size = qMin(size, plainSize - position);
+
+	while (size > 0) {
+		qint64 index = position / segmentSize();
+		if (index != currentIndex && !loadSegment(index))
+			return QByteArray();
+
+		int offset = position - index * segmentSize();
+		int n = qMin<qint64>(size, current.size() - offset);
+		out.append(current.constData() + offset, n);
+		position += n;
+		size -= n;
+	}
+
+	return out;
+}
+
+bool DecryptingReader::loadSegment(qint64 index) {
+	bool last = index == segments - 1;
+	qint64 length = segmentSize() + Encryption::overhead;
+	if (last)
+		length = qMin(length, file.size() - cipher.segmentOffset(index));
+
+	currentIndex = -1;
+	if (!file.seek(cipher.segmentOffset(index)))
+		return false;
+	QByteArray in = file.read(length);
+	if (in.size() != length || !cipher.open(index, last && complete, in, current)) {
+		error = QString("Segment %1 of '%2' is damaged").arg(index).arg(file.fileName());
+		return false;
+	}
+
+	currentIndex = index;
+	return true;
+}
+
@@ -0,0 +1,153 @@
+/*
+	Skype Call Recorder
+	Copyright 2008 - 2009 by jlh (jlh at gmx dot ch)
+
+	This program is free software; you can redistribute it and/or modify it
+	under the terms of the GNU General Public License as published by the
+	Free Software Foundation; either version 2 of the License, version 3 of
+	the License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful, but
+	WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+	General Public License for more details.
+
+	You should have received a copy of the GNU General Public License along
+	with this program; if not, write to the Free Software Foundation, Inc.,
+	51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+	The GNU General Public License version 2 is included with the source of
+	this program under the file name COPYING.  You can also get a copy on
+	http://www.fsf.org/
+*/
+
+#ifndef ENCRYPTION_H
+#define ENCRYPTION_H
+
+#include <QByteArray>
+#include <QFile>
+#include <QString>
+
+#include "common.h"
+
+struct evp_cipher_ctx_st;
+
+// the format of encrypted recordings.  the file starts with a header:
+//
+//   0  "SCRCRYPT"
+//   8  format version, 1
+//   9  three zero bytes
+//  12  plaintext bytes per segment, big endian
+//  16  16 random bytes identifying the file
+//
+// followed by the segments.  each one is a 12 byte nonce, the ciphertext
+// and a 16 byte tag, and all but the last one hold exactly one segment
+// worth of plaintext, so any segment can be found without reading the ones
+// before it.  segments are encrypted with AES-256-GCM, under a key derived
+// from the key file and the file's id.  the header, the segment's index and
+// whether it is the last one are authenticated along with it, so segments
+// can't be moved around, mixed between files or cut off at the end without
+// this being noticed.  AES-NI is used where OpenSSL supports it
+
+namespace Encryption {
+const int headerSize = 32;
+const int nonceSize = 12;
+const int tagSize = 16;
+const int overhead = nonceSize + tagSize;
+const int keySize = 32;
+const int defaultSegmentSize = 64 * 1024;
+
+// whether the data is the beginning of an encrypted file
+bool isEncrypted(const QByteArray &);
+// reads a key file, which holds the key as 64 hex digits
+bool loadKey(const QString &, QByteArray &, QString &);
+// creates a new key file with a random key, readable only by the user
+bool createKey(const QString &, QString &);
+}
+
+// encrypts or decrypts the segments of one file
+
+class SegmentCipher {
+public:
+	SegmentCipher();
+	~SegmentCipher();
+
+	// sets up for writing a new file with a random id
+	bool create(const QByteArray &, int);
+	// sets up for reading the file with the given header
+	bool load(const QByteArray &, const QByteArray &);
+	QString errorString() const { return error; }
+
+	const QByteArray &header() const { return fileHeader; }
+	int segmentSize() const { return plainSegmentSize; }
+	// where the given segment starts in the file
+	qint64 segmentOffset(qint64 index) const {
+		return Encryption::headerSize + index * (plainSegmentSize + Encryption::overhead);
+	}
+
+	// the second argument is true for the last segment of the file
+	bool seal(qint64, bool, const char *, int, QByteArray &);
+	bool open(qint64, bool, const QByteArray &, QByteArray &);
+
+private:
+	bool setKey(const QByteArray &);
+	QByteArray associatedData(qint64, bool) const;
+
+private:
+	struct evp_cipher_ctx_st *encryptContext;
+	struct evp_cipher_ctx_st *decryptContext;
+	QByteArray fileHeader;
+	int plainSegmentSize;
+	QString error;
+
+	DISABLE_COPY_AND_ASSIGNMENT(SegmentCipher);
+};
+
+// reads an encrypted file like a plain one.  only the segments that are
+// actually needed are read and decrypted, so seeking is cheap
+
+class DecryptingReader {
+public:
+	DecryptingReader();
+
+	// the last argument allows reading a file that has been cut off, like
+	// one that was being written when the program crashed.  everything up
+	// to the last intact segment is readable then
+	bool open(const QString &, const QByteArray &, bool = false);
+	void close();
+	QString errorString() const { return error; }
+
+	// the size of the plaintext
+	qint64 size() const { return plainSize; }
+	qint64 pos() const { return position; }
+	bool seek(qint64);
+	// returns less than requested at the end of the file, and an empty
+	// array on errors
+	QByteArray read(qint64);
+	int segmentSize() const { return cipher.segmentSize(); }
+	qint64 segmentCount() const { return segments; }
+	// false if the file has been cut off
+	bool isComplete() const { return complete; }
+
+private:
+	bool loadSegment(qint64);
+	bool tryLastSegment(bool);
+
+private:
+	QFile file;
+	SegmentCipher cipher;
+	qint64 segments;
+	// whether the last segment is marked as such, which it isn't if the
+	// file has been cut off
+	bool complete;
+	qint64 plainSize;
+	qint64 position;
+	qint64 currentIndex;
+	QByteArray current;
+	QString error;
+
+	DISABLE_COPY_AND_ASSIGNMENT(DecryptingReader);
+};
+
+#endif
+
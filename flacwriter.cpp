@@ -0,0 +1,457 @@
+/*
+	Skype Call Recorder
+	Copyright 2008 - 2009 by jlh (jlh at gmx dot ch)
+
+	This program is free software; you can redistribute it and/or modify it
+	under the terms of the GNU General Public License as published by the
+	Free Software Foundation; either version 2 of the License, version 3 of
+	the License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful, but
+	WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+	General Public License for more details.
+
+	You should have received a copy of the GNU General Public License along
+	with this program; if not, write to the Free Software Foundation, Inc.,
+	51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+	The GNU General Public License version 2 is included with the source of
+	this program under the file name COPYING.  You can also get a copy on
+	http://www.fsf.org/
+*/
+
+
+// Note: this writes native FLAC files through libFLAC's stream encoder.  the
+// encoder is given seek and tell callbacks, so that it can go back and fill
+// in STREAMINFO and the seek table itself when the stream is finished.
+
+#include <QByteArray>
+#include <QFile>
+#include <QList>
+#include <QString>
+#include <cstring>
+#include <FLAC/stream_encoder.h>
+#include <FLAC/metadata.h>
+
+#include "flacwriter.h"
+#include "common.h"
+#include "preferences.h"
+#include "codeclibrary.h"
+
+namespace {
+// the functions of libFLAC used here, see codeclibrary.h.  its soname has
+// changed over time, the one matching the headers is wanted
+#ifdef FLAC_API_VERSION_CURRENT
+const int flacSoVersion = FLAC_API_VERSION_CURRENT - FLAC_API_VERSION_AGE;
+#else
+const int flacSoVersion = 8;
+#endif
+#define FLAC_FUNCTIONS(X) \
+	X(FLAC__stream_encoder_new) X(FLAC__stream_encoder_delete) \
+	X(FLAC__stream_encoder_set_channels) \
+	X(FLAC__stream_encoder_set_bits_per_sample) \
+	X(FLAC__stream_encoder_set_sample_rate) \
+	X(FLAC__stream_encoder_set_compression_level) \
+	X(FLAC__stream_encoder_set_metadata) \
+	X(FLAC__stream_encoder_init_stream) X(FLAC__stream_encoder_process) \
+	X(FLAC__stream_encoder_finish) X(FLAC__stream_encoder_get_state) \
+	X(FLAC__metadata_object_new) X(FLAC__metadata_object_delete) \
+	X(FLAC__metadata_object_seektable_template_append_spaced_points_by_samples) \
+	X(FLAC__metadata_object_vorbiscomment_entry_from_name_value_pair) \
+	X(FLAC__metadata_object_vorbiscomment_append_comment)
+
+const int flacVersions[] = { flacSoVersion, -1 };
+CodecLibrary flacLibrary("FLAC", flacVersions);
+FLAC_FUNCTIONS(CODEC_FUNCTION_POINTER)
+
+bool resolveFlac(CodecLibrary *library) {
+	Q_UNUSED(library);
+	FLAC_FUNCTIONS(CODEC_FUNCTION_RESOLVE)
+	return true;
+}
+}
+
+#ifdef DLOPEN_CODECS
+#define FLAC__stream_encoder_new (*FLAC__stream_encoder_new_ptr)
+#define FLAC__stream_encoder_delete (*FLAC__stream_encoder_delete_ptr)
+#define FLAC__stream_encoder_set_channels (*FLAC__stream_encoder_set_channels_ptr)
+#define FLAC__stream_encoder_set_bits_per_sample (*FLAC__stream_encoder_set_bits_per_sample_ptr)
+#define FLAC__stream_encoder_set_sample_rate (*FLAC__stream_encoder_set_sample_rate_ptr)
+#define FLAC__stream_encoder_set_compression_level (*FLAC__stream_encoder_set_compression_level_ptr)
+#define FLAC__stream_encoder_set_metadata (*FLAC__stream_encoder_set_metadata_ptr)
+#define FLAC__stream_encoder_init_stream (*FLAC__stream_encoder_init_stream_ptr)
+#define FLAC__stream_encoder_process (*FLAC__stream_encoder_process_ptr)
+#define FLAC__stream_encoder_finish (*FLAC__stream_encoder_finish_ptr)
+#define FLAC__stream_encoder_get_state (*FLAC__stream_encoder_get_state_ptr)
+#define FLAC__metadata_object_new (*FLAC__metadata_object_new_ptr)
+#define FLAC__metadata_object_delete (*FLAC__metadata_object_delete_ptr)
+#define FLAC__metadata_object_seektable_template_append_spaced_points_by_samples (*FLAC__metadata_object_seektable_template_append_spaced_points_by_samples_ptr)
+#define FLAC__metadata_object_vorbiscomment_entry_from_name_value_pair (*FLAC__metadata_object_vorbiscomment_entry_from_name_value_pair_ptr)
+#define FLAC__metadata_object_vorbiscomment_append_comment (*FLAC__metadata_object_vorbiscomment_append_comment_ptr)
+#endif
+
+namespace {
+// a seek point is reserved every 10 seconds for up to 4 hours.  the encoder
+// fills them in as it goes, and the ones that remain unused when the call
+// ends are turned into placeholders
+const unsigned seekPointInterval = 10;
+const unsigned seekTableDuration = 4 * 3600;
+// padding reserved after the tags, so that they can be edited later without
+// rewriting the whole file
+const unsigned paddingSize = 4096;
+
+// the checksums used in frames, as described in the FLAC format
+// specification.  only needed for recovering after a crash
+
+uchar crc8(const uchar *data, int size) {
+	uchar crc = 0;
+	for (int i = 0; i < size; i++) {
+		crc ^= data[i];
+		for (int j = 0; j < 8; j++)
+			crc = crc & 0x80 ? (crc << 1) ^ 0x07 : crc << 1;
+	}
+	return crc;
+}
+
+quint16 crc16(const uchar *data, int size) {
+	quint16 crc = 0;
+	for (int i = 0; i < size; i++) {
+		crc ^= data[i] << 8;
+		for (int j = 0; j < 8; j++)
+			crc = crc & 0x8000 ? (crc << 1) ^ 0x8005 : crc << 1;
+	}
+	return crc;
+}
+
+// returns the length of the frame header at the given position, or 0 if
+// there is no intact frame header
+int frameHeaderLength(const uchar *h, int available) {
+	if (available < 6 || h[0] != 0xff || (h[1] & 0xfe) != 0xf8)
+		return 0;
+	int blockSizeCode = h[2] >> 4;
+	int sampleRateCode = h[2] & 0x0f;
+	if (blockSizeCode == 0 || sampleRateCode == 15 || (h[3] >> 4) > 10 || (h[3] & 1))
+		return 0;
+
+	// the frame number is coded like UTF-8
+	int extra;
+	if (h[4] < 0x80)
+		extra = 0;
+	else if ((h[4] & 0xe0) == 0xc0)
+		extra = 1;
+	else if ((h[4] & 0xf0) == 0xe0)
+		extra = 2;
+	else if ((h[4] & 0xf8) == 0xf0)
+		extra = 3;
+	else if ((h[4] & 0xfc) == 0xf8)
+		extra = 4;
+	else if ((h[4] & 0xfe) == 0xfc)
+		extra = 5;
+	else if (h[4] == 0xfe)
+		extra = 6;
+	else
+		return 0;
+
+	int length = 5 + extra;
+	if (blockSizeCode == 6)
+		length += 1;
+	else if (blockSizeCode == 7)
+		length += 2;
+	if (sampleRateCode == 12)
+		length += 1;
+	else if (sampleRateCode == 13 || sampleRateCode == 14)
+		length += 2;
+
+	if (available < length + 1)
+		return 0;
+	for (int i = 5; i < 5 + extra; i++) {
+		if ((h[i] & 0xc0) != 0x80)
+			return 0;
+	}
+	if (crc8(h, length) != h[length])
+		return 0;
+	return length + 1;
+}
+}
+
+struct FlacWriterPrivateData {
+	FLAC__StreamEncoder *encoder;
+	FLAC__StreamMetadata *metadata[3];
+};
+
+namespace {
+FLAC__StreamEncoderWriteStatus writeCallback(const FLAC__StreamEncoder *, const FLAC__byte buffer[],
+	size_t bytes, unsigned, unsigned, void *clientData)
+{
+	OutputFile *file = static_cast<OutputFile *>(clientData);
+	if (file->write(reinterpret_cast<const char *>(buffer), bytes) != (qint64)bytes)
+		return FLAC__STREAM_ENCODER_WRITE_STATUS_FATAL_ERROR;
+	return FLAC__STREAM_ENCODER_WRITE_STATUS_OK;
+}
+
+FLAC__StreamEncoderSeekStatus seekCallback(const FLAC__StreamEncoder *, FLAC__uint64 offset, void *clientData) {
+	OutputFile *file = static_cast<OutputFile *>(clientData);
+	if (!file->seek(offset))
+		return FLAC__STREAM_ENCODER_SEEK_STATUS_ERROR;
+	return FLAC__STREAM_ENCODER_SEEK_STATUS_OK;
+}
+
+FLAC__StreamEncoderTellStatus tellCallback(const FLAC__StreamEncoder *, FLAC__uint64 *offset, void *clientData) {
+	OutputFile *file = static_cast<OutputFile *>(clientData);
+	*offset = file->pos();
+	return FLAC__STREAM_ENCODER_TELL_STATUS_OK;
+}
+
+void addComment(FLAC__StreamMetadata *block, const char *name, const QString &value) {
+	FLAC__StreamMetadata_VorbisComment_Entry entry;
+	if (!FLAC__metadata_object_vorbiscomment_entry_from_name_value_pair(&entry, name, value.toUtf8().constData()))
+		return;
+	// with copy == false, the block takes ownership of the entry
+	FLAC__metadata_object_vorbiscomment_append_comment(block, entry, false);
+}
+}
+
+FlacWriter::FlacWriter() :
+	pd(NULL),
+	hasFlushed(false)
+{
+}
+
+FlacWriter::~FlacWriter() {
+	if (file.isOpen()) {
+		debug("WARNING: FlacWriter::~FlacWriter(): File has not been closed, closing it now");
+		close();
+	}
+
+	if (pd) {
+		if (pd->encoder)
+			FLAC__stream_encoder_delete(pd->encoder);
+		for (int i = 0; i < 3; i++)
+			if (pd->metadata[i])
+				FLAC__metadata_object_delete(pd->metadata[i]);
+		delete pd;
+	}
+}
+
+namespace {
+AudioFileWriter *createFlacWriter() {
+	return new FlacWriter;
+}
+}
+
+WriterFormat FlacWriter::writerFormat() {
+	WriterFormat format;
+	format.name = "flac";
+	format.description = "FLAC";
+	format.extension = ".flac";
+	format.capabilities = WriterStereo | WriterTags | WriterSeekable | WriterSegmentable;
+	format.cost = 3;
+	format.create = createFlacWriter;
+	format.prepare = NULL;
+	format.recover = FlacWriter::recover;
+	format.createReader = NULL;
+	return format;
+}
+
+bool FlacWriter::recover(const QString &fn) {
+	QFile f(fn);
+	if (!f.open(QIODevice::ReadWrite))
+		return false;
+
+	// STREAMINFO is fine as it is, since a total sample count and MD5 sum
+	// of zero mean unknown.  but the seek points have not been filled in,
+	// so they are all turned into placeholders
+	if (f.read(4) != "fLaC")
+		return false;
+	for (;;) {
+		QByteArray header = f.read(4);
+		if (header.size() != 4)
+			return false;
+		const uchar *h = reinterpret_cast<const uchar *>(header.constData());
+		qint64 length = (h[1] << 16) | (h[2] << 8) | h[3];
+
+		if ((h[0] & 0x7f) == FLAC__METADATA_TYPE_SEEKTABLE) {
+			QByteArray points(length, '\0');
+			for (int i = 0; i + FLAC__STREAM_METADATA_SEEKPOINT_LENGTH <= length; i += FLAC__STREAM_METADATA_SEEKPOINT_LENGTH)
+				memset(points.data() + i, 0xff, 8);
+			// switching from reading to writing needs a seek
+			if (!f.seek(f.pos()) || f.write(points) != length)
+				return false;
+		} else if (!f.seek(f.pos() + length)) {
+			return false;
+		}
+
+		if (h[0] & 0x80)
+			break;
+	}
+
+	qint64 audioStart = f.pos();
+	qint64 size = f.size();
+	if (size <= audioStart)
+		return true;
+
+	// a frame is at most a few dozen KB with our settings.  frames end
+	// with a checksum over the whole frame, which tells where the last
+	// complete one ends
+	qint64 tailStart = qMax(audioStart, size - 128 * 1024);
+	if (!f.seek(tailStart))
+		return false;
+	QByteArray tail = f.read(size - tailStart);
+	const uchar *t = reinterpret_cast<const uchar *>(tail.constData());
+	int n = tail.size();
+
+	QList<int> starts;
+	for (int i = 0; i < n; i++) {
+		if (frameHeaderLength(t + i, n - i))
+			starts.append(i);
+	}
+
+	// a frame ends where the next one starts, or at the end of the file.
+	// frame headers can appear by chance inside of frames, so a few
+	// starting points are tried for each end
+	int end = -1;
+	for (int e = starts.size(); e >= 0 && end < 0; e--) {
+		int pos = e == starts.size() ? n : starts.at(e);
+		for (int s = e - 1; s >= 0 && s >= e - 4; s--) {
+			int start = starts.at(s);
+			if (pos - start < 8)
+				continue;
+			if (crc16(t + start, pos - start - 2) == ((t[pos - 2] << 8) | t[pos - 1])) {
+				end = pos;
+				break;
+			}
+		}
+	}
+
+	if (end < 0)
+		return false;
+	if (end == n)
+		return true;
+
+	debug(QString("Cutting off %1 bytes of an incomplete frame from '%2'").arg(n - end).arg(fn));
+	return f.resize(tailStart + end);
+}
+
+bool FlacWriter::open(const QString &fn, long sr, bool s) {
+	if (!flacLibrary.load(resolveFlac)) {
+		error = flacLibrary.errorString();
+		return false;
+	}
+
+	bool b = AudioFileWriter::open(fn + ".flac", sr, s);
+
+	if (!b)
+		return false;
+
+	// lower compression levels are cheaper to encode
+	int level = preferences.get(Pref::OutputFormatFlacLevel).toInt() - encoderLoadStep() * 2;
+	if (level < 0)
+		level = 0;
+
+	pd = new FlacWriterPrivateData;
+	pd->encoder = FLAC__stream_encoder_new();
+	pd->metadata[0] = FLAC__metadata_object_new(FLAC__METADATA_TYPE_SEEKTABLE);
+	pd->metadata[1] = FLAC__metadata_object_new(FLAC__METADATA_TYPE_VORBIS_COMMENT);
+	pd->metadata[2] = FLAC__metadata_object_new(FLAC__METADATA_TYPE_PADDING);
+
+	if (!pd->encoder || !pd->metadata[0] || !pd->metadata[1] || !pd->metadata[2])
+		return false;
+
+	FLAC__metadata_object_seektable_template_append_spaced_points_by_samples(pd->metadata[0],
+		seekPointInterval * sampleRate, (FLAC__uint64)seekTableDuration * sampleRate);
+
+	addComment(pd->metadata[1], "COMMENT", tagComment);
+	addComment(pd->metadata[1], "DATE", tagTime.toString("yyyy-MM-dd hh:mm"));
+	addComment(pd->metadata[1], "GENRE", "Speech (Skype Call)");
+
+	pd->metadata[2]->length = paddingSize;
+
+	FLAC__stream_encoder_set_channels(pd->encoder, stereo ? 2 : 1);
+	FLAC__stream_encoder_set_bits_per_sample(pd->encoder, 16);
+	FLAC__stream_encoder_set_sample_rate(pd->encoder, sampleRate);
+	FLAC__stream_encoder_set_compression_level(pd->encoder, level);
+	FLAC__stream_encoder_set_metadata(pd->encoder, pd->metadata, 3);
+
+	FLAC__StreamEncoderInitStatus status = FLAC__stream_encoder_init_stream(pd->encoder,
+		writeCallback, seekCallback, tellCallback, NULL, &file);
+
+	if (status != FLAC__STREAM_ENCODER_INIT_STATUS_OK) {
+		debug(QString("Error while initializing FLAC encoder, code = %1").arg(status));
+		return false;
+	}
+
+	return true;
+}
+
+void FlacWriter::close() {
+	if (!file.isOpen()) {
+		debug("WARNING: FlacWriter::close() called, but file not open");
+		return;
+	}
+
+	if (!hasFlushed) {
+		debug("WARNING: FlacWriter::close() called but no flush happened, flushing now");
+		QByteArray dummy1, dummy2;
+		write(dummy1, dummy2, 0, true);
+	}
+
+	AudioFileWriter::close();
+}
+
+bool FlacWriter::write(QByteArray &left, QByteArray &right, long samples, bool flush) {
+	const long maxChunkSize = 4096;
+
+	const qint16 *leftData = (const qint16 *)left.constData();
+	const qint16 *rightData = stereo ? (const qint16 *)right.constData() : NULL;
+
+	FLAC__int32 leftBuffer[maxChunkSize];
+	FLAC__int32 rightBuffer[maxChunkSize];
+	const FLAC__int32 *buffers[2] = { leftBuffer, rightBuffer };
+
+	bool ret = true;
+
+	for (long done = 0; done < samples && ret; ) {
+		long chunkSize = samples - done > maxChunkSize ? maxChunkSize : samples - done;
+
+		for (long i = 0; i < chunkSize; i++)
+			leftBuffer[i] = leftData[done + i];
+		if (stereo)
+			for (long i = 0; i < chunkSize; i++)
+				rightBuffer[i] = rightData[done + i];
+
+		ret = FLAC__stream_encoder_process(pd->encoder, buffers, chunkSize);
+		done += chunkSize;
+	}
+
+	samplesWritten += samples;
+
+	left.remove(0, samples * 2);
+	if (stereo)
+		right.remove(0, samples * 2);
+
+	if (!ret) {
+		debug(QString("Error while writing FLAC file, state = %1").arg(FLAC__stream_encoder_get_state(pd->encoder)));
+		return false;
+	}
+
+	if (!flush)
+		return true;
+
+	// seek points past the end of the call were never reached.  turn them
+	// into placeholders, the encoder sorts them to the end of the table
+	// when it writes it out
+	FLAC__StreamMetadata_SeekTable &table = pd->metadata[0]->data.seek_table;
+	for (unsigned i = 0; i < table.num_points; i++)
+		if (table.points[i].sample_number >= (FLAC__uint64)samplesWritten)
+			table.points[i].sample_number = FLAC__STREAM_METADATA_SEEKPOINT_PLACEHOLDER;
+
+	hasFlushed = true;
+
+	if (!FLAC__stream_encoder_finish(pd->encoder)) {
+		debug("Error while flushing FLAC file");
+		return false;
+	}
+
+	return true;
+}
@@ -0,0 +1,58 @@
+/*
+	Skype Call Recorder
+	Copyright 2008 - 2009 by jlh (jlh at gmx dot ch)
+
+	This program is free software; you can redistribute it and/or modify it
+	under the terms of the GNU General Public License as published by the
+	Free Software Foundation; either version 2 of the License, version 3 of
+	the License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful, but
+	WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+	General Public License for more details.
+
+	You should have received a copy of the GNU General Public License along
+	with this program; if not, write to the Free Software Foundation, Inc.,
+	51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+	The GNU General Public License version 2 is included with the source of
+	this program under the file name COPYING.  You can also get a copy on
+	http://www.fsf.org/
+*/
+
+
+#ifndef FLACWRITER_H
+#define FLACWRITER_H
+
+#include "common.h"
+#include "writer.h"
+
+class QString;
+class QByteArray;
+struct FlacWriterPrivateData;
+
+class FlacWriter : public AudioFileWriter {
+public:
+	FlacWriter();
+	virtual ~FlacWriter();
+
+	virtual bool open(const QString &, long, bool);
+	virtual void close();
+	virtual bool write(QByteArray &, QByteArray &, long, bool = false);
+
+	// repairs a file that has been left unfinished by a crash, looking
+	// only at its beginning and its end
+	static bool recover(const QString &);
+	// describes this writer for the format registry, see writer.h
+	static WriterFormat writerFormat();
+
+private:
+	FlacWriterPrivateData *pd;
+	bool hasFlushed;
+
+	DISABLE_COPY_AND_ASSIGNMENT(FlacWriter);
+};
+
+#endif
+
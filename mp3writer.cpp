@@ -22,16 +22,228 @@
 */
 
 #include <QByteArray>
+#include <QFile>
 #include <QString>
 #include <lame/lame.h>
-#include <id3/tag.h>
 
 #include "mp3writer.h"
 #include "common.h"
 #include "preferences.h"
+#include "encoderpool.h"
+#include "codeclibrary.h"
+
+namespace {
+// the functions of libmp3lame used here, see codeclibrary.h
+#define LAME_FUNCTIONS(X) \
+	X(lame_init) X(lame_init_params) X(lame_close) \
+	X(lame_set_in_samplerate) X(lame_set_out_samplerate) \
+	X(lame_set_num_channels) X(lame_set_mode) X(lame_set_brate) \
+	X(lame_set_VBR) X(lame_set_VBR_q) X(lame_set_VBR_mean_bitrate_kbps) \
+	X(lame_set_bWriteVbrTag) X(lame_set_quality) X(lame_encode_buffer) \
+	X(lame_encode_flush) X(lame_get_lametag_frame)
+
+const int lameVersions[] = { 0, -1 };
+CodecLibrary lameLibrary("mp3lame", lameVersions);
+LAME_FUNCTIONS(CODEC_FUNCTION_POINTER)
+
+bool resolveLame(CodecLibrary *library) {
+	Q_UNUSED(library);
+	LAME_FUNCTIONS(CODEC_FUNCTION_RESOLVE)
+	return true;
+}
+}
+
+#ifdef DLOPEN_CODECS
+#define lame_init (*lame_init_ptr)
+#define lame_init_params (*lame_init_params_ptr)
+#define lame_close (*lame_close_ptr)
+#define lame_set_in_samplerate (*lame_set_in_samplerate_ptr)
+#define lame_set_out_samplerate (*lame_set_out_samplerate_ptr)
+#define lame_set_num_channels (*lame_set_num_channels_ptr)
+#define lame_set_mode (*lame_set_mode_ptr)
+#define lame_set_brate (*lame_set_brate_ptr)
+#define lame_set_VBR (*lame_set_VBR_ptr)
+#define lame_set_VBR_q (*lame_set_VBR_q_ptr)
+#define lame_set_VBR_mean_bitrate_kbps (*lame_set_VBR_mean_bitrate_kbps_ptr)
+#define lame_set_bWriteVbrTag (*lame_set_bWriteVbrTag_ptr)
+#define lame_set_quality (*lame_set_quality_ptr)
+#define lame_encode_buffer (*lame_encode_buffer_ptr)
+#define lame_encode_flush (*lame_encode_flush_ptr)
+#define lame_get_lametag_frame (*lame_get_lametag_frame_ptr)
+#endif
+
+namespace {
+// ID3v2.3, see http://www.id3.org/id3v2.3.0
+
+void appendBigEndian(QByteArray &data, quint32 value) {
+	data.append((char)(value >> 24));
+	data.append((char)(value >> 16));
+	data.append((char)(value >> 8));
+	data.append((char)value);
+}
+
+// the tag size in the header is stored with 7 bits per byte
+void appendSyncSafe(QByteArray &data, quint32 value) {
+	data.append((char)((value >> 21) & 0x7f));
+	data.append((char)((value >> 14) & 0x7f));
+	data.append((char)((value >> 7) & 0x7f));
+	data.append((char)(value & 0x7f));
+}
+
+const int sampleRates[4][3] = {
+	{ 11025, 12000, 8000 },  // MPEG 2.5
+	{ 0, 0, 0 },             // reserved
+	{ 22050, 24000, 16000 }, // MPEG 2
+	{ 44100, 48000, 32000 }  // MPEG 1
+};
+
+// returns the length of the MPEG layer III frame starting with the given
+// four bytes, or 0 if they aren't a valid frame header
+int frameLength(const uchar *h) {
+	static const int bitRates[2][15] = {
+		{ 0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160 },
+		{ 0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320 }
+	};
+
+	if (h[0] != 0xff || (h[1] & 0xe0) != 0xe0)
+		return 0;
+	int version = (h[1] >> 3) & 3;
+	int layer = (h[1] >> 1) & 3;
+	int bitRateIndex = h[2] >> 4;
+	int sampleRateIndex = (h[2] >> 2) & 3;
+	if (version == 1 || layer != 1 || bitRateIndex == 0 || bitRateIndex == 15 || sampleRateIndex == 3)
+		return 0;
+
+	bool mpeg1 = version == 3;
+	int bitRate = bitRates[mpeg1 ? 1 : 0][bitRateIndex] * 1000;
+	int padding = (h[2] >> 1) & 1;
+	return (mpeg1 ? 144 : 72) * bitRate / sampleRates[version][sampleRateIndex] + padding;
+}
+
+// whether the valid frame header has the given sample rate and channels
+bool frameMatches(const uchar *h, long sampleRate, bool stereo) {
+	bool mono = (h[3] >> 6) == 3;
+	return sampleRates[(h[1] >> 3) & 3][(h[2] >> 2) & 3] == sampleRate && mono != stereo;
+}
+
+// returns where the last complete frame at the end of the given data ends,
+// or -1 if there are no frames at all.  the largest frame is 1441 bytes, so
+// a few KB at the end of a file are enough to find where the frames are
+int framesEnd(const QByteArray &tail) {
+	const uchar *t = reinterpret_cast<const uchar *>(tail.constData());
+	int n = tail.size();
+
+	// find two frames in a row, which is very unlikely to happen by chance
+	int p = 0;
+	for (; p + 4 <= n; p++) {
+		int len = frameLength(t + p);
+		if (len == 0)
+			continue;
+		if (p + len == n || (p + len + 4 <= n && frameLength(t + p + len)))
+			break;
+	}
+	if (p + 4 > n)
+		return -1;
+
+	// then follow the frames up to the end
+	for (;;) {
+		int len = p + 4 <= n ? frameLength(t + p) : 0;
+		if (len == 0 || p + len >= n)
+			break;
+		p += len;
+	}
+
+	if (p + 4 <= n && p + frameLength(t + p) == n)
+		return n;
+	return p;
+}
+
+class PreparedLame : public PreparedEncoder {
+public:
+	PreparedLame(lame_global_flags *l) : lame(l) { }
+	~PreparedLame() {
+		if (lame)
+			lame_close(lame);
+	}
+
+	lame_global_flags *take() {
+		lame_global_flags *l = lame;
+		lame = NULL;
+		return l;
+	}
+
+private:
+	lame_global_flags *lame;
+};
+
+// UTF-16 with byte order mark, without terminator
+QByteArray toUtf16(const QString &str) {
+	QByteArray data("\xff\xfe", 2);
+	for (int i = 0; i < str.size(); i++) {
+		ushort c = str.at(i).unicode();
+		data.append((char)(c & 0xff));
+		data.append((char)(c >> 8));
+	}
+	return data;
+}
+
+void appendFrame(QByteArray &tag, const char *id, const QByteArray &content) {
+	tag.append(id, 4);
+	appendBigEndian(tag, content.size());
+	// flags
+	tag.append('\0');
+	tag.append('\0');
+	tag.append(content);
+}
+
+void appendTextFrame(QByteArray &tag, const char *id, const QString &str) {
+	// ISO-8859-1 encoding
+	QByteArray content(1, '\0');
+	content.append(str.toLatin1());
+	appendFrame(tag, id, content);
+}
+
+QByteArray renderFrames(const QString &comment, const QDateTime &time) {
+	QByteArray frames;
+
+	// NOTE: we don't set a title frame as the file name is already meant
+	// to be a good enough description of the content
+
+	// UTF-16 encoding, language, empty description, text
+	QByteArray content(1, '\1');
+	content.append("eng");
+	content.append(toUtf16(QString()));
+	content.append(QByteArray(2, '\0'));
+	content.append(toUtf16(comment));
+	appendFrame(frames, "COMM", content);
+
+	QString str = time.toString("yyyyddMMhhmm");
+	appendTextFrame(frames, "TCON", "(101)Skype Call");
+	appendTextFrame(frames, "TYER", str.mid(0, 4));
+	appendTextFrame(frames, "TDAT", str.mid(4, 4));
+	appendTextFrame(frames, "TIME", str.mid(8, 4));
+
+	return frames;
+}
+
+// returns a complete tag of exactly the given size, or an empty array if the
+// frames don't fit
+QByteArray renderTag(const QByteArray &frames, int size) {
+	if (frames.size() + 10 > size)
+		return QByteArray();
+
+	QByteArray tag("ID3\x03\x00\x00", 6);
+	appendSyncSafe(tag, size - 10);
+	tag.append(frames);
+	// the rest is padding
+	tag.append(QByteArray(size - tag.size(), '\0'));
+	return tag;
+}
+}
 
 Mp3Writer::Mp3Writer() :
 	lame(NULL),
+	tagSize(0),
 	hasFlushed(false)
 {
 }
@@ -47,26 +259,144 @@ Mp3Writer::~Mp3Writer() {
 }
 
 bool Mp3Writer::open(const QString &fn, long sr, bool s) {
+	if (!lameLibrary.load(resolveLame)) {
+		error = lameLibrary.errorString();
+		return false;
+	}
+
 	bool b = AudioFileWriter::open(fn + ".mp3", sr, s);
 
 	if (!b)
 		return false;
 
-	lame = lame_init();
-	if (!lame)
+	// the tag goes first in the file.  it is written now, with plenty of
+	// padding, so that close() only needs to overwrite it instead of
+	// moving the whole file
+	QByteArray frames = renderFrames(tagComment, tagTime);
+	tagSize = 4096;
+	while (frames.size() + 10 + 1024 > tagSize)
+		tagSize *= 2;
+	QByteArray tag = renderTag(frames, tagSize);
+	if (file.write(tag) != tag.size())
+		return false;
+	mustWriteTags = false;
+
+	// setting up lame takes a while, so use one that has been prepared in
+	// the background if possible
+	EncoderSettings settings = currentEncoderSettings();
+	PreparedEncoder *prepared = takePreparedEncoder("mp3", sampleRate, stereo);
+	if (!prepared)
+		prepared = prepareEncoder(sampleRate, stereo, settings);
+	if (!prepared)
 		return false;
+	lame = static_cast<PreparedLame *>(prepared)->take();
+	delete prepared;
+
+	bitRate = settings.mp3Bitrate;
+	// in VBR mode, this is only a rough guess
+	preallocate(bitRate * 1000 / 8);
+
+	return true;
+}
+
+namespace {
+lame_global_flags *setUpLame(long sampleRate, bool stereo, bool infoFrame, const EncoderSettings &settings) {
+	lame_global_flags *lame = lame_init();
+	if (!lame)
+		return NULL;
 
-	bitRate = preferences.get(Pref::OutputFormatMp3Bitrate).toInt();
+	int bitRate = settings.mp3Bitrate;
+	const QString &mode = settings.mp3Mode;
 
 	lame_set_in_samplerate(lame, sampleRate);
 	lame_set_num_channels(lame, stereo ? 2 : 1);
 	lame_set_out_samplerate(lame, sampleRate);
-	// TODO: do we need this?
-	lame_set_bWriteVbrTag(lame, 0);
+	// this makes lame start the stream with a placeholder frame, which is
+	// filled in with a Xing/LAME info frame when flushing.  for VBR and
+	// ABR, its seek table is what allows players to seek without scanning
+	// the whole file.  for CBR, it still tells them the exact length
+	lame_set_bWriteVbrTag(lame, infoFrame ? 1 : 0);
+	// lame's default algorithm quality is 3.  under CPU pressure, cheaper
+	// ones are used
+	if (settings.loadStep > 0)
+		lame_set_quality(lame, 3 + settings.loadStep * 2);
 	lame_set_mode(lame, stereo ? STEREO : MONO);
-	lame_set_brate(lame, bitRate);
-	if (lame_init_params(lame) == -1)
+	if (mode == "vbr") {
+		lame_set_VBR(lame, vbr_default);
+		lame_set_VBR_q(lame, settings.mp3VbrQuality);
+	} else if (mode == "abr") {
+		lame_set_VBR(lame, vbr_abr);
+		lame_set_VBR_mean_bitrate_kbps(lame, bitRate);
+	} else {
+		lame_set_brate(lame, bitRate);
+	}
+	if (lame_init_params(lame) == -1) {
+		lame_close(lame);
+		return NULL;
+	}
+
+	return lame;
+}
+}
+
+PreparedEncoder *Mp3Writer::prepareEncoder(long sampleRate, bool stereo, const EncoderSettings &settings) {
+	if (!lameLibrary.load(resolveLame))
+		return NULL;
+
+	lame_global_flags *lame = setUpLame(sampleRate, stereo, true, settings);
+	return lame ? new PreparedLame(lame) : NULL;
+}
+
+bool Mp3Writer::resume(const QString &fn, long sr, bool s) {
+	if (!lameLibrary.load(resolveLame)) {
+		error = lameLibrary.errorString();
+		return false;
+	}
+
+	if (!reopen(fn + ".mp3", sr, s))
+		return false;
+
+	// the ID3 tag tells where the frames start, and the first frame, the
+	// info frame, tells how they have been encoded
+	QByteArray header = readBack(0, 10);
+	const uchar *h = reinterpret_cast<const uchar *>(header.constData());
+	qint64 framesStart = header.size() == 10 && header.startsWith("ID3") ?
+		10 + ((h[6] << 21) | (h[7] << 14) | (h[8] << 7) | h[9]) : 0;
+	QByteArray first = readBack(framesStart, 4);
+	const uchar *f = reinterpret_cast<const uchar *>(first.constData());
+	qint64 size = file.size();
+
+	if (framesStart == 0 || first.size() != 4 || frameLength(f) == 0 || !frameMatches(f, sampleRate, stereo)) {
+		debug(QString("'%1' doesn't match this recording, not continuing it").arg(file.fileName()));
+		file.close();
+		return false;
+	}
+
+	// lame would start the new frames with another info frame.  there's
+	// no way to make it write one for the whole file at the end, so the
+	// new encoder doesn't write any
+	EncoderSettings settings = currentEncoderSettings();
+	lame = setUpLame(sampleRate, stereo, false, settings);
+	qint64 tailStart = qMax(framesStart, size - 8192);
+	int end = framesEnd(readBack(tailStart, size - tailStart));
+	if (!lame || end < 0 || (tailStart + end != size && !file.truncate(tailStart + end))) {
+		file.close();
+		return false;
+	}
+
+	// if the file has been closed before, its info frame covers only
+	// what has been written up to then.  it is turned back into the
+	// silent placeholder a crash would have left, and players estimate
+	// the length
+	int infoSize = frameLength(f);
+	if (!writeAt(framesStart + 4, QByteArray(infoSize - 4, '\0'))) {
+		file.close();
 		return false;
+	}
+
+	tagSize = framesStart;
+	bitRate = settings.mp3Bitrate;
+	preallocate(bitRate * 1000 / 8);
 
 	return true;
 }
@@ -83,21 +413,9 @@ void Mp3Writer::close() {
 		write(dummy1, dummy2, 0, true);
 	}
 
-	AudioFileWriter::close();
+	// only needed if the tags have changed since open()
 	writeTags();
-}
-
-namespace {
-ID3_Frame *getOrCreateTag(ID3_Tag &tag, ID3_FrameID id) {
-	ID3_Frame *frame = tag.Find(id);
-
-	if (!frame) {
-		frame = new ID3_Frame(id);
-		tag.AttachFrame(frame);
-	}
-
-	return frame;
-}
+	AudioFileWriter::close();
 }
 
 void Mp3Writer::writeTags() {
@@ -106,23 +424,16 @@ void Mp3Writer::writeTags() {
 
 	debug("Writing tags to MP3 file");
 
-	QByteArray fn = QFile::encodeName(file.fileName());
-	ID3_Tag tag(fn.constData());
-
-	// NOTE: we don't set ID3FID_TITLE as the file name is already meant to
-	// be a good enough description of the content
-
-	QString str = tagTime.toString("yyyyddMMhhmm");
-	// TODO: the following would be better but doesn't work.  find out why
-	//getOrCreateTag(tag, ID3FID_COMMENT    )->GetField(ID3FN_TEXT)->Set(tagComment.utf16());
-	getOrCreateTag(tag, ID3FID_COMMENT    )->GetField(ID3FN_TEXT)->Set(tagComment.toAscii().constData());
-	getOrCreateTag(tag, ID3FID_CONTENTTYPE)->GetField(ID3FN_TEXT)->Set("(101)Skype Call");
-	getOrCreateTag(tag, ID3FID_YEAR       )->GetField(ID3FN_TEXT)->Set(str.mid(0, 4).toAscii().constData());
-	getOrCreateTag(tag, ID3FID_DATE       )->GetField(ID3FN_TEXT)->Set(str.mid(4, 4).toAscii().constData());
-	getOrCreateTag(tag, ID3FID_TIME       )->GetField(ID3FN_TEXT)->Set(str.mid(8, 4).toAscii().constData());
+	QByteArray tag = renderTag(renderFrames(tagComment, tagTime), tagSize);
+	if (tag.isEmpty()) {
+		debug("WARNING: Tags have grown beyond the space reserved for them, not updating them");
+		return;
+	}
 
-	tag.Update();
-	mustWriteTags = false;
+	// the tag has the same size as the one written in open(), so it can
+	// simply be overwritten
+	if (writeAt(0, tag))
+		mustWriteTags = false;
 }
 
 bool Mp3Writer::write(QByteArray &left, QByteArray &right, long samples, bool flush) {
@@ -131,6 +442,8 @@ bool Mp3Writer::write(QByteArray &left, QByteArray &right, long samples, bool fl
 	// rough upper bound formula taken from lame.h
 	long size = samples + samples / 4 + 7200;
 
+	growPreallocation();
+
 	do {
 		output.resize(size);
 
@@ -177,20 +490,91 @@ bool Mp3Writer::write(QByteArray &left, QByteArray &right, long samples, bool fl
 	output.resize(10240);
 	ret = lame_encode_flush(lame, reinterpret_cast<unsigned char *>(output.data()), output.size());
 
+	if (ret > 0) {
+		output.truncate(ret);
+		file.write(output);
+	}
+
+	bool b = ret >= 0;
+	if (!b)
+		debug(QString("Error while flushing MP3 file, code = %1").arg(ret));
+	else
+		b = writeInfoFrame();
+
 	lame_close(lame);
 	lame = NULL;
 	hasFlushed = true;
 
-	if (ret < 0) {
-		debug(QString("Error while flushing MP3 file, code = %1").arg(ret));
+	return b;
+}
+
+namespace {
+AudioFileWriter *createMp3Writer() {
+	return new Mp3Writer;
+}
+}
+
+WriterFormat Mp3Writer::writerFormat() {
+	WriterFormat format;
+	format.name = "mp3";
+	format.description = "MP3";
+	format.extension = ".mp3";
+	format.capabilities = WriterStereo | WriterTags | WriterSeekable | WriterSegmentable;
+	format.cost = 10;
+	format.create = createMp3Writer;
+	format.prepare = Mp3Writer::prepareEncoder;
+	format.recover = Mp3Writer::recover;
+	format.createReader = NULL;
+	return format;
+}
+
+bool Mp3Writer::recover(const QString &fn) {
+	QFile f(fn);
+	if (!f.open(QIODevice::ReadWrite))
 		return false;
-	}
 
-	if (ret > 0) {
-		output.truncate(ret);
-		file.write(output);
+	// the ID3 tag, the first thing written, tells where the frames start
+	QByteArray header = f.read(10);
+	if (header.size() != 10 || !header.startsWith("ID3"))
+		return false;
+	const uchar *h = reinterpret_cast<const uchar *>(header.constData());
+	qint64 framesStart = 10 + ((h[6] << 21) | (h[7] << 14) | (h[8] << 7) | h[9]);
+	qint64 size = f.size();
+	if (size <= framesStart)
+		return f.resize(framesStart);
+
+	// the frames lame emitted before the crash are complete, except maybe
+	// for the last one.  the info frame at the start is left as the
+	// silent placeholder it still is, players estimate the length then
+	qint64 tailStart = qMax(framesStart, size - 8192);
+	if (!f.seek(tailStart))
+		return false;
+	QByteArray tail = f.read(size - tailStart);
+	int end = framesEnd(tail);
+	if (end < 0)
+		return false;
+	if (end == tail.size())
+		return true;
+
+	debug(QString("Cutting off %1 bytes of an incomplete frame from '%2'").arg(tail.size() - end).arg(fn));
+	return f.resize(tailStart + end);
+}
+
+bool Mp3Writer::writeInfoFrame() {
+	// the placeholder frame lame emitted at the start of the stream,
+	// right after the ID3 tag, has the same size as the final one
+	size_t size = lame_get_lametag_frame(lame, NULL, 0);
+	if (size == 0)
+		return true;
+
+	QByteArray frame(size, '\0');
+	size = lame_get_lametag_frame(lame, reinterpret_cast<unsigned char *>(frame.data()), frame.size());
+	if (size == 0 || size > (size_t)frame.size()) {
+		debug("Could not get the Xing/LAME info frame from lame");
+		return false;
 	}
+	frame.truncate(size);
 
-	return true;
+	return writeAt(tagSize, frame);
 }
 
@@ -29,6 +29,8 @@
 
 class QString;
 class QByteArray;
+class PreparedEncoder;
+struct EncoderSettings;
 typedef struct lame_global_struct lame_global_flags;
 
 class Mp3Writer : public AudioFileWriter {
@@ -37,15 +39,26 @@ public:
 	virtual ~Mp3Writer();
 
 	virtual bool open(const QString &, long, bool);
+	virtual bool resume(const QString &, long, bool);
 	virtual void close();
 	virtual bool write(QByteArray &, QByteArray &, long, bool = false);
 
+	// repairs a file that has been left unfinished by a crash, looking
+	// only at its beginning and its end
+	static bool recover(const QString &);
+	// sets up an encoder with the current preferences, for the pool
+	static PreparedEncoder *prepareEncoder(long, bool, const EncoderSettings &);
+	// describes this writer for the format registry, see writer.h
+	static WriterFormat writerFormat();
+
 private:
 	void writeTags();
+	bool writeInfoFrame();
 
 private:
 	lame_global_flags *lame;
 	int bitRate;
+	int tagSize;
 	bool hasFlushed;
 
 	DISABLE_COPY_AND_ASSIGNMENT(Mp3Writer);
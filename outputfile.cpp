@@ -0,0 +1,719 @@
+/*
+	Skype Call Recorder
+	Copyright 2008 - 2009 by jlh (jlh at gmx dot ch)
+
+	This program is free software; you can redistribute it and/or modify it
+	under the terms of the GNU General Public License as published by the
+	Free Software Foundation; either version 2 of the License, version 3 of
+	the License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful, but
+	WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+	General Public License for more details.
+
+	You should have received a copy of the GNU General Public License along
+	with this program; if not, write to the Free Software Foundation, Inc.,
+	51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+	The GNU General Public License version 2 is included with the source of
+	this program under the file name COPYING.  You can also get a copy on
+	http://www.fsf.org/
+*/
+
+
+#include <QFile>
+#include <QFileInfo>
+#include <QList>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QThread>
+#include <QWaitCondition>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "outputfile.h"
+#include "common.h"
+#include "preferences.h"
+#include "uringbackend.h"
+#include "encryptingbackend.h"
+#include "digest.h"
+#include "recovery.h"
+
+// OutputBackend
+
+bool OutputBackend::writeFully(int fd, qint64 pos, const char *data, qint64 size) {
+	while (size > 0) {
+		ssize_t ret = pwrite(fd, data, size, pos);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		data += ret;
+		pos += ret;
+		size -= ret;
+	}
+
+	return true;
+}
+
+bool OutputBackend::reserveRange(int fd, qint64 offset, qint64 length) {
+#ifdef FALLOC_FL_KEEP_SIZE
+	// KEEP_SIZE reserves the blocks without changing the file size, so
+	// readers never see unwritten data at the end of the file
+	return fallocate(fd, FALLOC_FL_KEEP_SIZE, offset, length) == 0;
+#else
+	Q_UNUSED(fd);
+	Q_UNUSED(offset);
+	Q_UNUSED(length);
+	return false;
+#endif
+}
+
+namespace {
+int openForWriting(const QString &fn, bool truncate = true) {
+	return ::open(QFile::encodeName(fn).constData(), O_WRONLY | O_CREAT | (truncate ? O_TRUNC : 0) | O_CLOEXEC, 0666);
+}
+
+// does everything right away, in the calling thread
+
+class SyncBackend : public OutputBackend {
+public:
+	SyncBackend() : fd(-1) { }
+	~SyncBackend() { close(); }
+
+	bool open(const QString &fn) {
+		fd = openForWriting(fn);
+		return fd >= 0;
+	}
+
+	bool reopen(const QString &fn) {
+		fd = openForWriting(fn, false);
+		return fd >= 0;
+	}
+
+	bool write(qint64 pos, const QByteArray &data, bool) {
+		return writeFully(fd, pos, data.constData(), data.size());
+	}
+
+	bool sync() {
+		return fdatasync(fd) == 0;
+	}
+
+	bool reserve(qint64 offset, qint64 length) {
+		return reserveRange(fd, offset, length);
+	}
+
+	bool truncate(qint64 size) {
+		return ftruncate(fd, size) == 0;
+	}
+
+	bool close() {
+		if (fd < 0)
+			return true;
+		bool b = ::close(fd) == 0;
+		fd = -1;
+		return b;
+	}
+
+private:
+	int fd;
+};
+
+// hands all operations to a thread of its own, which carries them out in
+// order with pwrite().  the caller only blocks if too much data is queued
+
+class ThreadedBackend : public OutputBackend, private QThread {
+public:
+	ThreadedBackend() : fd(-1), queuedBytes(0), failed(false), running(false) { }
+	~ThreadedBackend() { close(); }
+
+	bool open(const QString &fn) {
+		return startWorker(openForWriting(fn));
+	}
+
+	bool reopen(const QString &fn) {
+		return startWorker(openForWriting(fn, false));
+	}
+
+	bool write(qint64 pos, const QByteArray &data, bool) {
+		// the data is implicitly shared, so this doesn't copy it
+		return enqueue(Operation(Operation::Write, pos, data));
+	}
+
+	bool sync() {
+		return enqueue(Operation(Operation::Sync));
+	}
+
+	bool reserve(qint64 offset, qint64 length) {
+		// this is rare and cheap, and the caller wants to know whether
+		// it's supported at all
+		return reserveRange(fd, offset, length);
+	}
+
+	bool truncate(qint64 size) {
+		return enqueue(Operation(Operation::Truncate, size));
+	}
+
+	bool close() {
+		if (!running)
+			return true;
+		enqueue(Operation(Operation::Close));
+		wait();
+		running = false;
+		bool b = ::close(fd) == 0;
+		fd = -1;
+		return b && !failed;
+	}
+
+protected:
+	void run() {
+		for (;;) {
+			QMutexLocker locker(&mutex);
+			while (queue.isEmpty())
+				wakeWorker.wait(&mutex);
+			Operation op = queue.takeFirst();
+			locker.unlock();
+
+			bool ok = true;
+			if (op.type == Operation::Write)
+				ok = writeFully(fd, op.pos, op.data.constData(), op.data.size());
+			else if (op.type == Operation::Sync)
+				ok = fdatasync(fd) == 0;
+			else if (op.type == Operation::Truncate)
+				ok = ftruncate(fd, op.pos) == 0;
+
+			locker.relock();
+			queuedBytes -= op.data.size();
+			if (!ok)
+				failed = true;
+			wakeCaller.wakeAll();
+
+			if (op.type == Operation::Close)
+				return;
+		}
+	}
+
+private:
+	bool startWorker(int f) {
+		fd = f;
+		if (fd < 0)
+			return false;
+		running = true;
+		start();
+		return true;
+	}
+
+	struct Operation {
+		enum Type { Write, Sync, Truncate, Close };
+		Operation(Type t, qint64 p = 0, const QByteArray &d = QByteArray()) : type(t), pos(p), data(d) { }
+		Type type;
+		qint64 pos;
+		QByteArray data;
+	};
+
+	bool enqueue(const Operation &op) {
+		// backpressure, so a stalled disk can't eat up all memory
+		const qint64 maxQueuedBytes = 16 * 1024 * 1024;
+
+		QMutexLocker locker(&mutex);
+		while (queuedBytes > maxQueuedBytes && !failed)
+			wakeCaller.wait(&mutex);
+		queue.append(op);
+		queuedBytes += op.data.size();
+		wakeWorker.wakeOne();
+		return !failed;
+	}
+
+private:
+	int fd;
+	QMutex mutex;
+	QWaitCondition wakeWorker;
+	QWaitCondition wakeCaller;
+	QList<Operation> queue;
+	qint64 queuedBytes;
+	bool failed;
+	bool running;
+};
+
+// maps the file in large windows that map() hands out directly.  plain
+// writes, like header updates, use pwrite(), which is coherent with the
+// mapping since both go through the page cache
+
+class MmapBackend : public OutputBackend {
+public:
+	MmapBackend() : fd(-1), window(NULL), windowStart(0), windowSize(0), fileSize(0), end(0) { }
+	~MmapBackend() { close(); }
+
+	bool open(const QString &fn) {
+		// a shared writable mapping needs the file to be readable too
+		fd = ::open(QFile::encodeName(fn).constData(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+		return fd >= 0;
+	}
+
+	bool reopen(const QString &fn) {
+		fd = ::open(QFile::encodeName(fn).constData(), O_RDWR | O_CLOEXEC);
+		struct stat st;
+		if (fd < 0 || fstat(fd, &st) != 0)
+			return false;
+		fileSize = end = st.st_size;
+		return true;
+	}
+
+	bool write(qint64 pos, const QByteArray &data, bool) {
+		if (!writeFully(fd, pos, data.constData(), data.size()))
+			return false;
+		extend(pos + data.size());
+		if (end > fileSize)
+			fileSize = end;
+		return true;
+	}
+
+	bool sync() {
+		if (window && msync(window, windowSize, MS_SYNC) != 0)
+			return false;
+		return fdatasync(fd) == 0;
+	}
+
+	bool reserve(qint64 offset, qint64 length) {
+		return reserveRange(fd, offset, length);
+	}
+
+	bool truncate(qint64 size) {
+		if (ftruncate(fd, size) != 0)
+			return false;
+		fileSize = end = size;
+		return true;
+	}
+
+	bool close() {
+		if (fd < 0)
+			return true;
+		unmapWindow();
+		// the file has been grown ahead of the data, cut that off
+		bool b = ftruncate(fd, end) == 0;
+		b = ::close(fd) == 0 && b;
+		fd = -1;
+		return b;
+	}
+
+	char *map(qint64 pos, qint64 size) {
+		if (!window || pos < windowStart || pos + size > windowStart + windowSize) {
+			unmapWindow();
+
+			const qint64 pageSize = sysconf(_SC_PAGESIZE);
+			qint64 start = pos - pos % pageSize;
+			qint64 length = pos + size - start;
+			if (length < windowLength)
+				length = windowLength;
+			length = (length + pageSize - 1) / pageSize * pageSize;
+
+			// with the blocks allocated up front, a full disk is
+			// noticed here, rather than by a SIGBUS when touching the
+			// mapping.  file systems that can't do it are risked
+			if (!reserveRange(fd, start, length) && errno == ENOSPC)
+				return NULL;
+
+			void *p = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, start);
+			if (p == MAP_FAILED)
+				return NULL;
+
+			window = static_cast<char *>(p);
+			windowStart = start;
+			windowSize = length;
+			madvise(window, windowSize, MADV_SEQUENTIAL);
+		}
+
+		// memory past the end of the file can't be touched, so the file
+		// is grown ahead of the data.  this is done in steps small enough
+		// that after a crash, not much more than the data is left over
+		if (pos + size > fileSize) {
+			qint64 newSize = (pos + size + sizeStep - 1) / sizeStep * sizeStep;
+			if (ftruncate(fd, newSize) != 0)
+				return NULL;
+			fileSize = newSize;
+		}
+
+		extend(pos + size);
+		return window + (pos - windowStart);
+	}
+
+private:
+	void extend(qint64 e) {
+		if (e > end)
+			end = e;
+	}
+
+	void unmapWindow() {
+		if (!window)
+			return;
+		// get the finished window on its way to the disk now, instead of
+		// letting dirty pages pile up until the kernel decides to write
+		msync(window, windowSize, MS_ASYNC);
+#ifdef SYNC_FILE_RANGE_WRITE
+		sync_file_range(fd, windowStart, windowSize, SYNC_FILE_RANGE_WRITE);
+#endif
+		munmap(window, windowSize);
+		window = NULL;
+	}
+
+private:
+	static const qint64 windowLength = 16 * 1024 * 1024;
+	static const qint64 sizeStep = 256 * 1024;
+
+	int fd;
+	char *window;
+	qint64 windowStart;
+	qint64 windowSize;
+	qint64 fileSize;
+	qint64 end;
+};
+}
+
+OutputBackend *createOutputBackend(const QString &name) {
+	if (name == "sync")
+		return new SyncBackend;
+	if (name == "thread")
+		return new ThreadedBackend;
+	if (name == "mmap")
+		return new MmapBackend;
+
+	// "uring" and "auto" both fall back to a thread if io_uring isn't
+	// available on this kernel or hasn't been compiled in
+	OutputBackend *backend = createUringBackend();
+	if (backend)
+		return backend;
+	if (name == "uring")
+		debug("io_uring is not available, using a thread for output instead");
+	return new ThreadedBackend;
+}
+
+// OutputFile
+
+OutputFile::OutputFile() :
+	backend(NULL),
+	digester(NULL),
+	position(0),
+	end(0),
+	written(0),
+	pendingPos(0),
+	bufferMapped(false),
+	bufferSize(0),
+	syncPolicy(SyncNone),
+	syncInterval(0),
+	writeCount(0),
+	syncCount(0)
+{
+}
+
+OutputFile::~OutputFile() {
+	close();
+}
+
+bool OutputFile::open() {
+	// the recovery at startup may be repairing a file of the same name,
+	// like the output of a transcode job that is started over
+	waitForRecovery(name);
+
+	if (backendName.isEmpty())
+		backend = createOutputBackend(preferences.get(Pref::OutputBackend).toString());
+	else
+		backend = createOutputBackend(backendName);
+	bool encrypt = preferences.get(Pref::OutputEncryption).toBool();
+	// the digests are of what ends up on the disk, so they go below the
+	// encryption
+	digester = NULL;
+	if (preferences.get(Pref::OutputDigests).toBool())
+		backend = digester = new DigestBackend(backend);
+	position = end = written = 0;
+	applyPreferences();
+
+	if (encrypt) {
+		QString error;
+		OutputBackend *b = createEncryptingBackend(backend, error);
+		if (!b) {
+			debug(QString("Cannot encrypt '%1': %2").arg(name, error));
+			delete backend;
+			backend = NULL;
+			digester = NULL;
+			return false;
+		}
+		backend = b;
+	}
+
+	journalFileOpened(name);
+	if (!backend->open(temporaryName(name))) {
+		delete backend;
+		backend = NULL;
+		digester = NULL;
+		journalFileClosed(name);
+		return false;
+	}
+
+	return true;
+}
+
+bool OutputFile::reopen() {
+	if (preferences.get(Pref::OutputEncryption).toBool()) {
+		debug(QString("Cannot continue '%1', encrypted files can only be written from the start").arg(name));
+		return false;
+	}
+
+	// the recovery at startup may be repairing this very file
+	waitForRecovery(name);
+
+	QString tmp = temporaryName(name);
+	journalFileOpened(name);
+	if (!QFile::exists(tmp) && ::rename(QFile::encodeName(name).constData(), QFile::encodeName(tmp).constData()) != 0) {
+		journalFileClosed(name);
+		return false;
+	}
+
+	if (backendName.isEmpty())
+		backend = createOutputBackend(preferences.get(Pref::OutputBackend).toString());
+	else
+		backend = createOutputBackend(backendName);
+	digester = NULL;
+
+	if (!backend->reopen(tmp)) {
+		debug(QString("Cannot continue '%1'").arg(name));
+		delete backend;
+		backend = NULL;
+		if (::rename(QFile::encodeName(tmp).constData(), QFile::encodeName(name).constData()) == 0)
+			journalFileClosed(name);
+		return false;
+	}
+
+	// digests written by an earlier close() don't match anymore
+	QFile::remove(digestName(name));
+
+	position = end = written = QFileInfo(tmp).size();
+	applyPreferences();
+	return true;
+}
+
+void OutputFile::applyPreferences() {
+	pending = QByteArray();
+	writeCount = syncCount = 0;
+
+	bufferSize = preferences.get(Pref::OutputBufferKilobytes).toInt() * 1024;
+	QString policy = preferences.get(Pref::OutputSyncPolicy).toString();
+	if (policy == "interval")
+		syncPolicy = SyncInterval;
+	else if (policy == "close")
+		syncPolicy = SyncClose;
+	else
+		syncPolicy = SyncNone;
+	syncInterval = preferences.get(Pref::OutputSyncSeconds).toInt() * 1000;
+	lastSync.start();
+}
+
+qint64 OutputFile::write(const char *data, qint64 size) {
+	return write(QByteArray(data, size));
+}
+
+qint64 OutputFile::write(const QByteArray &data) {
+	if (!backend)
+		return -1;
+
+	bool b = true;
+	if (!pending.isEmpty() && position != pendingPos + pending.size())
+		b = flushBuffer();
+
+	if (pending.isEmpty() && data.size() >= bufferSize) {
+		// too large to be worth buffering
+		b = issue(position, data) && b;
+	} else {
+		if (pending.isEmpty()) {
+			pendingPos = position;
+			pending.reserve(bufferSize);
+		}
+		pending.append(data);
+		if (pending.size() >= bufferSize)
+			b = flushBuffer() && b;
+	}
+
+	position += data.size();
+	if (position > end)
+		end = position;
+	return b ? data.size() : -1;
+}
+
+char *OutputFile::buffer(qint64 size) {
+	if (!backend)
+		return NULL;
+
+	char *p = backend->map(position, size);
+	bufferMapped = p != NULL;
+	if (p)
+		return flushBuffer() ? p : NULL;
+
+	// otherwise the caller fills the write buffer directly
+	if (!pending.isEmpty() && position != pendingPos + pending.size() && !flushBuffer())
+		return NULL;
+	if (pending.isEmpty()) {
+		pendingPos = position;
+		pending.reserve(qMax<qint64>(bufferSize, size));
+	}
+
+	int offset = pending.size();
+	pending.resize(offset + size);
+	return pending.data() + offset;
+}
+
+bool OutputFile::commitBuffer(qint64 size) {
+	position += size;
+	if (position > end)
+		end = position;
+
+	if (bufferMapped) {
+		bufferMapped = false;
+		if (position > written)
+			written = position;
+		return true;
+	}
+
+	if (pending.size() >= bufferSize)
+		return flushBuffer();
+	return true;
+}
+
+bool OutputFile::writeAt(qint64 pos, const QByteArray &data) {
+	if (!backend)
+		return false;
+
+	// buffered data that overlaps must go first, so it doesn't overwrite
+	// this later on
+	bool b = true;
+	if (!pending.isEmpty() && pos < pendingPos + pending.size() && pos + data.size() > pendingPos)
+		b = flushBuffer();
+
+	b = issue(pos, data) && b;
+	if (pos + data.size() > end)
+		end = pos + data.size();
+	return b;
+}
+
+bool OutputFile::seek(qint64 pos) {
+	if (!backend || pos < 0)
+		return false;
+	position = pos;
+	return true;
+}
+
+bool OutputFile::flush() {
+	return backend && flushBuffer();
+}
+
+bool OutputFile::sync() {
+	return backend && flushBuffer() && syncNow();
+}
+
+bool OutputFile::reserve(qint64 offset, qint64 length) {
+	return backend && backend->reserve(offset, length);
+}
+
+bool OutputFile::truncate(qint64 size) {
+	if (!backend || !flushBuffer() || !backend->truncate(size))
+		return false;
+	end = written = size;
+	if (position > end)
+		position = end;
+	return true;
+}
+
+bool OutputFile::close() {
+	if (!backend)
+		return true;
+
+	bool b = flushBuffer();
+	if (syncPolicy != SyncNone)
+		b = syncNow() && b;
+	b = backend->close() && b;
+	if (!b)
+		debug(QString("Error while writing '%1'").arg(name));
+	debug(QString("'%1' took %2 writes and %3 syncs").arg(name).arg(writeCount).arg(syncCount));
+	QString digests;
+	if (digester)
+		digests = digester->report(QFileInfo(name).fileName());
+	delete backend;
+	backend = NULL;
+	digester = NULL;
+
+	// even if writing failed, whatever made it to the disk is better off
+	// under the real name than hidden.  rename() replaces an existing
+	// file atomically, unlike QFile::rename()
+	if (::rename(QFile::encodeName(temporaryName(name)).constData(), QFile::encodeName(name).constData()) != 0) {
+		debug(QString("Could not rename '%1' to '%2'").arg(temporaryName(name)).arg(name));
+		// leave it in the journal, the next start will try again
+		return false;
+	}
+
+	journalFileClosed(name);
+	if (!digests.isEmpty())
+		writeDigests(digests);
+	return b;
+}
+
+QString OutputFile::digestName(const QString &fn) {
+	return fn + ".digests";
+}
+
+bool OutputFile::remove(const QString &fn) {
+	QFile::remove(digestName(fn));
+	return QFile::remove(fn);
+}
+
+void OutputFile::writeDigests(const QString &digests) {
+	QString fn = digestName(name);
+	QFile file(temporaryName(fn));
+	QByteArray data = digests.toUtf8();
+	if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate) || file.write(data) != data.size()) {
+		debug(QString("Cannot write digests to '%1'").arg(fn));
+		return;
+	}
+	file.close();
+
+	if (::rename(QFile::encodeName(file.fileName()).constData(), QFile::encodeName(fn).constData()) != 0)
+		debug(QString("Cannot write digests to '%1'").arg(fn));
+}
+
+QString OutputFile::temporaryName(const QString &fn) {
+	QFileInfo info(fn);
+	return info.path() + "/." + info.fileName() + ".part";
+}
+
+bool OutputFile::flushBuffer() {
+	if (pending.isEmpty())
+		return true;
+
+	// the backend may hold on to the data, so start a new buffer instead
+	// of reusing this one
+	QByteArray data = pending;
+	pending = QByteArray();
+	return issue(pendingPos, data);
+}
+
+bool OutputFile::issue(qint64 pos, const QByteArray &data) {
+	bool b = backend->write(pos, data, pos < written);
+	writeCount++;
+	if (pos + data.size() > written)
+		written = pos + data.size();
+
+	if (syncPolicy == SyncInterval && lastSync.elapsed() >= syncInterval)
+		b = syncNow() && b;
+
+	return b;
+}
+
+bool OutputFile::syncNow() {
+	syncCount++;
+	lastSync.restart();
+	return backend->sync();
+}
+
@@ -0,0 +1,172 @@
+/*
+	Skype Call Recorder
+	Copyright 2008 - 2009 by jlh (jlh at gmx dot ch)
+
+	This program is free software; you can redistribute it and/or modify it
+	under the terms of the GNU General Public License as published by the
+	Free Software Foundation; either version 2 of the License, version 3 of
+	the License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful, but
+	WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+	General Public License for more details.
+
+	You should have received a copy of the GNU General Public License along
+	with this program; if not, write to the Free Software Foundation, Inc.,
+	51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+	The GNU General Public License version 2 is included with the source of
+	this program under the file name COPYING.  You can also get a copy on
+	http://www.fsf.org/
+*/
+
+
+#ifndef OUTPUTFILE_H
+#define OUTPUTFILE_H
+
+#include <QByteArray>
+#include <QString>
+#include <QTime>
+
+#include "common.h"
+
+// the low level part of writing a file.  backends only know positional
+// writes, and may carry them out asynchronously.  errors of asynchronous
+// operations are reported by the next call, or by close() at the latest
+
+class DigestBackend;
+
+class OutputBackend {
+public:
+	OutputBackend() { }
+	virtual ~OutputBackend() { }
+
+	// creates or truncates the file
+	virtual bool open(const QString &) = 0;
+	// opens an existing file without truncating it, for appending to it.
+	// backends that can't do that return false
+	virtual bool reopen(const QString &) { return false; }
+	// writes data at the given offset.  the last argument is true if the
+	// data overwrites something that has been written before, in which
+	// case it must not be reordered with earlier writes
+	virtual bool write(qint64, const QByteArray &, bool) = 0;
+	// starts flushing everything written so far to the disk
+	virtual bool sync() = 0;
+	// preallocates the given range without changing the file size
+	virtual bool reserve(qint64, qint64) = 0;
+	// sets the file size, after all earlier writes have completed
+	virtual bool truncate(qint64) = 0;
+	// waits for everything to complete and closes the file
+	virtual bool close() = 0;
+	// returns memory the given range of the file is mapped to, so that the
+	// caller can fill it in place, or NULL if the backend doesn't map
+	// files.  the whole range must be filled, and the memory is only valid
+	// until the next call
+	virtual char *map(qint64, qint64) { return NULL; }
+
+protected:
+	static bool writeFully(int, qint64, const char *, qint64);
+	static bool reserveRange(int, qint64, qint64);
+
+	DISABLE_COPY_AND_ASSIGNMENT(OutputBackend);
+};
+
+// creates a backend by name, as used by Pref::OutputBackend.  "auto" picks
+// the best one available.  "mmap" is only useful for writers that fill
+// OutputFile::buffer() directly
+
+OutputBackend *createOutputBackend(const QString &);
+
+// the file AudioFileWriter and its subclasses write to.  this is used like a
+// write-only QFile, with a current position that is advanced by write() and
+// can be moved with seek(), but the actual I/O is done by a backend.
+// sequential writes are collected in a buffer of Pref::OutputBufferKilobytes
+// before they are handed to the backend, and Pref::OutputSyncPolicy decides
+// when the data is flushed to the disk.  while the file is open, it is
+// written under a hidden temporary name in the same directory, and only
+// renamed to its real name by close(), so that nobody picks up a half
+// written file.  files are listed in the recovery journal while they are
+// open.  with Pref::OutputEncryption, everything is encrypted on the way to
+// the backend, see encryptingbackend.h.  with Pref::OutputDigests, digests of
+// the file are computed on the way as well, and written next to it by
+// close(), see digest.h
+
+class OutputFile {
+public:
+	OutputFile();
+	~OutputFile();
+
+	void setFileName(const QString &n) { name = n; }
+	QString fileName() const { return name; }
+	// overrides Pref::OutputBackend for this file, must be set before open()
+	void setBackendName(const QString &n) { backendName = n; }
+	// the name the given file has while it is being written
+	static QString temporaryName(const QString &);
+	// the name of the file with the digests of the given file
+	static QString digestName(const QString &);
+	// removes the given file along with its digest file
+	static bool remove(const QString &);
+
+	bool open();
+	// opens the file as left by an earlier open(), to continue writing it
+	// after a restart.  the file may have been closed, or still be under
+	// its temporary name after a crash, in which case recovery is waited
+	// for.  the position is at the end of the file.  encrypted files can't
+	// be continued, and neither digests nor encryption apply
+	bool reopen();
+	bool isOpen() const { return backend != NULL; }
+	qint64 write(const char *, qint64);
+	qint64 write(const QByteArray &);
+	// returns a buffer for the given number of bytes at the current
+	// position, which must be filled completely and then be written with
+	// commitBuffer().  with the mmap backend, this points right into the
+	// file and nothing is copied
+	char *buffer(qint64);
+	bool commitBuffer(qint64);
+	// writes at the given offset without moving the current position
+	bool writeAt(qint64, const QByteArray &);
+	qint64 pos() const { return position; }
+	bool seek(qint64);
+	qint64 size() const { return end; }
+	// hands buffered data to the backend
+	bool flush();
+	// flushes and starts writing everything to the disk
+	bool sync();
+	bool reserve(qint64, qint64);
+	bool truncate(qint64);
+	bool close();
+
+private:
+	void applyPreferences();
+	bool flushBuffer();
+	bool issue(qint64, const QByteArray &);
+	bool syncNow();
+	void writeDigests(const QString &);
+
+private:
+	enum SyncPolicy { SyncNone, SyncInterval, SyncClose };
+
+	QString name;
+	QString backendName;
+	OutputBackend *backend;
+	DigestBackend *digester;
+	qint64 position;
+	qint64 end;
+	// the end of what has been handed to the backend
+	qint64 written;
+	QByteArray pending;
+	qint64 pendingPos;
+	bool bufferMapped;
+	qint64 bufferSize;
+	SyncPolicy syncPolicy;
+	int syncInterval;
+	QTime lastSync;
+	int writeCount;
+	int syncCount;
+
+	DISABLE_COPY_AND_ASSIGNMENT(OutputFile);
+};
+
+#endif
+
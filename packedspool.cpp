@@ -0,0 +1,735 @@
+/*
+	Skype Call Recorder
+	Copyright 2008 - 2009 by jlh (jlh at gmx dot ch)
+
+	This program is free software; you can redistribute it and/or modify it
+	under the terms of the GNU General Public License as published by the
+	Free Software Foundation; either version 2 of the License, version 3 of
+	the License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful, but
+	WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+	General Public License for more details.
+
+	You should have received a copy of the GNU General Public License along
+	with this program; if not, write to the Free Software Foundation, Inc.,
+	51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+	The GNU General Public License version 2 is included with the source of
+	this program under the file name COPYING.  You can also get a copy on
+	http://www.fsf.org/
+*/
+
+#include <QByteArray>
+#include <QDateTime>
+#include <QFile>
+#include <QString>
+#include <cstdlib>
+#include <cstring>
+
+#include "packedspool.h"
+#include "common.h"
+#include "digest.h"
+
+namespace {
+const int headerSize = 32;
+const int blockHeaderSize = 24;
+const int partitionSize = 256;
+// a residual of 16 bit samples at order 3 is at most 8 * 32768, which is
+// below 2^20 after the mapping to unsigned
+const int escapeLength = 32;
+const int rawBits = 20;
+const int maxRiceParameter = rawBits - 1;
+
+void putUInt16(char *d, quint16 i) {
+	d[0] = (char)i;
+	d[1] = (char)(i >> 8);
+}
+
+void putUInt32(char *d, quint32 i) {
+	putUInt16(d, (quint16)i);
+	putUInt16(d + 2, (quint16)(i >> 16));
+}
+
+void putUInt64(char *d, quint64 i) {
+	putUInt32(d, (quint32)i);
+	putUInt32(d + 4, (quint32)(i >> 32));
+}
+
+quint32 getUInt16(const char *d) {
+	const uchar *u = reinterpret_cast<const uchar *>(d);
+	return u[0] | (u[1] << 8);
+}
+
+quint32 getUInt32(const char *d) {
+	return getUInt16(d) | (getUInt16(d + 2) << 16);
+}
+
+quint64 getUInt64(const char *d) {
+	return getUInt32(d) | ((quint64)getUInt32(d + 4) << 32);
+}
+
+struct Header {
+	int channels;
+	long sampleRate;
+	long blockSize;
+	qint64 created;
+};
+
+QByteArray makeHeader(const Header &header) {
+	QByteArray array(headerSize, 0);
+	char *d = array.data();
+	memcpy(d, "PCMZ", 4);
+	putUInt16(d + 4, 1);
+	putUInt16(d + 6, header.channels);
+	putUInt32(d + 8, header.sampleRate);
+	putUInt32(d + 12, header.blockSize);
+	putUInt64(d + 16, header.created);
+	return array;
+}
+
+bool parseHeader(const QByteArray &array, Header &header) {
+	if (array.size() != headerSize || !array.startsWith("PCMZ"))
+		return false;
+
+	const char *d = array.constData();
+	header.channels = getUInt16(d + 6);
+	header.sampleRate = getUInt32(d + 8);
+	header.blockSize = getUInt32(d + 12);
+	header.created = getUInt64(d + 16);
+
+	// a block is a second, so this is plenty
+	return getUInt16(d + 4) == 1 && (header.channels == 1 || header.channels == 2) &&
+		header.sampleRate > 0 && header.blockSize > 0 && header.blockSize <= 1024 * 1024;
+}
+
+// the most a block of the given size can take, with every residual escaped
+qint64 maxPayloadSize(long samples, int channels) {
+	qint64 bits = 2 + 3 * 16 + (samples / partitionSize + 1) * 5 + (qint64)samples * (escapeLength + rawBits);
+	return channels * (bits / 8 + 1);
+}
+
+struct BlockHeader {
+	qint64 payloadSize;
+	qint64 firstSample;
+	long samples;
+	quint32 crc;
+};
+
+bool parseBlockHeader(const QByteArray &array, const Header &header, BlockHeader &block) {
+	if (array.size() != blockHeaderSize || !array.startsWith("BLKZ"))
+		return false;
+
+	const char *d = array.constData();
+	block.payloadSize = getUInt32(d + 4);
+	block.firstSample = getUInt64(d + 8);
+	block.samples = getUInt32(d + 16);
+	block.crc = getUInt32(d + 20);
+
+	return block.samples > 0 && block.samples <= header.blockSize &&
+		block.payloadSize <= maxPayloadSize(block.samples, header.channels) && block.firstSample >= 0;
+}
+
+quint32 blockChecksum(const char *header, const char *payload, qint64 size) {
+	return crc32c(crc32c(0, header + 4, 16), payload, size);
+}
+
+// returns where the last complete block of the file ends, and the number of
+// samples up to there.  blocks are appended one after the other, so only the
+// last one may have been cut off by a crash, and only its checksum is checked
+qint64 intactSize(QFile &f, const Header &header, qint64 &samples) {
+	qint64 pos = headerSize;
+	qint64 previousPos = headerSize;
+	qint64 previousSamples = 0;
+	QByteArray lastHeader;
+	BlockHeader last;
+	samples = 0;
+
+	for (;;) {
+		BlockHeader block;
+		QByteArray h = f.seek(pos) ? f.read(blockHeaderSize) : QByteArray();
+		if (!parseBlockHeader(h, header, block) || pos + blockHeaderSize + block.payloadSize > f.size())
+			break;
+
+		previousPos = pos;
+		previousSamples = samples;
+		lastHeader = h;
+		last = block;
+		pos += blockHeaderSize + block.payloadSize;
+		samples = block.firstSample + block.samples;
+	}
+
+	if (pos > headerSize) {
+		QByteArray payload = f.seek(previousPos + blockHeaderSize) ? f.read(last.payloadSize) : QByteArray();
+		if (payload.size() != last.payloadSize ||
+				blockChecksum(lastHeader.constData(), payload.constData(), payload.size()) != last.crc) {
+			samples = previousSamples;
+			return previousPos;
+		}
+	}
+
+	return pos;
+}
+
+// writes up to 32 bits at a time, most significant bit first.  the caller
+// makes sure there is enough room
+class BitWriter {
+public:
+	BitWriter(char *o) : out(reinterpret_cast<uchar *>(o)), start(out), buffer(0), bits(0) { }
+
+	inline void put(quint32 value, int count) {
+		buffer = (buffer << count) | value;
+		bits += count;
+		if (bits >= 32) {
+			bits -= 32;
+			quint32 word = (quint32)(buffer >> bits);
+			out[0] = (uchar)(word >> 24);
+			out[1] = (uchar)(word >> 16);
+			out[2] = (uchar)(word >> 8);
+			out[3] = (uchar)word;
+			out += 4;
+		}
+	}
+
+	// pads the last byte and returns the number of bytes written
+	qint64 finish() {
+		while (bits >= 8) {
+			bits -= 8;
+			*out++ = (uchar)(buffer >> bits);
+		}
+		if (bits > 0)
+			*out++ = (uchar)(buffer << (8 - bits));
+		bits = 0;
+		return out - start;
+	}
+
+private:
+	uchar *out;
+	uchar *start;
+	quint64 buffer;
+	int bits;
+};
+
+// reads what BitWriter has written.  reading past the end yields zeros and
+// is reported by overrun()
+class BitReader {
+public:
+	BitReader(const char *d, qint64 size) :
+		data(reinterpret_cast<const uchar *>(d)), end(data + size), buffer(0), bits(0), padding(0) { }
+
+	// between 1 and 32 bits
+	inline quint32 get(int count) {
+		refill();
+		quint32 value = (quint32)(buffer >> (64 - count));
+		buffer <<= count;
+		bits -= count;
+		return value;
+	}
+
+	inline quint32 getRice(int k) {
+		refill();
+		// the buffer holds more than escapeLength bits after refill()
+		int zeros = buffer ? __builtin_clzll(buffer) : 64;
+		if (zeros >= escapeLength) {
+			buffer <<= escapeLength;
+			bits -= escapeLength;
+			return get(rawBits);
+		}
+
+		buffer <<= zeros + 1;
+		bits -= zeros + 1;
+		return k ? ((quint32)zeros << k) | get(k) : (quint32)zeros;
+	}
+
+	bool overrun() const { return padding > bits; }
+
+private:
+	// keeps at least 57 bits in the buffer, aligned to its top
+	inline void refill() {
+		while (bits <= 56) {
+			quint64 byte = 0;
+			if (data < end)
+				byte = *data++;
+			else
+				padding += 8;
+			buffer |= byte << (56 - bits);
+			bits += 8;
+		}
+	}
+
+private:
+	const uchar *data;
+	const uchar *end;
+	quint64 buffer;
+	int bits;
+	int padding;
+};
+
+inline quint32 zigzag(qint32 e) {
+	return ((quint32)e << 1) ^ (quint32)(e >> 31);
+}
+
+inline qint32 unzigzag(quint32 u) {
+	return (qint32)(u >> 1) ^ -(qint32)(u & 1);
+}
+
+// picks the order whose residuals have the smallest sum of magnitudes.  the
+// loop has no branches and works on one channel at a time, so compilers can
+// vectorize it
+int chooseOrder(const qint16 *x, long n) {
+	if (n <= 3)
+		return 0;
+
+	quint64 sum0 = 0, sum1 = 0, sum2 = 0, sum3 = 0;
+	for (long i = 3; i < n; i++) {
+		qint32 e0 = x[i];
+		qint32 e1 = e0 - x[i - 1];
+		qint32 e2 = e1 - (x[i - 1] - x[i - 2]);
+		qint32 e3 = e2 - (x[i - 1] - 2 * x[i - 2] + x[i - 3]);
+		sum0 += abs(e0);
+		sum1 += abs(e1);
+		sum2 += abs(e2);
+		sum3 += abs(e3);
+	}
+
+	int order = 0;
+	quint64 best = sum0;
+	if (sum1 < best) {
+		order = 1;
+		best = sum1;
+	}
+	if (sum2 < best) {
+		order = 2;
+		best = sum2;
+	}
+	if (sum3 < best)
+		order = 3;
+	return order;
+}
+
+void computeResiduals(const qint16 *x, long n, int order, quint32 *u) {
+	switch (order) {
+		case 0:
+			for (long i = 0; i < n; i++)
+				u[i] = zigzag(x[i]);
+			break;
+		case 1:
+			for (long i = 1; i < n; i++)
+				u[i] = zigzag(x[i] - x[i - 1]);
+			break;
+		case 2:
+			for (long i = 2; i < n; i++)
+				u[i] = zigzag(x[i] - 2 * x[i - 1] + x[i - 2]);
+			break;
+		default:
+			for (long i = 3; i < n; i++)
+				u[i] = zigzag(x[i] - 3 * x[i - 1] + 3 * x[i - 2] - x[i - 3]);
+			break;
+	}
+}
+
+void encodeChannel(BitWriter &out, const qint16 *x, long n, quint32 *u) {
+	int order = chooseOrder(x, n);
+	computeResiduals(x, n, order, u);
+
+	out.put(order, 2);
+	for (int i = 0; i < order; i++)
+		out.put((quint16)x[i], 16);
+
+	for (long from = 0; from < n; from += partitionSize) {
+		long start = qMax(from, (long)order);
+		long to = qMin(from + partitionSize, n);
+
+		// the parameter closest to log2 of the mean
+		quint64 sum = 0;
+		for (long i = start; i < to; i++)
+			sum += u[i];
+		int k = 0;
+		while (k < maxRiceParameter && ((quint64)(to - start) << (k + 1)) < sum)
+			k++;
+		out.put(k, 5);
+
+		quint32 mask = (1 << k) - 1;
+		for (long i = start; i < to; i++) {
+			quint32 q = u[i] >> k;
+			if (q >= (quint32)escapeLength) {
+				out.put(0, escapeLength);
+				out.put(u[i], rawBits);
+			} else if (q + 1 + k <= 32) {
+				out.put((1 << k) | (u[i] & mask), q + 1 + k);
+			} else {
+				out.put(1, q + 1);
+				out.put(u[i] & mask, k);
+			}
+		}
+	}
+}
+
+bool decodeChannel(BitReader &in, qint16 *x, long n, quint32 *u) {
+	int order = in.get(2);
+	if (order > 0 && order >= n)
+		return false;
+
+	for (int i = 0; i < order; i++)
+		x[i] = (qint16)in.get(16);
+
+	for (long from = 0; from < n; from += partitionSize) {
+		long start = qMax(from, (long)order);
+		long to = qMin(from + partitionSize, n);
+		int k = in.get(5);
+		if (k > maxRiceParameter)
+			return false;
+		for (long i = start; i < to; i++)
+			u[i] = in.getRice(k);
+	}
+
+	switch (order) {
+		case 0:
+			for (long i = 0; i < n; i++)
+				x[i] = (qint16)unzigzag(u[i]);
+			break;
+		case 1:
+			for (long i = 1; i < n; i++)
+				x[i] = (qint16)(unzigzag(u[i]) + x[i - 1]);
+			break;
+		case 2:
+			for (long i = 2; i < n; i++)
+				x[i] = (qint16)(unzigzag(u[i]) + 2 * x[i - 1] - x[i - 2]);
+			break;
+		default:
+			for (long i = 3; i < n; i++)
+				x[i] = (qint16)(unzigzag(u[i]) + 3 * x[i - 1] - 3 * x[i - 2] + x[i - 3]);
+			break;
+	}
+
+	return !in.overrun();
+}
+
+AudioFileWriter *createPackedSpoolWriter() {
+	return new PackedSpoolWriter;
+}
+
+AudioFileReader *createPackedSpoolReader() {
+	return new PackedSpoolReader;
+}
+}
+
+// PackedSpoolWriter
+
+PackedSpoolWriter::PackedSpoolWriter() :
+	blockSize(0),
+	hasFlushed(false)
+{
+}
+
+PackedSpoolWriter::~PackedSpoolWriter() {
+	if (file.isOpen()) {
+		debug("WARNING: PackedSpoolWriter::~PackedSpoolWriter(): File has not been closed, closing it now");
+		close();
+	}
+}
+
+bool PackedSpoolWriter::open(const QString &fn, long sr, bool s) {
+	if (!AudioFileWriter::open(fn + ".pcmz", sr, s))
+		return false;
+
+	QDateTime now = QDateTime::currentDateTime();
+	Header header;
+	header.channels = stereo ? 2 : 1;
+	header.sampleRate = sampleRate;
+	header.blockSize = blockSize = sampleRate;
+	header.created = (qint64)now.toTime_t() * 1000 + now.time().msec();
+
+	// speech takes about half of what it takes as PCM
+	preallocate(stereo ? sampleRate * 2 : sampleRate);
+
+	return file.write(makeHeader(header)) == headerSize;
+}
+
+bool PackedSpoolWriter::resume(const QString &fn, long sr, bool s) {
+	if (!reopen(fn + ".pcmz", sr, s))
+		return false;
+
+	// the blocks are walked through, which reopen() doesn't allow through
+	// readBack() without opening the file for each one
+	QFile f(OutputFile::temporaryName(file.fileName()));
+	Header header;
+	if (!f.open(QIODevice::ReadOnly) || !parseHeader(f.read(headerSize), header) ||
+			header.channels != (stereo ? 2 : 1) || header.sampleRate != sampleRate) {
+		debug(QString("'%1' doesn't match this recording, not continuing it").arg(file.fileName()));
+		file.close();
+		return false;
+	}
+
+	qint64 size = intactSize(f, header, samplesWritten);
+	f.close();
+	if (file.size() != size && !file.truncate(size)) {
+		file.close();
+		return false;
+	}
+
+	blockSize = header.blockSize;
+	preallocate(stereo ? sampleRate * 2 : sampleRate);
+
+	return true;
+}
+
+void PackedSpoolWriter::close() {
+	if (!file.isOpen()) {
+		debug("WARNING: PackedSpoolWriter::close() called, but file not open");
+		return;
+	}
+
+	if (!hasFlushed) {
+		debug("WARNING: PackedSpoolWriter::close() called but no flush happened, flushing now");
+		QByteArray dummy1, dummy2;
+		write(dummy1, dummy2, 0, true);
+	}
+
+	AudioFileWriter::close();
+}
+
+bool PackedSpoolWriter::write(QByteArray &left, QByteArray &right, long samples, bool flush) {
+	pendingLeft.append(left.constData(), samples * 2);
+	left.remove(0, samples * 2);
+	if (stereo) {
+		pendingRight.append(right.constData(), samples * 2);
+		right.remove(0, samples * 2);
+	}
+
+	bool ok = true;
+	while (ok && pendingLeft.size() >= blockSize * 2)
+		ok = writeBlock(blockSize);
+
+	// a short block is only written at the end
+	if (ok && flush && !pendingLeft.isEmpty())
+		ok = writeBlock(pendingLeft.size() / 2);
+
+	if (flush)
+		hasFlushed = true;
+
+	return ok;
+}
+
+bool PackedSpoolWriter::writeBlock(long samples) {
+	int channels = stereo ? 2 : 1;
+	qint64 maxSize = blockHeaderSize + maxPayloadSize(samples, channels);
+	if (block.size() < maxSize)
+		block.resize(maxSize);
+	if (residuals.size() < samples)
+		residuals.resize(samples);
+
+	char *h = block.data();
+	BitWriter out(h + blockHeaderSize);
+	encodeChannel(out, reinterpret_cast<const qint16 *>(pendingLeft.constData()), samples, residuals.data());
+	if (stereo)
+		encodeChannel(out, reinterpret_cast<const qint16 *>(pendingRight.constData()), samples, residuals.data());
+	qint64 payloadSize = out.finish();
+
+	memcpy(h, "BLKZ", 4);
+	putUInt32(h + 4, payloadSize);
+	putUInt64(h + 8, samplesWritten);
+	putUInt32(h + 16, samples);
+	putUInt32(h + 20, blockChecksum(h, h + blockHeaderSize, payloadSize));
+
+	pendingLeft.remove(0, samples * 2);
+	if (stereo)
+		pendingRight.remove(0, samples * 2);
+	samplesWritten += samples;
+
+	growPreallocation();
+	return file.write(h, blockHeaderSize + payloadSize) == blockHeaderSize + payloadSize;
+}
+
+WriterFormat PackedSpoolWriter::writerFormat() {
+	WriterFormat format;
+	format.name = "packed";
+	format.description = "Packed PCM";
+	format.extension = ".pcmz";
+	format.capabilities = WriterStereo | WriterSegmentable | WriterSpool;
+	format.cost = 2;
+	format.create = createPackedSpoolWriter;
+	format.prepare = NULL;
+	format.recover = PackedSpoolWriter::recover;
+	format.createReader = createPackedSpoolReader;
+	return format;
+}
+
+bool PackedSpoolWriter::recover(const QString &fn) {
+	QFile f(fn);
+	Header header;
+	if (!f.open(QIODevice::ReadWrite) || !parseHeader(f.read(headerSize), header))
+		return false;
+
+	qint64 samples;
+	qint64 size = intactSize(f, header, samples);
+	return f.size() == size || f.resize(size);
+}
+
+// PackedSpoolReader
+
+PackedSpoolReader::PackedSpoolReader() :
+	sampleRate(0),
+	stereo(false),
+	blockSize(0),
+	created(0),
+	position(0),
+	indexBuilt(false),
+	atEnd(false)
+{
+}
+
+bool PackedSpoolReader::open(const QString &fn) {
+	// spool files are encrypted along with everything else
+	if (!file.open(fn))
+		return false;
+
+	Header header;
+	if (!parseHeader(file.read(headerSize), header)) {
+		debug(QString("PackedSpoolReader: '%1' is not a packed spool file").arg(fn));
+		close();
+		return false;
+	}
+
+	sampleRate = header.sampleRate;
+	stereo = header.channels == 2;
+	blockSize = header.blockSize;
+	created = header.created;
+	position = 0;
+	left.clear();
+	right.clear();
+	index.clear();
+	indexBuilt = false;
+	atEnd = false;
+
+	return true;
+}
+
+void PackedSpoolReader::close() {
+	file.close();
+}
+
+long PackedSpoolReader::read(QByteArray &l, QByteArray &r, long samples) {
+	while (left.size() < samples * 2 && !atEnd)
+		atEnd = !nextBlock();
+
+	long n = qMin((long)left.size() / 2, samples);
+	l.append(left.constData(), n * 2);
+	left.remove(0, n * 2);
+	if (stereo) {
+		r.append(right.constData(), n * 2);
+		right.remove(0, n * 2);
+	}
+
+	position += n;
+	return n;
+}
+
+bool PackedSpoolReader::nextBlock() {
+	Header header;
+	header.channels = stereo ? 2 : 1;
+	header.blockSize = blockSize;
+
+	for (;;) {
+		qint64 offset = file.pos();
+		QByteArray h = file.read(blockHeaderSize);
+		BlockHeader block;
+		if (!parseBlockHeader(h, header, block))
+			return false;
+		QByteArray payload = file.read(block.payloadSize);
+		if (payload.size() != block.payloadSize)
+			return false;
+
+		// blocks that end before what has been decoded so far, which
+		// happens after seeking
+		qint64 decoded = position + left.size() / 2;
+		if (block.firstSample + block.samples <= decoded)
+			continue;
+
+		QByteArray blockLeft(block.samples * 2, 0);
+		QByteArray blockRight(stereo ? block.samples * 2 : 0, 0);
+		if (residuals.size() < block.samples)
+			residuals.resize(block.samples);
+
+		BitReader in(payload.constData(), payload.size());
+		bool ok = blockChecksum(h.constData(), payload.constData(), payload.size()) == block.crc &&
+			decodeChannel(in, reinterpret_cast<qint16 *>(blockLeft.data()), block.samples, residuals.data()) &&
+			(!stereo || decodeChannel(in, reinterpret_cast<qint16 *>(blockRight.data()), block.samples, residuals.data()));
+		if (!ok) {
+			debug(QString("PackedSpoolReader: the block at offset %1 is damaged, skipping it").arg(offset));
+			continue;
+		}
+
+		// fill a gap with silence, or drop what has already been read
+		qint64 skip = decoded - block.firstSample;
+		if (skip < 0) {
+			left.append(QByteArray(-skip * 2, 0));
+			if (stereo)
+				right.append(QByteArray(-skip * 2, 0));
+			skip = 0;
+		}
+		left.append(blockLeft.constData() + skip * 2, (block.samples - skip) * 2);
+		if (stereo)
+			right.append(blockRight.constData() + skip * 2, (block.samples - skip) * 2);
+
+		return true;
+	}
+}
+
+bool PackedSpoolReader::buildIndex() {
+	Header header;
+	header.channels = stereo ? 2 : 1;
+	header.blockSize = blockSize;
+	qint64 pos = headerSize;
+
+	// only complete blocks are listed.  their checksums are checked when
+	// they are decoded
+	for (;;) {
+		BlockHeader block;
+		QByteArray h = file.seek(pos) ? file.read(blockHeaderSize) : QByteArray();
+		if (!parseBlockHeader(h, header, block))
+			break;
+		qint64 next = pos + blockHeaderSize + block.payloadSize;
+		if (!file.seek(next - 1) || file.read(1).size() != 1)
+			break;
+
+		IndexEntry entry;
+		entry.offset = pos;
+		entry.firstSample = block.firstSample;
+		entry.samples = block.samples;
+		index.append(entry);
+		pos = next;
+	}
+
+	indexBuilt = true;
+	return !index.isEmpty();
+}
+
+bool PackedSpoolReader::seek(qint64 sample) {
+	if (!indexBuilt)
+		buildIndex();
+	if (index.isEmpty() || sample < 0 || sample >= index.last().firstSample + index.last().samples)
+		return false;
+
+	// the last block that starts at or before the sample
+	int low = 0;
+	int high = index.size();
+	while (low < high) {
+		int middle = (low + high) / 2;
+		if (index.at(middle).firstSample <= sample)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+
+	if (!file.seek(index.at(qMax(low - 1, 0)).offset))
+		return false;
+
+	left.clear();
+	right.clear();
+	position = sample;
+	atEnd = false;
+	return true;
+}
+
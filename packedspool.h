@@ -0,0 +1,149 @@
+/*
+	Skype Call Recorder
+	Copyright 2008 - 2009 by jlh (jlh at gmx dot ch)
+
+	This program is free software; you can redistribute it and/or modify it
+	under the terms of the GNU General Public License as published by the
+	Free Software Foundation; either version 2 of the License, version 3 of
+	the License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful, but
+	WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+	General Public License for more details.
+
+	You should have received a copy of the GNU General Public License along
+	with this program; if not, write to the Free Software Foundation, Inc.,
+	51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+	The GNU General Public License version 2 is included with the source of
+	this program under the file name COPYING.  You can also get a copy on
+	http://www.fsf.org/
+*/
+
+#ifndef PACKEDSPOOL_H
+#define PACKEDSPOOL_H
+
+#include <QByteArray>
+#include <QList>
+#include <QVector>
+
+#include "common.h"
+#include "writer.h"
+#include "encryptingbackend.h"
+
+class QString;
+
+// a compact lossless format for spool files, about half the size of WAV for
+// speech at a fraction of the CPU time FLAC takes.  the audio is cut into
+// blocks of one second, and each channel of a block is predicted by a fixed
+// polynomial of order 0 to 3, whichever fits best.  what the prediction
+// misses is stored as Rice codes.  blocks can be decoded on their own, and
+// a file that has been cut off is readable up to its last complete block.
+//
+// all numbers are little-endian.  the file starts with a 32 byte header:
+//
+//    0  4  "PCMZ"
+//    4  2  format version, 1
+//    6  2  number of channels, 1 or 2
+//    8  4  sample rate
+//   12  4  samples per block
+//   16  8  when the file was created, in milliseconds since the epoch
+//   24  8  reserved, 0
+//
+// each block has a 24 byte header, followed by its payload:
+//
+//    0  4  "BLKZ"
+//    4  4  size of the payload
+//    8  8  the first sample of the block, counted from the start of the file
+//   16  4  number of samples, at most the block size
+//   20  4  CRC-32C of bytes 4 to 19 of this header and of the payload
+//
+// the payload is a bit stream, most significant bit first, padded to a
+// whole byte.  for each channel, it has the predictor order in 2 bits, as
+// many warm-up samples as the order in 16 bits each, and the residuals of
+// the remaining samples in partitions of 256.  a partition starts with its
+// Rice parameter k in 5 bits.  each residual r is mapped to u = 2r for r >= 0
+// and u = -2r - 1 otherwise, and written as u >> k in unary, that is as
+// zeros ended by a one, followed by the low k bits of u.  a u with 32 or
+// more in its high part is written as 32 zeros and u in 20 bits instead
+
+class PackedSpoolWriter : public AudioFileWriter {
+public:
+	PackedSpoolWriter();
+	virtual ~PackedSpoolWriter();
+
+	virtual bool open(const QString &, long, bool);
+	virtual bool resume(const QString &, long, bool);
+	virtual void close();
+	virtual bool write(QByteArray &, QByteArray &, long, bool = false);
+
+	// cuts off a block that has been left incomplete by a crash
+	static bool recover(const QString &);
+	// describes this writer for the format registry, see writer.h
+	static WriterFormat writerFormat();
+
+private:
+	bool writeBlock(long);
+
+private:
+	long blockSize;
+	QByteArray pendingLeft;
+	QByteArray pendingRight;
+	QByteArray block;
+	QVector<quint32> residuals;
+	bool hasFlushed;
+
+	DISABLE_COPY_AND_ASSIGNMENT(PackedSpoolWriter);
+};
+
+// reads files written by PackedSpoolWriter.  a block that fails its checksum
+// is skipped, and gaps between blocks are filled with silence, so that what
+// follows keeps its position in time
+
+class PackedSpoolReader : public AudioFileReader {
+public:
+	PackedSpoolReader();
+
+	virtual bool open(const QString &);
+	virtual void close();
+	virtual long read(QByteArray &, QByteArray &, long);
+	// finds the block with the given sample and decodes only that one.
+	// the first seek walks the block headers of the whole file
+	virtual bool seek(qint64);
+	virtual long getSampleRate() const { return sampleRate; }
+	virtual bool isStereo() const { return stereo; }
+	// when the file was created
+	qint64 startTime() const { return created; }
+
+private:
+	bool nextBlock();
+	bool buildIndex();
+
+private:
+	struct IndexEntry {
+		qint64 offset;
+		qint64 firstSample;
+		long samples;
+	};
+
+	InputFile file;
+	long sampleRate;
+	bool stereo;
+	long blockSize;
+	qint64 created;
+	// the decoded samples of the current block, from position on
+	QByteArray left;
+	QByteArray right;
+	// the sample the next read starts at
+	qint64 position;
+	QVector<quint32> residuals;
+	QList<IndexEntry> index;
+	bool indexBuilt;
+	bool atEnd;
+
+	DISABLE_COPY_AND_ASSIGNMENT(PackedSpoolReader);
+};
+
+#endif
+
@@ -0,0 +1,382 @@
+/*
+	Skype Call Recorder
+	Copyright 2008 - 2009 by jlh (jlh at gmx dot ch)
+
+	This program is free software; you can redistribute it and/or modify it
+	under the terms of the GNU General Public License as published by the
+	Free Software Foundation; either version 2 of the License, version 3 of
+	the License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful, but
+	WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+	General Public License for more details.
+
+	You should have received a copy of the GNU General Public License along
+	with this program; if not, write to the Free Software Foundation, Inc.,
+	51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+	The GNU General Public License version 2 is included with the source of
+	this program under the file name COPYING.  You can also get a copy on
+	http://www.fsf.org/
+*/
+
+#include <QByteArray>
+#include <QDir>
+#include <QFileInfo>
+#include <QString>
+#include <QStringList>
+#include <cstring>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/ioctl.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "pipewriter.h"
+#include "common.h"
+#include "preferences.h"
+#include "wavewriter.h"
+
+namespace {
+// how long the command may refuse data before we give up on it
+const int stallTimeout = 5000;
+// interleaving is done in pieces of this many sample frames
+const long chunkFrames = 4096;
+// a larger pipe absorbs hiccups of the encoder.  this is the default limit
+// for unprivileged processes
+const int wantedPipeCapacity = 1024 * 1024;
+// how much audio is held back for a command that's slower than real time
+const int maxPendingSeconds = 30;
+
+QString shellQuote(const QString &s) {
+	QString quoted = s;
+	quoted.replace("'", "'\\''");
+	return "'" + quoted + "'";
+}
+
+AudioFileWriter *createPipeWriter() {
+	return new PipeWriter;
+}
+}
+
+PipeWriter::PipeWriter() :
+	fd(-1),
+	pipeCapacity(0),
+	maxFillLevel(0),
+	chunkPos(0),
+	spool(NULL),
+	fellBack(false)
+{
+}
+
+PipeWriter::~PipeWriter() {
+	if (fd >= 0 || spool) {
+		debug("WARNING: PipeWriter::~PipeWriter(): File has not been closed, closing it now");
+		close();
+	}
+}
+
+bool PipeWriter::open(const QString &fn, long sr, bool s) {
+	QString command = preferences.get(Pref::OutputFormatPipeCommand).toString();
+	if (command.trimmed().isEmpty()) {
+		error = "No command has been set for the external encoder.";
+		return false;
+	}
+
+	QString name = fn + "." + preferences.get(Pref::OutputFormatPipeExtension).toString();
+	if (!QDir().mkpath(QFileInfo(name).path()))
+		return false;
+
+	// the command writes the file, this is only for fileName()
+	file.setFileName(name);
+	baseName = fn;
+	sampleRate = sr;
+	stereo = s;
+
+	command.replace("%r", QString("%1").arg(sampleRate));
+	command.replace("%c", stereo ? "2" : "1");
+	// last, so that the file name isn't searched for placeholders
+	command.replace("%f", shellQuote(name));
+
+	debug(QString("Opening '%1' through '%2'").arg(name, command));
+
+	if (!spawn(command)) {
+		error = "The external encoder could not be started.";
+		return false;
+	}
+
+	spool = new WaveWriter;
+	if (spool->open(baseName + "-unencoded", sampleRate, stereo)) {
+		spoolName = spool->fileName();
+	} else {
+		debug(QString("Cannot open '%1-unencoded.wav', the recording can't be saved if the external encoder fails").arg(baseName));
+		delete spool;
+		spool = NULL;
+	}
+
+	lastProgress.start();
+	return true;
+}
+
+bool PipeWriter::spawn(const QString &command) {
+	// a command that exits early must not take us down with it.  writes
+	// to its pipe fail with EPIPE instead
+	static bool ignoringSigPipe = false;
+	if (!ignoringSigPipe) {
+		signal(SIGPIPE, SIG_IGN);
+		ignoringSigPipe = true;
+	}
+
+	// prepared before forking, only async-signal-safe calls are allowed
+	// in the child
+	QByteArray shellCommand = command.toLocal8Bit();
+
+	int fds[2];
+	if (pipe2(fds, O_CLOEXEC) != 0)
+		return false;
+
+	pid_t pid = fork();
+	if (pid < 0) {
+		::close(fds[0]);
+		::close(fds[1]);
+		return false;
+	}
+
+	if (pid == 0) {
+		// the intermediate child exits right away, so that the command
+		// is adopted by init and never needs to be waited for
+		if (fork() == 0) {
+			dup2(fds[0], 0);
+			execl("/bin/sh", "sh", "-c", shellCommand.constData(), (char *)NULL);
+		}
+		_exit(127);
+	}
+
+	waitpid(pid, NULL, 0);
+	::close(fds[0]);
+	fd = fds[1];
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+#ifdef F_SETPIPE_SZ
+	fcntl(fd, F_SETPIPE_SZ, wantedPipeCapacity);
+	pipeCapacity = fcntl(fd, F_GETPIPE_SZ);
+#endif
+	if (pipeCapacity <= 0)
+		pipeCapacity = 65536;
+
+	return true;
+}
+
+bool PipeWriter::write(QByteArray &left, QByteArray &right, long samples, bool flush) {
+	if (fellBack)
+		return spool->write(left, right, samples, flush);
+
+	if (fd < 0)
+		return false;
+
+	pendingLeft.append(left.constData(), samples * 2);
+	left.remove(0, samples * 2);
+	if (stereo) {
+		pendingRight.append(right.constData(), samples * 2);
+		right.remove(0, samples * 2);
+	}
+	samplesWritten += samples;
+
+	drain();
+	catchUp();
+	if (fd < 0)
+		return fallBack("The external encoder has gone away");
+
+	maxFillLevel = qMax(maxFillLevel, fillLevel());
+
+	if (isBehind() && lastProgress.elapsed() > stallTimeout)
+		return fallBack(QString("The external encoder has taken no data for %1 seconds").arg(stallTimeout / 1000));
+	if (pendingLeft.size() > (qint64)maxPendingSeconds * sampleRate * 2)
+		return fallBack(QString("The external encoder is more than %1 seconds behind").arg(maxPendingSeconds));
+
+	return true;
+}
+
+void PipeWriter::catchUp() {
+	if (!mayWait)
+		return;
+
+	while (fd >= 0 && isBehind()) {
+		int timeout = stallTimeout - lastProgress.elapsed();
+		if (timeout <= 0)
+			return;
+
+		struct pollfd p;
+		p.fd = fd;
+		p.events = POLLOUT;
+		p.revents = 0;
+		int n = poll(&p, 1, timeout);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return;
+		// this also notices when the command has exited
+		drain();
+	}
+}
+
+void PipeWriter::drain() {
+	while (fd >= 0) {
+		if (chunkPos >= chunk.size()) {
+			long frames = qMin((long)pendingLeft.size() / 2, chunkFrames);
+			if (frames == 0)
+				return;
+
+			chunk.resize(frames * (stereo ? 4 : 2));
+			if (stereo) {
+				qint16 *chunkData = reinterpret_cast<qint16 *>(chunk.data());
+				const qint16 *leftData = reinterpret_cast<const qint16 *>(pendingLeft.constData());
+				const qint16 *rightData = reinterpret_cast<const qint16 *>(pendingRight.constData());
+				for (long i = 0; i < frames; i++) {
+					chunkData[i * 2] = leftData[i];
+					chunkData[i * 2 + 1] = rightData[i];
+				}
+				pendingRight.remove(0, frames * 2);
+			} else {
+				memcpy(chunk.data(), pendingLeft.constData(), frames * 2);
+			}
+			pendingLeft.remove(0, frames * 2);
+			chunkPos = 0;
+		}
+
+		ssize_t n = ::write(fd, chunk.constData() + chunkPos, chunk.size() - chunkPos);
+		if (n > 0) {
+			chunkPos += n;
+			lastProgress.restart();
+		} else if (n < 0 && errno == EINTR) {
+			continue;
+		} else if (n < 0 && errno == EAGAIN) {
+			// the pipe is full, try again with the next write()
+			return;
+		} else {
+			// EPIPE, the command has exited
+			closePipe();
+		}
+	}
+}
+
+int PipeWriter::fillLevel() const {
+	int n = 0;
+	if (fd < 0 || ioctl(fd, FIONREAD, &n) < 0)
+		return 0;
+	return n;
+}
+
+bool PipeWriter::fallBack(const QString &reason) {
+	closePipe();
+	if (!spool) {
+		debug(QString("%1, dropping the rest of '%2'").arg(reason, fileName()));
+		return false;
+	}
+	debug(QString("%1, writing the rest of '%2' to '%3'").arg(reason, fileName(), spoolName));
+	fellBack = true;
+
+	// the part of the current chunk the command hasn't received goes
+	// first.  a partly written sample frame is lost
+	int frameSize = stereo ? 4 : 2;
+	int from = (chunkPos + frameSize - 1) / frameSize * frameSize;
+	long frames = (chunk.size() - from) / frameSize;
+	QByteArray left, right;
+	left.resize(frames * 2);
+	right.resize(stereo ? frames * 2 : 0);
+	const qint16 *chunkData = reinterpret_cast<const qint16 *>(chunk.constData() + from);
+	qint16 *leftData = reinterpret_cast<qint16 *>(left.data());
+	qint16 *rightData = reinterpret_cast<qint16 *>(right.data());
+	for (long i = 0; i < frames; i++) {
+		if (stereo) {
+			leftData[i] = chunkData[i * 2];
+			rightData[i] = chunkData[i * 2 + 1];
+		} else {
+			leftData[i] = chunkData[i];
+		}
+	}
+	chunk.clear();
+	chunkPos = 0;
+
+	left += pendingLeft;
+	right += pendingRight;
+	pendingLeft.clear();
+	pendingRight.clear();
+
+	return spool->write(left, right, left.size() / 2);
+}
+
+void PipeWriter::closePipe() {
+	if (fd < 0)
+		return;
+	// the command sees the end of its input and finishes the file
+	::close(fd);
+	fd = -1;
+}
+
+void PipeWriter::close() {
+	if (fd < 0 && !spool) {
+		debug("WARNING: PipeWriter::close() called, but pipe not open");
+		return;
+	}
+
+	// whatever the pipe won't take right now goes to the spool.  waiting
+	// for the command here would hold up the other calls, unless that's
+	// allowed
+	if (fd >= 0) {
+		drain();
+		catchUp();
+		if (fd < 0)
+			fallBack("The external encoder has gone away");
+		else if (isBehind())
+			fallBack("The external encoder is behind at the end of the recording");
+	}
+
+	debug(QString("Closing '%1', wrote %2 samples, %3 seconds, the pipe was up to %4% full")
+		.arg(fileName()).arg(samplesWritten).arg(samplesWritten / sampleRate).arg(maxFillLevel * 100 / pipeCapacity));
+
+	closePipe();
+
+	if (fellBack) {
+		QByteArray dummy1, dummy2;
+		spool->write(dummy1, dummy2, 0, true);
+	}
+	if (spool) {
+		spool->close();
+		delete spool;
+		spool = NULL;
+	}
+	if (!fellBack && !spoolName.isEmpty()) {
+		OutputFile::remove(spoolName);
+		spoolName.clear();
+	}
+}
+
+QStringList PipeWriter::fileNames() const {
+	QStringList list(fileName());
+	if (!spoolName.isEmpty())
+		list.append(spoolName);
+	return list;
+}
+
+WriterFormat PipeWriter::writerFormat() {
+	WriterFormat format;
+	format.name = "pipe";
+	format.description = "External encoder";
+	// configurable, see Pref::OutputFormatPipeExtension.  the files aren't
+	// recovered after a crash anyway, that's up to the command
+	format.extension = QString();
+	format.capabilities = WriterStereo | WriterSegmentable;
+	// the encoder is unknown, so assume it's as expensive as ours
+	format.cost = 10;
+	format.create = createPipeWriter;
+	format.prepare = NULL;
+	format.recover = NULL;
+	format.createReader = NULL;
+	return format;
+}
+
@@ -0,0 +1,89 @@
+/*
+	Skype Call Recorder
+	Copyright 2008 - 2009 by jlh (jlh at gmx dot ch)
+
+	This program is free software; you can redistribute it and/or modify it
+	under the terms of the GNU General Public License as published by the
+	Free Software Foundation; either version 2 of the License, version 3 of
+	the License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful, but
+	WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+	General Public License for more details.
+
+	You should have received a copy of the GNU General Public License along
+	with this program; if not, write to the Free Software Foundation, Inc.,
+	51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+	The GNU General Public License version 2 is included with the source of
+	this program under the file name COPYING.  You can also get a copy on
+	http://www.fsf.org/
+*/
+
+#ifndef PIPEWRITER_H
+#define PIPEWRITER_H
+
+#include <QByteArray>
+#include <QTime>
+
+#include "common.h"
+#include "writer.h"
+
+class QString;
+class WaveWriter;
+
+// Feeds the audio to an external encoder, a command that reads raw PCM
+// (signed 16 bit, little endian, interleaved) from its standard input and
+// writes the output file itself.  the pipe is only waited on if
+// setMayWait() allows it, otherwise what it can't take is held back for a
+// while.  if the command stops taking data for too long, falls too far
+// behind or goes away, the rest of the recording goes to a WAV file next to
+// the output instead, so nothing is lost
+
+class PipeWriter : public AudioFileWriter {
+public:
+	PipeWriter();
+	virtual ~PipeWriter();
+
+	virtual bool open(const QString &, long, bool);
+	virtual void close();
+	virtual bool write(QByteArray &, QByteArray &, long, bool = false);
+	virtual QStringList fileNames() const;
+
+	// describes this writer for the format registry, see writer.h
+	static WriterFormat writerFormat();
+
+private:
+	bool spawn(const QString &);
+	void drain();
+	bool isBehind() const { return !pendingLeft.isEmpty() || chunkPos < chunk.size(); }
+	void catchUp();
+	int fillLevel() const;
+	bool fallBack(const QString &);
+	void closePipe();
+
+private:
+	int fd;
+	int pipeCapacity;
+	int maxFillLevel;
+	// audio that hasn't been handed to the pipe yet.  the part of the
+	// interleaved chunk that has been written is skipped by chunkPos
+	QByteArray pendingLeft;
+	QByteArray pendingRight;
+	QByteArray chunk;
+	int chunkPos;
+	QTime lastProgress;
+	QString baseName;
+	// opened along with the pipe, since opening reads the preferences,
+	// which write() and close() can't do on other threads.  it is removed
+	// again if it isn't needed
+	WaveWriter *spool;
+	QString spoolName;
+	bool fellBack;
+
+	DISABLE_COPY_AND_ASSIGNMENT(PipeWriter);
+};
+
+#endif
+
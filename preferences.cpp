@@ -45,6 +45,7 @@
 #include "smartwidgets.h"
 #include "common.h"
 #include "recorder.h"
+#include "writer.h"
 
 Preferences preferences;
 
@@ -184,16 +185,29 @@ QWidget *PreferencesDialog::createFormatTab() {
 	QLabel *label = new QLabel("Fil&e format:");
 	formatWidget = new SmartComboBox(preferences.get(Pref::OutputFormat));
 	label->setBuddy(formatWidget);
-	formatWidget->addItem("WAV PCM", "wav");
-	formatWidget->addItem("MP3", "mp3");
-	formatWidget->addItem("Ogg Vorbis", "vorbis");
+	QList<const WriterFormat *> formats = writerFormats();
+	for (int i = 0; i < formats.size(); i++)
+		if (!(formats.at(i)->capabilities & WriterSpool))
+			formatWidget->addItem(formats.at(i)->description, formats.at(i)->name);
 	formatWidget->setupDone();
 	connect(formatWidget, SIGNAL(currentIndexChanged(int)), this, SLOT(updateFormatSettings()));
 	grid->addWidget(label, 0, 0);
 	grid->addWidget(formatWidget, 0, 1);
 
+	label = new QLabel("MP3 encoding mo&de:");
+	SmartComboBox *combo = new SmartComboBox(preferences.get(Pref::OutputFormatMp3Mode));
+	label->setBuddy(combo);
+	combo->addItem("Constant bitrate", "cbr");
+	combo->addItem("Average bitrate", "abr");
+	combo->addItem("Variable bitrate (smallest for speech)", "vbr");
+	combo->setupDone();
+	mp3Settings.append(label);
+	mp3Settings.append(combo);
+	grid->addWidget(label, 1, 0);
+	grid->addWidget(combo, 1, 1);
+
 	label = new QLabel("MP3 &bitrate:");
-	SmartComboBox *combo = new SmartComboBox(preferences.get(Pref::OutputFormatMp3Bitrate));
+	combo = new SmartComboBox(preferences.get(Pref::OutputFormatMp3Bitrate));
 	label->setBuddy(combo);
 	combo->addItem("8 kbps", 8);
 	combo->addItem("16 kbps", 16);
@@ -212,8 +226,27 @@ QWidget *PreferencesDialog::createFormatTab() {
 	combo->setupDone();
 	mp3Settings.append(label);
 	mp3Settings.append(combo);
-	grid->addWidget(label, 1, 0);
-	grid->addWidget(combo, 1, 1);
+	grid->addWidget(label, 2, 0);
+	grid->addWidget(combo, 2, 1);
+
+	label = new QLabel("MP3 &VBR quality:");
+	combo = new SmartComboBox(preferences.get(Pref::OutputFormatMp3VbrQuality));
+	label->setBuddy(combo);
+	combo->addItem("Quality 0 (best)", 0);
+	combo->addItem("Quality 1", 1);
+	combo->addItem("Quality 2", 2);
+	combo->addItem("Quality 3", 3);
+	combo->addItem("Quality 4", 4);
+	combo->addItem("Quality 5", 5);
+	combo->addItem("Quality 6 (recommended)", 6);
+	combo->addItem("Quality 7", 7);
+	combo->addItem("Quality 8", 8);
+	combo->addItem("Quality 9 (smallest)", 9);
+	combo->setupDone();
+	mp3Settings.append(label);
+	mp3Settings.append(combo);
+	grid->addWidget(label, 3, 0);
+	grid->addWidget(combo, 3, 1);
 
 	label = new QLabel("Ogg Vorbis &quality:");
 	combo = new SmartComboBox(preferences.get(Pref::OutputFormatVorbisQuality));
@@ -233,8 +266,78 @@ QWidget *PreferencesDialog::createFormatTab() {
 	combo->setupDone();
 	vorbisSettings.append(label);
 	vorbisSettings.append(combo);
-	grid->addWidget(label, 2, 0);
-	grid->addWidget(combo, 2, 1);
+	grid->addWidget(label, 4, 0);
+	grid->addWidget(combo, 4, 1);
+
+	label = new QLabel("FLAC &compression level:");
+	combo = new SmartComboBox(preferences.get(Pref::OutputFormatFlacLevel));
+	label->setBuddy(combo);
+	combo->addItem("Level 0 (fastest)", 0);
+	combo->addItem("Level 1", 1);
+	combo->addItem("Level 2", 2);
+	combo->addItem("Level 3", 3);
+	combo->addItem("Level 4", 4);
+	combo->addItem("Level 5 (recommended)", 5);
+	combo->addItem("Level 6", 6);
+	combo->addItem("Level 7", 7);
+	combo->addItem("Level 8 (smallest)", 8);
+	combo->setupDone();
+	flacSettings.append(label);
+	flacSettings.append(combo);
+	grid->addWidget(label, 5, 0);
+	grid->addWidget(combo, 5, 1);
+
+	label = new QLabel("External encoder co&mmand:");
+	SmartLineEdit *edit = new SmartLineEdit(preferences.get(Pref::OutputFormatPipeCommand));
+	label->setBuddy(edit);
+	edit->setToolTip("Command that reads raw 16 bit little endian PCM from its standard input and writes the file.\n"
+		"%r is replaced by the sample rate, %c by the number of channels and %f by the file name.");
+	pipeSettings.append(label);
+	pipeSettings.append(edit);
+	grid->addWidget(label, 6, 0);
+	grid->addWidget(edit, 6, 1);
+
+	label = new QLabel("External encoder file ex&tension:");
+	edit = new SmartLineEdit(preferences.get(Pref::OutputFormatPipeExtension));
+	label->setBuddy(edit);
+	pipeSettings.append(label);
+	pipeSettings.append(edit);
+	grid->addWidget(label, 7, 0);
+	grid->addWidget(edit, 7, 1);
+
+	label = new QLabel("&Additional formats:");
+	edit = new SmartLineEdit(preferences.get(Pref::OutputExtraFormats));
+	label->setBuddy(edit);
+	edit->setToolTip("Comma separated list of additional files to write, for example \"flac,mp3:mono\".\n"
+		"Valid formats are wav, mp3, vorbis, flac and pipe, optionally followed by :mono or :stereo.");
+	grid->addWidget(label, 8, 0);
+	grid->addWidget(edit, 8, 1);
+
+	label = new QLabel("S&plit recordings:");
+	combo = new SmartComboBox(preferences.get(Pref::OutputSegmentMinutes));
+	label->setBuddy(combo);
+	combo->addItem("Never", 0);
+	combo->addItem("Every 15 minutes", 15);
+	combo->addItem("Every 30 minutes", 30);
+	combo->addItem("Every hour", 60);
+	combo->addItem("Every 2 hours", 120);
+	combo->addItem("Every 4 hours", 240);
+	combo->setupDone();
+	grid->addWidget(label, 9, 0);
+	grid->addWidget(combo, 9, 1);
+
+	label = new QLabel("Maximum file si&ze:");
+	combo = new SmartComboBox(preferences.get(Pref::OutputSegmentMegabytes));
+	label->setBuddy(combo);
+	combo->addItem("Unlimited", 0);
+	combo->addItem("50 MB", 50);
+	combo->addItem("100 MB", 100);
+	combo->addItem("500 MB", 500);
+	combo->addItem("1000 MB", 1000);
+	combo->addItem("2000 MB", 2000);
+	combo->setupDone();
+	grid->addWidget(label, 10, 0);
+	grid->addWidget(combo, 10, 1);
 
 	vbox->addLayout(grid);
 
@@ -261,6 +364,32 @@ QWidget *PreferencesDialog::createFormatTab() {
 	check = new SmartCheckBox("Save call &information in files", preferences.get(Pref::OutputSaveTags));
 	mp3Settings.append(check);
 	vorbisSettings.append(check);
+	flacSettings.append(check);
+	vbox->addWidget(check);
+
+	check = new SmartCheckBox("Write a seek inde&x file for Ogg Vorbis files", preferences.get(Pref::OutputFormatVorbisSeekIndex));
+	vorbisSettings.append(check);
+	vbox->addWidget(check);
+
+	check = new SmartCheckBox("&Encode in the background after the call has ended", preferences.get(Pref::OutputDeferEncoding));
+	mp3Settings.append(check);
+	vorbisSettings.append(check);
+	flacSettings.append(check);
+	vbox->addWidget(check);
+
+	check = new SmartCheckBox("Keep the separate st&reams for remixing later", preferences.get(Pref::OutputKeepStreams));
+	check->setToolTip("The local and remote streams are kept unmixed next to each recording.\n"
+		"Use skype-call-recorder --remix to render it again with another stereo mix, gain or format.");
+	vbox->addWidget(check);
+
+	check = new SmartCheckBox("Write chec&ksums of recordings", preferences.get(Pref::OutputDigests));
+	check->setToolTip("A file with the CRC-32C and SHA-256 digests of each recording is written next to it.");
+	vbox->addWidget(check);
+
+	check = new SmartCheckBox("Encr&ypt recordings", preferences.get(Pref::OutputEncryption));
+	check->setToolTip("Recordings are encrypted as they are written, with the key in the key file.\n"
+		"Use skype-call-recorder-decrypt to decrypt them.  Without the key file, they are lost.\n"
+		"Files written by an external encoder are not encrypted.");
 	vbox->addWidget(check);
 
 	vbox->addStretch();
@@ -318,6 +447,12 @@ void PreferencesDialog::updateFormatSettings() {
 	if (v != "vorbis")
 		for (int i = 0; i < vorbisSettings.size(); i++)
 			vorbisSettings.at(i)->setEnabled(false);
+	if (v != "flac")
+		for (int i = 0; i < flacSettings.size(); i++)
+			flacSettings.at(i)->setEnabled(false);
+	if (v != "pipe")
+		for (int i = 0; i < pipeSettings.size(); i++)
+			pipeSettings.at(i)->setEnabled(false);
 	// enable
 	if (v == "mp3")
 		for (int i = 0; i < mp3Settings.size(); i++)
@@ -325,6 +460,12 @@ void PreferencesDialog::updateFormatSettings() {
 	if (v == "vorbis")
 		for (int i = 0; i < vorbisSettings.size(); i++)
 			vorbisSettings.at(i)->setEnabled(true);
+	if (v == "flac")
+		for (int i = 0; i < flacSettings.size(); i++)
+			flacSettings.at(i)->setEnabled(true);
+	if (v == "pipe")
+		for (int i = 0; i < pipeSettings.size(); i++)
+			pipeSettings.at(i)->setEnabled(true);
 }
 
 void PreferencesDialog::updateStereoSettings(bool stereo) {
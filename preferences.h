@@ -155,6 +155,8 @@ private:
 private:
 	QList<QWidget *> mp3Settings;
 	QList<QWidget *> vorbisSettings;
+	QList<QWidget *> flacSettings;
+	QList<QWidget *> pipeSettings;
 	QList<QWidget *> stereoSettings;
 	SmartLineEdit *outputPathEdit;
 	SmartComboBox *formatWidget;
@@ -230,10 +232,30 @@ X(OutputPath,                  output.path)
 X(OutputPattern,               output.pattern)
 X(OutputFormat,                output.format)
 X(OutputFormatMp3Bitrate,      output.format.mp3.bitrate)
+X(OutputFormatMp3Mode,         output.format.mp3.mode)
+X(OutputFormatMp3VbrQuality,   output.format.mp3.vbrquality)
 X(OutputFormatVorbisQuality,   output.format.vorbis.quality)
+X(OutputFormatVorbisSeekIndex, output.format.vorbis.seekindex)
+X(OutputFormatFlacLevel,       output.format.flac.level)
+X(OutputFormatWaveMmap,        output.format.wav.mmap)
+X(OutputFormatPipeCommand,     output.format.pipe.command)
+X(OutputFormatPipeExtension,   output.format.pipe.extension)
+X(OutputExtraFormats,          output.format.extra)
+X(OutputSegmentMinutes,        output.segment.minutes)
+X(OutputSegmentMegabytes,      output.segment.megabytes)
 X(OutputStereo,                output.stereo)
 X(OutputStereoMix,             output.stereo.mix)
 X(OutputSaveTags,              output.savetags)
+X(OutputDeferEncoding,         output.deferencoding)
+X(OutputSpoolFormat,           output.spool.format)
+X(OutputKeepStreams,           output.keepstreams)
+X(OutputBackend,               output.backend)
+X(OutputBufferKilobytes,       output.buffer.kilobytes)
+X(OutputSyncPolicy,            output.sync.policy)
+X(OutputSyncSeconds,           output.sync.seconds)
+X(OutputEncryption,            output.encryption)
+X(OutputEncryptionKeyFile,     output.encryption.keyfile)
+X(OutputDigests,               output.digests)
 X(SuppressLegalInformation,    suppress.legalinformation)
 X(SuppressFirstRunInformation, suppress.firstruninformation)
 X(PreferencesVersion,          preferences.version)
@@ -38,12 +38,25 @@
 #include "preferences.h"
 #include "skype.h"
 #include "call.h"
+#include "writer.h"
+#include "recovery.h"
+#include "encoderpool.h"
+#include "remix.h"
 
 Recorder::Recorder(int &argc, char **argv) :
-	QApplication(argc, argv)
+	// the remix tool doesn't need a display
+	QApplication(argc, argv, !isRemixCommand(argc, argv))
 {
 	recorderInstance = this;
 
+	// the remix tool may run along with a running instance, and only needs
+	// the preferences.  they are left to that instance to save
+	if (isRemixCommand(argc, argv)) {
+		loadPreferences(false);
+		QTimer::singleShot(0, this, SLOT(remix()));
+		return;
+	}
+
 	debug("Initializing application");
 
 	// check for already running instance
@@ -54,6 +67,10 @@ Recorder::Recorder(int &argc, char **argv) :
 	}
 
 	loadPreferences();
+	// whatever was being recorded when we last crashed
+	recoverUnfinishedFiles();
+	// encoders take a while to set up, have some ready before the first call
+	warmUpEncoderPool();
 
 	setupGUI();
 	setupSkype();
@@ -115,7 +132,7 @@ QString Recorder::getConfigFile() const {
 	return QDir::homePath() + "/.skypecallrecorder.rc";
 }
 
-void Recorder::loadPreferences() {
+void Recorder::loadPreferences(bool maySave) {
 	preferences.load(getConfigFile());
 	int c = preferences.count();
 
@@ -135,12 +152,32 @@ void Recorder::loadPreferences() {
 	X(Pref::AutoRecordNo,                "");            // comma separated skypenames to never record
 	X(Pref::OutputPath,                  "~/Skype Calls");
 	X(Pref::OutputPattern,               "Calls with &s/Call with &s, %a %b %d %Y, %H:%M:%S");
-	X(Pref::OutputFormat,                "mp3");         // "mp3", "vorbis" or "wav"
-	X(Pref::OutputFormatMp3Bitrate,      64);
+	X(Pref::OutputFormat,                "mp3");         // any registered format, see writer.h
+	X(Pref::OutputFormatMp3Bitrate,      64);            // average bitrate in ABR mode
+	X(Pref::OutputFormatMp3Mode,         "cbr");         // "cbr", "abr" or "vbr"
+	X(Pref::OutputFormatMp3VbrQuality,   6);             // 0 (best) .. 9
 	X(Pref::OutputFormatVorbisQuality,   3);
+	X(Pref::OutputFormatVorbisSeekIndex, false);
+	X(Pref::OutputFormatFlacLevel,       5);             // 0 .. 8
+	X(Pref::OutputFormatWaveMmap,        false);         // write WAV files through a memory mapping
+	X(Pref::OutputFormatPipeCommand,     "");            // %r rate, %c channels, %f file, e.g. "opusenc --raw --raw-rate %r --raw-chan %c - %f"
+	X(Pref::OutputFormatPipeExtension,   "raw");         // of the files the command writes
+	X(Pref::OutputExtraFormats,          "");            // comma separated, e.g. "flac,wav:mono"
+	X(Pref::OutputSegmentMinutes,        0);             // 0 means don't split
+	X(Pref::OutputSegmentMegabytes,      0);             // 0 means no size limit
+	X(Pref::OutputBackend,               "auto");        // "auto", "uring", "thread" or "sync"
+	X(Pref::OutputBufferKilobytes,       64);            // 0 means no buffering
+	X(Pref::OutputSyncPolicy,            "none");        // "none", "interval" or "close"
+	X(Pref::OutputSyncSeconds,           10);            // for the "interval" policy
+	X(Pref::OutputEncryption,            false);
+	X(Pref::OutputEncryptionKeyFile,     "~/.skypecallrecorder.key"); // created when first needed
+	X(Pref::OutputDigests,               false);         // write CRC-32C and SHA-256 digests next to each file
 	X(Pref::OutputStereo,                true);
 	X(Pref::OutputStereoMix,             0);             // 0 .. 100
 	X(Pref::OutputSaveTags,              true);
+	X(Pref::OutputDeferEncoding,         false);
+	X(Pref::OutputSpoolFormat,           "packed");      // "wav" or another spool format, see writer.h
+	X(Pref::OutputKeepStreams,           false);         // keep the unmixed streams for remixing, see remix.h
 	X(Pref::SuppressLegalInformation,    false);
 	X(Pref::SuppressFirstRunInformation, false);
 	X(Pref::PreferencesVersion,          2);
@@ -154,15 +191,18 @@ void Recorder::loadPreferences() {
 	if (c)
 		debug(QString("Loading %1 built-in default preference(s)").arg(c));
 
-	sanatizePreferences();
+	sanatizePreferences(maySave);
 }
 
 void Recorder::savePreferences() {
 	preferences.save(getConfigFile());
 	// TODO: when failure?
+
+	// encoders prepared with old settings are useless now
+	warmUpEncoderPool();
 }
 
-void Recorder::sanatizePreferences() {
+void Recorder::sanatizePreferences(bool maySave) {
 	// this converts old preferences to new preferences
 
 	int v = preferences.get(Pref::PreferencesVersion).toInt();
@@ -175,7 +215,7 @@ void Recorder::sanatizePreferences() {
 
 	didSomething |= sanatizePreferencesGeneric();
 
-	if (didSomething)
+	if (didSomething && maySave)
 		savePreferences();
 }
 
@@ -213,7 +253,7 @@ bool Recorder::sanatizePreferencesGeneric() {
 	}
 
 	s = preferences.get(Pref::OutputFormat).toString();
-	if (s != "mp3" && s != "vorbis" && s != "wav") {
+	if (!findWriterFormat(s) || (findWriterFormat(s)->capabilities & WriterSpool)) {
 		preferences.get(Pref::OutputFormat).set("mp3");
 		didSomething = true;
 	}
@@ -224,12 +264,100 @@ bool Recorder::sanatizePreferencesGeneric() {
 		didSomething = true;
 	}
 
+	s = preferences.get(Pref::OutputFormatMp3Mode).toString();
+	if (s != "cbr" && s != "abr" && s != "vbr") {
+		preferences.get(Pref::OutputFormatMp3Mode).set("cbr");
+		didSomething = true;
+	}
+
+	i = preferences.get(Pref::OutputFormatMp3VbrQuality).toInt();
+	if (i < 0 || i > 9) {
+		preferences.get(Pref::OutputFormatMp3VbrQuality).set(6);
+		didSomething = true;
+	}
+
 	i = preferences.get(Pref::OutputFormatVorbisQuality).toInt();
 	if (i < -1 || i > 10) {
 		preferences.get(Pref::OutputFormatVorbisQuality).set(3);
 		didSomething = true;
 	}
 
+	i = preferences.get(Pref::OutputFormatFlacLevel).toInt();
+	if (i < 0 || i > 8) {
+		preferences.get(Pref::OutputFormatFlacLevel).set(5);
+		didSomething = true;
+	}
+
+	// appended to the file name, so it must not lead somewhere else
+	s = preferences.get(Pref::OutputFormatPipeExtension).toString();
+	if (s.isEmpty() || s.contains('/') || s.startsWith('.')) {
+		preferences.get(Pref::OutputFormatPipeExtension).set("raw");
+		didSomething = true;
+	}
+
+	QStringList list = preferences.get(Pref::OutputExtraFormats).toList();
+	QStringList valid, formats;
+	formats.append(preferences.get(Pref::OutputFormat).toString());
+	for (int j = 0; j < list.size(); j++) {
+		QString format;
+		bool stereo;
+		// drop bogus entries, and entries that would write to the same
+		// file as another output
+		if (!parseOutputSpec(list.at(j), format, stereo, true) || formats.contains(format) ||
+				(findWriterFormat(format)->capabilities & WriterSpool))
+			continue;
+		formats.append(format);
+		valid.append(list.at(j).trimmed());
+	}
+	if (valid != list) {
+		preferences.get(Pref::OutputExtraFormats).set(valid);
+		didSomething = true;
+	}
+
+	// the spool must be readable by the transcode queue, and it may be split
+	// like any other output
+	s = preferences.get(Pref::OutputSpoolFormat).toString();
+	if (!findWriterFormat(s) || !findWriterFormat(s)->createReader || !(findWriterFormat(s)->capabilities & WriterSegmentable)) {
+		preferences.get(Pref::OutputSpoolFormat).set("packed");
+		didSomething = true;
+	}
+
+	i = preferences.get(Pref::OutputSegmentMinutes).toInt();
+	if (i < 0 || i > 24 * 60) {
+		preferences.get(Pref::OutputSegmentMinutes).set(0);
+		didSomething = true;
+	}
+
+	i = preferences.get(Pref::OutputSegmentMegabytes).toInt();
+	if (i < 0 || i > 4000) {
+		preferences.get(Pref::OutputSegmentMegabytes).set(0);
+		didSomething = true;
+	}
+
+	s = preferences.get(Pref::OutputBackend).toString();
+	if (s != "auto" && s != "uring" && s != "thread" && s != "sync") {
+		preferences.get(Pref::OutputBackend).set("auto");
+		didSomething = true;
+	}
+
+	i = preferences.get(Pref::OutputBufferKilobytes).toInt();
+	if (i < 0 || i > 16384) {
+		preferences.get(Pref::OutputBufferKilobytes).set(64);
+		didSomething = true;
+	}
+
+	s = preferences.get(Pref::OutputSyncPolicy).toString();
+	if (s != "none" && s != "interval" && s != "close") {
+		preferences.get(Pref::OutputSyncPolicy).set("none");
+		didSomething = true;
+	}
+
+	i = preferences.get(Pref::OutputSyncSeconds).toInt();
+	if (i < 1 || i > 3600) {
+		preferences.get(Pref::OutputSyncSeconds).set(10);
+		didSomething = true;
+	}
+
 	i = preferences.get(Pref::OutputStereoMix).toInt();
 	if (i < 0 || i > 100) {
 		preferences.get(Pref::OutputStereoMix).set(0);
@@ -328,6 +456,10 @@ void Recorder::skypeConnectionFailed(const QString &reason) {
 		"Internal reason for failure: %2").arg(PROGRAM_NAME, reason));
 }
 
+void Recorder::remix() {
+	exit(runRemix(arguments().mid(2)));
+}
+
 void Recorder::debugMessage(const QString &s) {
 	std::cout << QDateTime::currentDateTime().toString("yyyy-MM-dd hh:mm:ss ").toLocal8Bit().constData()
 		<< s.toLocal8Bit().constData() << "\n";
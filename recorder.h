@@ -57,12 +57,15 @@ public slots:
 	void skypeConnectionFailed(const QString &);
 	void savePreferences();
 
+private slots:
+	void remix();
+
 private:
-	void loadPreferences();
+	void loadPreferences(bool = true);
 	void setupGUI();
 	void setupSkype();
 	void setupCallHandler();
-	void sanatizePreferences();
+	void sanatizePreferences(bool);
 	bool convertSettingsToV2();
 	bool sanatizePreferencesGeneric();
 
@@ -0,0 +1,295 @@
+/*
+	Skype Call Recorder
+	Copyright 2008 - 2009 by jlh (jlh at gmx dot ch)
+
+	This program is free software; you can redistribute it and/or modify it
+	under the terms of the GNU General Public License as published by the
+	Free Software Foundation; either version 2 of the License, version 3 of
+	the License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful, but
+	WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+	General Public License for more details.
+
+	You should have received a copy of the GNU General Public License along
+	with this program; if not, write to the Free Software Foundation, Inc.,
+	51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+	The GNU General Public License version 2 is included with the source of
+	this program under the file name COPYING.  You can also get a copy on
+	http://www.fsf.org/
+*/
+
+#include <QDir>
+#include <QFile>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QSet>
+#include <QStringList>
+#include <QWaitCondition>
+#include <QtConcurrentRun>
+#include <cstdio>
+#include <unistd.h>
+
+#include "recovery.h"
+#include "common.h"
+#include "outputfile.h"
+#include "writer.h"
+#include "encryption.h"
+
+namespace {
+QMutex journalMutex;
+QStringList journal;
+bool journalLoaded = false;
+// files queued for recovery or being recovered
+QSet<QString> recovering;
+QWaitCondition recoveryDone;
+
+QString getJournalFile() {
+	return QDir::homePath() + "/.skypecallrecorder.journal";
+}
+
+// must be called with journalMutex held
+void loadJournal() {
+	if (journalLoaded)
+		return;
+	journalLoaded = true;
+
+	QFile file(getJournalFile());
+	if (!file.open(QIODevice::ReadOnly))
+		return;
+
+	while (!file.atEnd()) {
+		QString line = QString::fromUtf8(file.readLine()).trimmed();
+		if (!line.isEmpty() && !journal.contains(line))
+			journal.append(line);
+	}
+}
+
+// must be called with journalMutex held.  the journal is replaced as a
+// whole, so it is never seen half written
+void saveJournal() {
+	QString fn = getJournalFile();
+
+	if (journal.isEmpty()) {
+		QFile::remove(fn);
+		return;
+	}
+
+	QFile file(fn + ".tmp");
+	if (!file.open(QIODevice::WriteOnly)) {
+		debug(QString("Can't write journal '%1'").arg(fn));
+		return;
+	}
+
+	file.write(journal.join("\n").toUtf8() + "\n");
+	file.flush();
+	// the journal is only of any use if it survives a power loss
+	fdatasync(file.handle());
+	file.close();
+
+	if (::rename(QFile::encodeName(file.fileName()).constData(), QFile::encodeName(fn).constData()) != 0)
+		debug(QString("Can't write journal '%1'").arg(fn));
+}
+
+bool repair(const QString &fn) {
+	// the writers can't look into encrypted files.  they are only
+	// renamed, and the decryption tool can read them up to where they
+	// have been cut off
+	QFile file(fn);
+	if (file.open(QIODevice::ReadOnly) && Encryption::isEncrypted(file.read(Encryption::headerSize)))
+		return true;
+	file.close();
+
+	const WriterFormat *format = findWriterFormatByExtension(fn);
+	if (format && format->recover)
+		return format->recover(fn);
+	// other files, like seek indexes, are only renamed
+	return true;
+}
+
+void finishFile(const QString &fn) {
+	QString tmp = OutputFile::temporaryName(fn);
+
+	// if it isn't there anymore, the program has died between renaming
+	// the file and updating the journal, or the user removed it
+	if (QFile::exists(tmp)) {
+		debug(QString("Recovering unfinished file '%1'").arg(fn));
+		if (!repair(tmp))
+			debug(QString("Could not repair '%1', keeping it as is").arg(fn));
+
+		if (::rename(QFile::encodeName(tmp).constData(), QFile::encodeName(fn).constData()) != 0) {
+			debug(QString("Could not rename '%1' to '%2'").arg(tmp).arg(fn));
+			return;
+		}
+	}
+
+	journalFileClosed(fn);
+}
+
+void recoverFile(const QString &fn) {
+	finishFile(fn);
+
+	QMutexLocker locker(&journalMutex);
+	recovering.remove(fn);
+	recoveryDone.wakeAll();
+}
+
+// the calls journal.  it is small and rarely written, so it is simply
+// rewritten as a whole, like the journal of files.  each line is a call,
+// with tab separated fields
+QMutex callsMutex;
+
+QString getCallsJournalFile() {
+	return QDir::homePath() + "/.skypecallrecorder.calls";
+}
+
+// must be called with callsMutex held
+QList<JournaledCall> loadCalls() {
+	QList<JournaledCall> calls;
+	QFile file(getCallsJournalFile());
+	if (!file.open(QIODevice::ReadOnly))
+		return calls;
+
+	// calls that ended while this program wasn't running are never
+	// finished, drop them after a while
+	QDateTime expired = QDateTime::currentDateTime().addDays(-2);
+
+	while (!file.atEnd()) {
+		QString line = QString::fromUtf8(file.readLine());
+		line.chop(1);
+		QStringList fields = line.split('\t');
+		if (fields.size() < 5)
+			continue;
+
+		JournaledCall call;
+		call.id = fields.at(0).toInt();
+		call.started = QDateTime::fromString(fields.at(1), Qt::ISODate);
+		call.deferred = fields.at(2) == "1";
+		call.outputs = fields.at(3).split(',', QString::SkipEmptyParts);
+		// the file name goes last, as it might contain tabs
+		call.baseName = line.section('\t', 4);
+		if (call.started.isValid() && call.started > expired)
+			calls.append(call);
+	}
+
+	return calls;
+}
+
+// must be called with callsMutex held
+void saveCalls(const QList<JournaledCall> &calls) {
+	QString fn = getCallsJournalFile();
+
+	if (calls.isEmpty()) {
+		QFile::remove(fn);
+		return;
+	}
+
+	QStringList lines;
+	for (int i = 0; i < calls.size(); i++) {
+		const JournaledCall &call = calls.at(i);
+		lines.append(QString("%1\t%2\t%3\t%4\t%5").arg(call.id).arg(call.started.toString(Qt::ISODate))
+			.arg(call.deferred ? "1" : "0").arg(call.outputs.join(",")).arg(call.baseName));
+	}
+
+	QFile file(fn + ".tmp");
+	if (!file.open(QIODevice::WriteOnly)) {
+		debug(QString("Can't write calls journal '%1'").arg(fn));
+		return;
+	}
+
+	file.write(lines.join("\n").toUtf8() + "\n");
+	file.close();
+
+	if (::rename(QFile::encodeName(file.fileName()).constData(), QFile::encodeName(fn).constData()) != 0)
+		debug(QString("Can't write calls journal '%1'").arg(fn));
+}
+
+// removes the given call, returns whether it was there
+bool removeCall(QList<JournaledCall> &calls, int id) {
+	for (int i = 0; i < calls.size(); i++) {
+		if (calls.at(i).id == id) {
+			calls.removeAt(i);
+			return true;
+		}
+	}
+	return false;
+}
+}
+
+void journalFileOpened(const QString &fn) {
+	QMutexLocker locker(&journalMutex);
+	loadJournal();
+	if (journal.contains(fn))
+		return;
+	journal.append(fn);
+	saveJournal();
+}
+
+void journalFileClosed(const QString &fn) {
+	QMutexLocker locker(&journalMutex);
+	loadJournal();
+	if (journal.removeAll(fn) == 0)
+		return;
+	saveJournal();
+}
+
+void recoverUnfinishedFiles() {
+	QStringList list;
+	{
+		QMutexLocker locker(&journalMutex);
+		loadJournal();
+		list = journal;
+	}
+
+	if (list.isEmpty())
+		return;
+
+	debug(QString("The journal lists %1 unfinished file(s)").arg(list.size()));
+
+	{
+		QMutexLocker locker(&journalMutex);
+		for (int i = 0; i < list.size(); i++)
+			recovering.insert(list.at(i));
+	}
+
+	// each file is repaired in a thread of the global pool.  nothing waits
+	// for them, files leave the journal as they are done
+	for (int i = 0; i < list.size(); i++)
+		QtConcurrent::run(recoverFile, list.at(i));
+}
+
+
+void waitForRecovery(const QString &fn) {
+	QMutexLocker locker(&journalMutex);
+	while (recovering.contains(fn))
+		recoveryDone.wait(&journalMutex);
+}
+
+void journalCallStarted(const JournaledCall &call) {
+	QMutexLocker locker(&callsMutex);
+	QList<JournaledCall> calls = loadCalls();
+	removeCall(calls, call.id);
+	calls.append(call);
+	saveCalls(calls);
+}
+
+void journalCallFinished(int id) {
+	QMutexLocker locker(&callsMutex);
+	QList<JournaledCall> calls = loadCalls();
+	if (removeCall(calls, id))
+		saveCalls(calls);
+}
+
+bool findJournaledCall(int id, JournaledCall &call) {
+	QMutexLocker locker(&callsMutex);
+	QList<JournaledCall> calls = loadCalls();
+	for (int i = 0; i < calls.size(); i++) {
+		if (calls.at(i).id == id) {
+			call = calls.at(i);
+			return true;
+		}
+	}
+	return false;
+}
@@ -0,0 +1,70 @@
+/*
+	Skype Call Recorder
+	Copyright 2008 - 2009 by jlh (jlh at gmx dot ch)
+
+	This program is free software; you can redistribute it and/or modify it
+	under the terms of the GNU General Public License as published by the
+	Free Software Foundation; either version 2 of the License, version 3 of
+	the License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful, but
+	WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+	General Public License for more details.
+
+	You should have received a copy of the GNU General Public License along
+	with this program; if not, write to the Free Software Foundation, Inc.,
+	51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+	The GNU General Public License version 2 is included with the source of
+	this program under the file name COPYING.  You can also get a copy on
+	http://www.fsf.org/
+*/
+
+#ifndef RECOVERY_H
+#define RECOVERY_H
+
+#include <QDateTime>
+#include <QString>
+#include <QStringList>
+
+// every file that is being written is listed in a small journal in the home
+// directory, from when it is opened until it has been closed and renamed to
+// its real name.  after a crash or power loss, the journal says exactly
+// which files have been left unfinished, without having to look at all the
+// recordings in the output path
+
+void journalFileOpened(const QString &);
+void journalFileClosed(const QString &);
+
+// repairs the files listed in the journal and gives them their real names.
+// this runs in the background and only reads the beginning and the end of
+// each file
+
+void recoverUnfinishedFiles();
+
+// returns once the given file isn't being recovered anymore, so that it can
+// be reopened
+
+void waitForRecovery(const QString &);
+
+// calls that are being recorded are listed in a journal of their own, with
+// what is needed to find their files again.  if this program is restarted
+// during a call, the recording is continued in the same files instead of
+// starting new ones, see Call::startRecording().  recordings split into
+// segments are not listed
+
+struct JournaledCall {
+	int id;
+	QDateTime started;
+	QString baseName;    // the file name without extension
+	bool deferred;       // whether a spool is written, see Call
+	QStringList outputs; // in the form "format:layout"
+};
+
+void journalCallStarted(const JournaledCall &);
+void journalCallFinished(int);
+bool findJournaledCall(int, JournaledCall &);
+
+#endif
+
@@ -0,0 +1,318 @@
+/*
+	Skype Call Recorder
+	Copyright 2008 - 2009 by jlh (jlh at gmx dot ch)
+
+	This program is free software; you can redistribute it and/or modify it
+	under the terms of the GNU General Public License as published by the
+	Free Software Foundation; either version 2 of the License, version 3 of
+	the License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful, but
+	WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+	General Public License for more details.
+
+	You should have received a copy of the GNU General Public License along
+	with this program; if not, write to the Free Software Foundation, Inc.,
+	51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+	The GNU General Public License version 2 is included with the source of
+	this program under the file name COPYING.  You can also get a copy on
+	http://www.fsf.org/
+*/
+
+#include <QByteArray>
+#include <QDateTime>
+#include <QDir>
+#include <QFileInfo>
+#include <QList>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QString>
+#include <QStringList>
+#include <QThread>
+#include <QThreadPool>
+#include <QtConcurrentMap>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+
+#include "remix.h"
+#include "common.h"
+#include "preferences.h"
+#include "writer.h"
+#include "packedspool.h"
+
+namespace {
+struct RemixJob {
+	QString input;
+	QString baseName;
+	// the name of the recording, for the tags
+	QString comment;
+	// output specs as understood by parseOutputSpec()
+	QStringList outputs;
+	int stereoMix;
+	// in units of 1 / 65536
+	qint32 localGain;
+	qint32 remoteGain;
+	bool success;
+};
+
+// opening a writer reads the preferences, which are not meant to be used
+// from several threads at once.  writers are closed under it too, so that
+// nothing they do then can get in the way
+QMutex openMutex;
+
+int usage() {
+	fprintf(stderr,
+		"Usage: skype-call-recorder --remix [options] file...\n"
+		"\n"
+		"Renders recordings again from the separate streams kept next to them,\n"
+		"in the files ending with \".streams.pcmz\".\n"
+		"\n"
+		"  -f format  the output format, optionally followed by \":mono\" or\n"
+		"             \":stereo\".  may be given more than once.  by default, the\n"
+		"             format and channel layout of the preferences\n"
+		"  -m mix     the stereo mix, from 0 for local left and remote right to\n"
+		"             100 for the opposite, 50 being mono\n"
+		"  -l gain    the gain of the local stream, in dB\n"
+		"  -r gain    the gain of the remote stream, in dB\n"
+		"  -s suffix  added to the names of the outputs, \".remix\" by default\n"
+		"  -o dir     write the outputs to this directory instead of next to\n"
+		"             the streams\n"
+		"  -j jobs    the number of files processed at once, by default the\n"
+		"             number of CPU cores\n");
+	return 2;
+}
+
+qint32 gainFactor(double dB) {
+	return (qint32)floor(pow(10.0, dB / 20.0) * 65536.0 + 0.5);
+}
+
+void applyGain(QByteArray &data, long samples, qint32 gain) {
+	if (gain == 65536)
+		return;
+
+	qint16 *d = reinterpret_cast<qint16 *>(data.data());
+	for (long i = 0; i < samples; i++) {
+		qint64 v = ((qint64)d[i] * gain + 32768) >> 16;
+		d[i] = (qint16)qBound((qint64)-32768, v, (qint64)32767);
+	}
+}
+
+void deleteOutputs(const QList<AudioFileWriter *> &writers) {
+	for (int i = 0; i < writers.size(); i++) {
+		QStringList names = writers.at(i)->fileNames();
+		delete writers.at(i);
+		for (int j = 0; j < names.size(); j++)
+			if (!names.at(j).isEmpty())
+				OutputFile::remove(names.at(j));
+	}
+}
+
+// runs in a thread of the global thread pool
+void remixFile(RemixJob &job) {
+	job.success = false;
+
+	PackedSpoolReader reader;
+	if (!reader.open(job.input)) {
+		debug(QString("Cannot read the streams in '%1'").arg(job.input));
+		return;
+	}
+
+	if (!reader.isStereo()) {
+		debug(QString("'%1' doesn't have separate streams").arg(job.input));
+		reader.close();
+		return;
+	}
+
+	QList<AudioFileWriter *> writers;
+	bool needMono = false;
+	bool needStereo = false;
+	bool ok = true;
+
+	openMutex.lock();
+	bool saveTags = preferences.get(Pref::OutputSaveTags).toBool();
+	QDateTime time = QDateTime::fromTime_t(reader.startTime() / 1000);
+	for (int i = 0; ok && i < job.outputs.size(); i++) {
+		QString format;
+		bool stereo;
+		parseOutputSpec(job.outputs.at(i), format, stereo, false);
+
+		AudioFileWriter *writer = createAudioFileWriter(format);
+		writers.append(writer);
+		writer->setMayWait(true);
+		if (saveTags && (findWriterFormat(format)->capabilities & WriterTags))
+			writer->setTags(job.comment, time);
+
+		ok = writer->open(job.baseName, reader.getSampleRate(), stereo);
+		if (!ok && !writer->errorString().isEmpty())
+			debug(writer->errorString());
+		if (stereo)
+			needStereo = true;
+		else
+			needMono = true;
+	}
+	openMutex.unlock();
+
+	// one second at a time, as the streams are stored
+	QByteArray local, remote, mono, left, right;
+	const long chunkSize = reader.getSampleRate();
+
+	while (ok) {
+		long samples = reader.read(local, remote, chunkSize);
+		bool last = samples < chunkSize;
+
+		applyGain(local, samples, job.localGain);
+		applyGain(remote, samples, job.remoteGain);
+
+		// as in Call::tryToWrite()
+		if (needMono)
+			downmixToMono(local, remote, mono, samples);
+		if (needStereo && job.stereoMix != 0)
+			mixToStereo(local, remote, samples, job.stereoMix);
+
+		// files a writer opens while writing are opened here, under the
+		// lock
+		openMutex.lock();
+		for (int i = 0; ok && i < writers.size(); i++)
+			ok = writers.at(i)->prepareWrite(samples);
+		openMutex.unlock();
+
+		for (int i = 0; ok && i < writers.size(); i++) {
+			AudioFileWriter *writer = writers.at(i);
+			// writers consume the data they're given, so hand out copies
+			left = writer->isStereo() ? local : mono;
+			right = remote;
+			ok = writer->write(left, right, samples, last);
+		}
+
+		local.clear();
+		remote.clear();
+		if (last)
+			break;
+	}
+
+	reader.close();
+
+	QMutexLocker locker(&openMutex);
+
+	if (!ok) {
+		debug(QString("Cannot remix '%1'").arg(job.input));
+		deleteOutputs(writers);
+		return;
+	}
+
+	for (int i = 0; i < writers.size(); i++) {
+		writers.at(i)->close();
+		debug(QString("Remixed '%1' to '%2'").arg(job.input, writers.at(i)->fileName()));
+		delete writers.at(i);
+	}
+
+	job.success = true;
+}
+
+bool toNumber(const QString &s, double min, double max, double &out) {
+	bool ok;
+	out = s.toDouble(&ok);
+	return ok && out >= min && out <= max;
+}
+}
+
+bool isRemixCommand(int argc, char **argv) {
+	return argc > 1 && strcmp(argv[1], "--remix") == 0;
+}
+
+int runRemix(const QStringList &args) {
+	QStringList outputs;
+	double stereoMix = preferences.get(Pref::OutputStereoMix).toInt();
+	double localGain = 0.0;
+	double remoteGain = 0.0;
+	double jobs = QThread::idealThreadCount();
+	QString suffix = ".remix";
+	QString outputDir;
+	QStringList files;
+
+	for (int i = 0; i < args.size(); i++) {
+		const QString &arg = args.at(i);
+		bool hasValue = i + 1 < args.size();
+		bool ok = true;
+		if (arg == "-f" && hasValue)
+			outputs.append(args.at(++i));
+		else if (arg == "-m" && hasValue)
+			ok = toNumber(args.at(++i), 0, 100, stereoMix);
+		else if (arg == "-l" && hasValue)
+			ok = toNumber(args.at(++i), -60, 60, localGain);
+		else if (arg == "-r" && hasValue)
+			ok = toNumber(args.at(++i), -60, 60, remoteGain);
+		else if (arg == "-s" && hasValue)
+			suffix = args.at(++i);
+		else if (arg == "-o" && hasValue)
+			outputDir = args.at(++i);
+		else if (arg == "-j" && hasValue)
+			ok = toNumber(args.at(++i), 1, 1024, jobs);
+		else if (arg.startsWith('-'))
+			ok = false;
+		else
+			files.append(arg);
+		if (!ok)
+			return usage();
+	}
+
+	if (files.isEmpty() || suffix.contains('/'))
+		return usage();
+
+	bool defaultStereo = preferences.get(Pref::OutputStereo).toBool();
+	if (outputs.isEmpty())
+		outputs.append(preferences.get(Pref::OutputFormat).toString());
+
+	// as when recording, each format may only be written once, since
+	// they would write to the same file otherwise
+	QStringList formats;
+	for (int i = 0; i < outputs.size(); i++) {
+		QString format;
+		bool stereo;
+		if (!parseOutputSpec(outputs.at(i), format, stereo, defaultStereo) ||
+				(findWriterFormat(format)->capabilities & WriterSpool) || formats.contains(format)) {
+			fprintf(stderr, "skype-call-recorder: invalid output format '%s'\n", outputs.at(i).toLocal8Bit().constData());
+			return 2;
+		}
+		formats.append(format);
+		outputs[i] = format + (stereo ? ":stereo" : ":mono");
+	}
+
+	QList<RemixJob> list;
+	for (int i = 0; i < files.size(); i++) {
+		RemixJob job;
+		job.input = files.at(i);
+		job.baseName = files.at(i);
+		if (job.baseName.endsWith(".pcmz"))
+			job.baseName.chop(5);
+		if (job.baseName.endsWith(".streams"))
+			job.baseName.chop(8);
+		job.comment = QFileInfo(job.baseName).fileName();
+		job.baseName += suffix;
+		if (!outputDir.isEmpty())
+			job.baseName = QDir(outputDir).filePath(QFileInfo(job.baseName).fileName());
+		job.outputs = outputs;
+		job.stereoMix = (int)stereoMix;
+		job.localGain = gainFactor(localGain);
+		job.remoteGain = gainFactor(remoteGain);
+		job.success = false;
+		list.append(job);
+	}
+
+	// each file is encoded by one thread, which is what the encoders are
+	// made for, so files are spread over the cores instead
+	QThreadPool::globalInstance()->setMaxThreadCount((int)jobs);
+	QtConcurrent::blockingMap(list, remixFile);
+
+	int failed = 0;
+	for (int i = 0; i < list.size(); i++)
+		if (!list.at(i).success)
+			failed++;
+
+	debug(QString("Remixed %1 of %2 file(s)").arg(list.size() - failed).arg(list.size()));
+	return failed ? 1 : 0;
+}
+
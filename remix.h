@@ -0,0 +1,43 @@
+/*
+	Skype Call Recorder
+	Copyright 2008 - 2009 by jlh (jlh at gmx dot ch)
+
+	This program is free software; you can redistribute it and/or modify it
+	under the terms of the GNU General Public License as published by the
+	Free Software Foundation; either version 2 of the License, version 3 of
+	the License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful, but
+	WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+	General Public License for more details.
+
+	You should have received a copy of the GNU General Public License along
+	with this program; if not, write to the Free Software Foundation, Inc.,
+	51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+	The GNU General Public License version 2 is included with the source of
+	this program under the file name COPYING.  You can also get a copy on
+	http://www.fsf.org/
+*/
+
+#ifndef REMIX_H
+#define REMIX_H
+
+#include <QStringList>
+
+// the remix tool, run as "skype-call-recorder --remix [options] files".  it
+// renders recordings again from the unmixed streams kept with
+// Pref::OutputKeepStreams, with another stereo mix, gain or format.  the
+// streams are in a packed file named like the recording, with ".streams"
+// before the extension, see packedspool.h.  files are processed in parallel,
+// one per CPU core.  the output formats are set up as in the preferences
+
+bool isRemixCommand(int, char **);
+
+// takes the arguments after "--remix" and returns the exit code
+
+int runRemix(const QStringList &);
+
+#endif
+
@@ -0,0 +1,252 @@
+/*
+	Skype Call Recorder
+	Copyright 2008 - 2009 by jlh (jlh at gmx dot ch)
+
+	This program is free software; you can redistribute it and/or modify it
+	under the terms of the GNU General Public License as published by the
+	Free Software Foundation; either version 2 of the License, version 3 of
+	the License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful, but
+	WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+	General Public License for more details.
+
+	You should have received a copy of the GNU General Public License along
+	with this program; if not, write to the Free Software Foundation, Inc.,
+	51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+	The GNU General Public License version 2 is included with the source of
+	this program under the file name COPYING.  You can also get a copy on
+	http://www.fsf.org/
+*/
+
+
+#include <QByteArray>
+#include <QFile>
+#include <QFileInfo>
+#include <QTextStream>
+
+#include "segmentedwriter.h"
+#include "common.h"
+
+SegmentedWriter::SegmentedWriter(const QString &f, long seconds, qint64 bytes, const QString &s, bool m) :
+	format(f),
+	suffix(s),
+	maxSeconds(seconds),
+	maxSamples(0),
+	maxBytes(bytes),
+	withManifest(m),
+	current(NULL),
+	segmentSamples(0),
+	isOpen(false)
+{
+}
+
+SegmentedWriter::~SegmentedWriter() {
+	if (isOpen) {
+		debug("WARNING: SegmentedWriter::~SegmentedWriter(): File has not been closed, closing it now");
+		close();
+	}
+}
+
+void SegmentedWriter::setTags(const QString &comment, const QDateTime &t) {
+	AudioFileWriter::setTags(comment, t);
+	if (current)
+		current->setTags(comment, t);
+	for (int i = 0; i < ready.size(); i++)
+		ready.at(i)->setTags(comment, t);
+}
+
+bool SegmentedWriter::open(const QString &fn, long sr, bool s) {
+	baseName = fn;
+	sampleRate = sr;
+	stereo = s;
+	maxSamples = (qint64)maxSeconds * sr;
+	isOpen = true;
+
+	// the first segment is opened right away, so errors show up early
+	return startSegment();
+}
+
+void SegmentedWriter::close() {
+	if (!isOpen) {
+		debug("WARNING: SegmentedWriter::close() called, but file not open");
+		return;
+	}
+
+	closeSegment(true);
+	isOpen = false;
+
+	// segments opened ahead for data that never came, which only happens
+	// after a failed write
+	while (!ready.isEmpty()) {
+		AudioFileWriter *writer = ready.takeLast();
+		QString fn = writer->fileName();
+		writer->close();
+		delete writer;
+		OutputFile::remove(fn);
+		segments.removeAll(fn);
+	}
+
+	debug(QString("Closing segmented recording '%1', wrote %2 samples in %3 segments").arg(baseName).arg(samplesWritten).arg(segments.size()));
+}
+
+QString SegmentedWriter::segmentBaseName(int n) const {
+	return baseName + QString("-%1").arg(n, 3, 10, QChar('0'));
+}
+
+AudioFileWriter *SegmentedWriter::openSegment() {
+	AudioFileWriter *writer = createAudioFileWriter(format);
+	if (!tagComment.isNull() || tagTime.isValid())
+		writer->setTags(tagComment, tagTime);
+
+	int n = segments.size() + 1;
+	bool b = writer->open(segmentBaseName(n) + suffix, sampleRate, stereo);
+	segments.append(writer->fileName());
+
+	if (!b) {
+		error = writer->errorString();
+		delete writer;
+		return NULL;
+	}
+
+	return writer;
+}
+
+bool SegmentedWriter::startSegment() {
+	current = ready.isEmpty() ? openSegment() : ready.takeFirst();
+	segmentSamples = 0;
+	return current != NULL;
+}
+
+bool SegmentedWriter::closeSegment(bool mustFlush) {
+	if (!current)
+		return true;
+
+	// make sure the encoder terminates the stream properly
+	bool b = true;
+	if (mustFlush) {
+		QByteArray dummy1, dummy2;
+		b = current->write(dummy1, dummy2, 0, true);
+	}
+	current->close();
+	// the segment only appears under its real name once it is closed
+	if (withManifest)
+		appendToManifest(baseName + suffix, current->fileName());
+	QStringList list = current->fileNames();
+	list.removeAll(current->fileName());
+	extraFiles += list;
+	delete current;
+	current = NULL;
+
+	finished.append(segments.size() - ready.size());
+	return b;
+}
+
+bool SegmentedWriter::write(QByteArray &left, QByteArray &right, long samples, bool flush) {
+	bool ok = true;
+
+	while (ok && samples > 0) {
+		// the next segment is only started when there's data for it, so
+		// a recording never ends with an empty segment
+		if (!current && !startSegment())
+			return false;
+
+		long chunk = samples;
+		if (maxSamples > 0 && segmentSamples + chunk > maxSamples)
+			chunk = maxSamples - segmentSamples;
+		bool last = flush && chunk == samples;
+
+		// the writer removes the written samples from the arrays
+		ok = current->write(left, right, chunk, last);
+		segmentSamples += chunk;
+		samplesWritten += chunk;
+		samples -= chunk;
+
+		// the size limit is checked after writing, so segments may grow
+		// slightly beyond it
+		bool full = (maxSamples > 0 && segmentSamples >= maxSamples) ||
+			(maxBytes > 0 && current->bytesWritten() >= maxBytes);
+		if (full || last)
+			ok &= closeSegment(!last);
+	}
+
+	return ok;
+}
+
+bool SegmentedWriter::prepareWrite(long samples) {
+	if (samples <= 0)
+		return true;
+
+	// only the duration limit splits a write, the size limit is checked
+	// after it.  so it's known exactly how many segments the write starts
+	qint64 needed = current ? 0 : 1;
+	qint64 room = current ? maxSamples - segmentSamples : maxSamples;
+	if (maxSamples > 0 && samples > room)
+		needed += (samples - room + maxSamples - 1) / maxSamples;
+
+	while (ready.size() < needed) {
+		AudioFileWriter *writer = openSegment();
+		if (!writer)
+			return false;
+		ready.append(writer);
+	}
+
+	return true;
+}
+
+QStringList SegmentedWriter::fileNames() const {
+	QStringList list = segments + extraFiles;
+	if (current) {
+		QStringList extra = current->fileNames();
+		extra.removeAll(current->fileName());
+		list += extra;
+	}
+	if (withManifest && !segments.isEmpty())
+		list.append(manifestName(baseName + suffix, segments.first()));
+	return list;
+}
+
+QList<int> SegmentedWriter::takeFinishedSegments() {
+	QList<int> list = finished;
+	finished.clear();
+	return list;
+}
+
+QString SegmentedWriter::manifestName(const QString &base, const QString &segmentFile) {
+	// "dir/call-001.mp3" with base "dir/call" gives "dir/call.mp3.m3u"
+	QString name = QFileInfo(segmentFile).fileName();
+	int dot = name.indexOf('.', QFileInfo(base).fileName().size());
+	QString extension = dot >= 0 ? name.mid(dot) : QString();
+	return base + extension + ".m3u";
+}
+
+void SegmentedWriter::appendToManifest(const QString &base, const QString &segmentFile) {
+	QString fn = manifestName(base, segmentFile);
+	QString entry = QFileInfo(segmentFile).fileName();
+
+	QFile file(fn);
+	bool isNew = !file.exists();
+
+	if (!isNew && file.open(QIODevice::ReadOnly | QIODevice::Text)) {
+		QTextStream in(&file);
+		in.setCodec("UTF-8");
+		while (!in.atEnd())
+			if (in.readLine() == entry)
+				return;
+		file.close();
+	}
+
+	if (!file.open(QIODevice::WriteOnly | QIODevice::Append | QIODevice::Text)) {
+		debug(QString("Can't open manifest '%1'").arg(fn));
+		return;
+	}
+
+	QTextStream out(&file);
+	out.setCodec("UTF-8");
+	if (isNew)
+		out << "#EXTM3U\n";
+	out << entry << '\n';
+}
+
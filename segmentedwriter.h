@@ -0,0 +1,96 @@
+/*
+	Skype Call Recorder
+	Copyright 2008 - 2009 by jlh (jlh at gmx dot ch)
+
+	This program is free software; you can redistribute it and/or modify it
+	under the terms of the GNU General Public License as published by the
+	Free Software Foundation; either version 2 of the License, version 3 of
+	the License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful, but
+	WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+	General Public License for more details.
+
+	You should have received a copy of the GNU General Public License along
+	with this program; if not, write to the Free Software Foundation, Inc.,
+	51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+	The GNU General Public License version 2 is included with the source of
+	this program under the file name COPYING.  You can also get a copy on
+	http://www.fsf.org/
+*/
+
+
+#ifndef SEGMENTEDWRITER_H
+#define SEGMENTEDWRITER_H
+
+#include <QList>
+#include <QString>
+#include <QStringList>
+
+#include "common.h"
+#include "writer.h"
+
+class QByteArray;
+
+// splits a recording into several files of limited duration and/or size.
+// each segment is a complete file of its own, written by a writer of the
+// given format.  segments are named "<base>-001", "<base>-002", etc, followed
+// by the suffix given to the constructor and the writer's extension.  a
+// segment boundary always falls between two samples, so concatenating the
+// decoded segments gives back the exact recording.  optionally, an M3U
+// manifest named "<base><suffix>.<extension>.m3u" lists the segments in order
+
+class SegmentedWriter : public AudioFileWriter {
+public:
+	// a limit of zero means no limit
+	SegmentedWriter(const QString &, long, qint64, const QString & = QString(), bool = true);
+	virtual ~SegmentedWriter();
+
+	virtual void setTags(const QString &, const QDateTime &);
+	virtual bool open(const QString &, long, bool);
+	virtual void close();
+	virtual bool write(QByteArray &, QByteArray &, long, bool = false);
+	virtual bool prepareWrite(long);
+	virtual QStringList fileNames() const;
+
+	// returns the numbers of the segments that have been completed since
+	// the last call.  they won't be touched anymore by this writer
+	QList<int> takeFinishedSegments();
+	QString segmentFileName(int n) const { return segments.value(n - 1); }
+	QString segmentBaseName(int) const;
+
+	// adds a segment file to the manifest of the given base name, unless
+	// it's already listed
+	static void appendToManifest(const QString &, const QString &);
+
+private:
+	AudioFileWriter *openSegment();
+	bool startSegment();
+	bool closeSegment(bool);
+	static QString manifestName(const QString &, const QString &);
+
+private:
+	QString format;
+	QString suffix;
+	long maxSeconds;
+	qint64 maxSamples;
+	qint64 maxBytes;
+	bool withManifest;
+	QString baseName;
+	AudioFileWriter *current;
+	// segments opened ahead by prepareWrite(), they follow the current one
+	QList<AudioFileWriter *> ready;
+	qint64 segmentSamples;
+	QStringList segments;
+	// files written next to segments, like seek indexes
+	QStringList extraFiles;
+	QList<int> finished;
+	bool isOpen;
+
+	DISABLE_COPY_AND_ASSIGNMENT(SegmentedWriter);
+};
+
+#endif
+
@@ -12,7 +12,7 @@ Packager: jlh <jlh@gmx.ch>
 Group: Applications/Internet
 
 %description
-Skype Call recorder allows you to record Skype calls to MP3, Ogg Vorbis or WAV files.
+Skype Call recorder allows you to record Skype calls to MP3, Ogg Vorbis, FLAC or WAV files.
 
 %prep
 %setup -q
@@ -28,6 +28,7 @@ make DESTDIR="%{buildroot}" install
 %files
 %defattr(-,root,root)
 /usr/local/bin/skype-call-recorder
+/usr/local/bin/skype-call-recorder-decrypt
 /usr/local/share/applications/skype-call-recorder.desktop
 /usr/local/share/icons/hicolor/128x128/apps/skype-call-recorder.png
 
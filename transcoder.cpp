@@ -0,0 +1,367 @@
+/*
+	Skype Call Recorder
+	Copyright 2008 - 2009 by jlh (jlh at gmx dot ch)
+
+	This program is free software; you can redistribute it and/or modify it
+	under the terms of the GNU General Public License as published by the
+	Free Software Foundation; either version 2 of the License, version 3 of
+	the License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful, but
+	WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+	General Public License for more details.
+
+	You should have received a copy of the GNU General Public License along
+	with this program; if not, write to the Free Software Foundation, Inc.,
+	51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+	The GNU General Public License version 2 is included with the source of
+	this program under the file name COPYING.  You can also get a copy on
+	http://www.fsf.org/
+*/
+
+
+#include <QFile>
+#include <QDir>
+#include <QTextStream>
+#include <QStringList>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "transcoder.h"
+#include "common.h"
+#include "writer.h"
+#include "segmentedwriter.h"
+
+namespace {
+QString escape(const QString &s) {
+	QString out = s;
+	out.replace('\\', "\\\\");
+	out.replace('\t', "\\t");
+	out.replace('\n', "\\n");
+	return out;
+}
+
+QString unescape(const QString &s) {
+	QString out;
+	for (int i = 0; i < s.size(); i++) {
+		if (s.at(i) == QChar('\\') && i + 1 < s.size()) {
+			i++;
+			if (s.at(i) == QChar('t'))
+				out += QChar('\t');
+			else if (s.at(i) == QChar('n'))
+				out += QChar('\n');
+			else
+				out += s.at(i);
+		} else {
+			out += s.at(i);
+		}
+	}
+	return out;
+}
+
+// deletes the writers and removes what they have written so far, both
+// after a failure to open one of them and for aborted jobs
+void deleteOutputs(const QList<AudioFileWriter *> &writers) {
+	for (int i = 0; i < writers.size(); i++) {
+		QStringList names = writers.at(i)->fileNames();
+		delete writers.at(i);
+		for (int j = 0; j < names.size(); j++) {
+			if (names.at(j).isEmpty())
+				continue;
+			OutputFile::remove(names.at(j));
+			QFile::remove(OutputFile::temporaryName(names.at(j)));
+		}
+	}
+}
+}
+
+// TranscodeThread
+
+TranscodeThread::TranscodeThread(const TranscodeJob &j, AudioFileReader *r, const QList<AudioFileWriter *> &w) :
+	job(j),
+	reader(r),
+	writers(w),
+	aborted(false),
+	success(false)
+{
+}
+
+TranscodeThread::~TranscodeThread() {
+	wait();
+	// an aborted or failed job leaves no truncated outputs behind
+	if (!success) {
+		deleteOutputs(writers);
+	} else {
+		for (int i = 0; i < writers.size(); i++)
+			delete writers.at(i);
+	}
+	delete reader;
+}
+
+void TranscodeThread::run() {
+	// on top of QThread::IdlePriority, which maps to SCHED_IDLE where
+	// available, also give this thread the lowest nice value.  on Linux,
+	// nice values apply to individual threads
+	setpriority(PRIO_PROCESS, syscall(SYS_gettid), 19);
+
+	QByteArray left, right, mono;
+	// encode one second at a time
+	const long chunkSize = reader->getSampleRate();
+	const bool stereoSpool = reader->isStereo();
+	bool ok = true;
+
+	while (ok && !aborted) {
+		long samples = reader->read(left, right, chunkSize);
+		bool last = samples < chunkSize;
+
+		// mono outputs of a stereo spool get the sum of both channels
+		if (stereoSpool)
+			downmixToMono(left, right, mono, samples);
+		else
+			mono = left;
+
+		for (int i = 0; i < writers.size(); i++) {
+			AudioFileWriter *writer = writers.at(i);
+			// writers consume the data they're given, so hand out copies
+			QByteArray l = writer->isStereo() ? left : mono;
+			QByteArray r = right;
+			ok &= writer->write(l, r, samples, last);
+		}
+
+		// read() appends to the buffers
+		left.clear();
+		right.clear();
+		mono.clear();
+		if (last)
+			break;
+	}
+
+	// closing would give what has been written its final name
+	if (aborted || !ok)
+		return;
+
+	for (int i = 0; i < writers.size(); i++)
+		writers.at(i)->close();
+	success = true;
+}
+
+// TranscodeQueue
+
+TranscodeQueue::TranscodeQueue(QObject *parent) :
+	QObject(parent)
+{
+	maxThreads = QThread::idealThreadCount();
+	if (maxThreads < 1)
+		maxThreads = 1;
+
+	load();
+	startJobs();
+}
+
+TranscodeQueue::~TranscodeQueue() {
+	// running jobs are aborted, but they stay in the queue file and will
+	// be started over on the next run
+	for (int i = 0; i < threads.size(); i++) {
+		disconnect(threads.at(i), 0, this, 0);
+		threads.at(i)->abort();
+	}
+
+	for (int i = 0; i < threads.size(); i++)
+		delete threads.at(i);
+}
+
+QString TranscodeQueue::getQueueFile() const {
+	return QDir::homePath() + "/.skypecallrecorder.queue";
+}
+
+void TranscodeQueue::add(const TranscodeJob &job) {
+	debug(QString("Queueing '%1' for transcoding").arg(job.spoolName));
+	pending.append(job);
+	save();
+	startJobs();
+}
+
+void TranscodeQueue::cancel(const QString &spoolName) {
+	for (int i = 0; i < pending.size(); i++) {
+		if (pending.at(i).spoolName == spoolName) {
+			debug(QString("Cancelling transcoding of '%1'").arg(spoolName));
+			pending.removeAt(i);
+			save();
+			return;
+		}
+	}
+
+	for (int i = 0; i < failed.size(); i++) {
+		if (failed.at(i).spoolName == spoolName) {
+			failed.removeAt(i);
+			save();
+			return;
+		}
+	}
+
+	for (int i = 0; i < threads.size(); i++) {
+		if (threads.at(i)->getJob().spoolName == spoolName) {
+			debug(QString("Aborting transcoding of '%1'").arg(spoolName));
+			threads.at(i)->abort();
+			return;
+		}
+	}
+}
+
+void TranscodeQueue::startJobs() {
+	while (threads.size() < maxThreads && !pending.isEmpty()) {
+		TranscodeJob job = pending.takeFirst();
+
+		// the writer is opened here rather than in the thread, since
+		// opening it reads the preferences
+		AudioFileReader *reader = createAudioFileReader(job.spoolName);
+		if (!reader || !reader->open(job.spoolName)) {
+			delete reader;
+			if (QFile::exists(job.spoolName)) {
+				debug(QString("Cannot open spool file '%1', trying again on the next start").arg(job.spoolName));
+				failed.append(job);
+			} else {
+				debug(QString("Spool file '%1' is gone, dropping it from the transcode queue").arg(job.spoolName));
+			}
+			save();
+			continue;
+		}
+
+		QList<AudioFileWriter *> writers;
+		bool ok = true;
+
+		for (int i = 0; ok && i < job.outputs.size(); i++) {
+			QString format;
+			bool stereo;
+			// the format may have been unregistered since the job was
+			// queued in an earlier run
+			if (!parseOutputSpec(job.outputs.at(i), format, stereo, reader->isStereo())) {
+				debug(QString("Unknown output format '%1'").arg(job.outputs.at(i)));
+				ok = false;
+				break;
+			}
+
+			AudioFileWriter *writer = createAudioFileWriter(format);
+			writer->setMayWait(true);
+			writers.append(writer);
+			if (job.saveTags)
+				writer->setTags(job.comment, job.time);
+
+			// a mono spool can't be made into a real stereo file
+			ok = writer->open(job.baseName, reader->getSampleRate(), stereo && reader->isStereo());
+			if (!ok) {
+				if (!writer->errorString().isEmpty())
+					debug(writer->errorString());
+				break;
+			}
+
+			debug(QString("Transcoding '%1' to '%2'").arg(job.spoolName, writer->fileName()));
+			// segments are queued in order, so this keeps the manifest
+			// in order too
+			if (!job.manifestBase.isEmpty())
+				SegmentedWriter::appendToManifest(job.manifestBase, writer->fileName());
+		}
+
+		if (!ok || writers.isEmpty()) {
+			debug(QString("Cannot open output file for '%1', keeping the spool file and trying again on the next start").arg(job.spoolName));
+			deleteOutputs(writers);
+			delete reader;
+			failed.append(job);
+			save();
+			continue;
+		}
+
+		TranscodeThread *thread = new TranscodeThread(job, reader, writers);
+		connect(thread, SIGNAL(finished()), this, SLOT(threadFinished()));
+		threads.append(thread);
+		thread->start(QThread::IdlePriority);
+	}
+}
+
+void TranscodeQueue::threadFinished() {
+	TranscodeThread *thread = static_cast<TranscodeThread *>(sender());
+	const TranscodeJob &job = thread->getJob();
+
+	threads.removeAll(thread);
+
+	if (thread->getSuccess()) {
+		debug(QString("Finished transcoding '%1', removing it").arg(job.spoolName));
+		OutputFile::remove(job.spoolName);
+	} else if (thread->getAborted()) {
+		// the recording has been deleted by the user, the thread has
+		// removed its outputs
+	} else {
+		debug(QString("Transcoding '%1' failed, keeping the spool file and trying again on the next start").arg(job.spoolName));
+		failed.append(job);
+	}
+
+	delete thread;
+	save();
+	startJobs();
+}
+
+void TranscodeQueue::load() {
+	QFile file(getQueueFile());
+	if (!file.open(QIODevice::ReadOnly | QIODevice::Text))
+		return;
+
+	QTextStream in(&file);
+	in.setCodec("UTF-8");
+
+	while (!in.atEnd()) {
+		QStringList fields = in.readLine().split('\t');
+		// older queue files don't have the manifest field
+		if (fields.size() != 6 && fields.size() != 7)
+			continue;
+
+		TranscodeJob job;
+		job.spoolName = unescape(fields.at(0));
+		job.baseName = unescape(fields.at(1));
+		// older queue files hold a single format here
+		job.outputs = fields.at(2).split(',', QString::SkipEmptyParts);
+		job.saveTags = fields.at(3) == "yes";
+		job.time = QDateTime::fromTime_t(fields.at(4).toUInt());
+		job.comment = unescape(fields.at(5));
+		if (fields.size() == 7)
+			job.manifestBase = unescape(fields.at(6));
+		pending.append(job);
+	}
+
+	if (!pending.isEmpty())
+		debug(QString("Resuming %1 transcode job(s) from the last run").arg(pending.size()));
+}
+
+void TranscodeQueue::save() {
+	QList<TranscodeJob> jobs;
+	for (int i = 0; i < threads.size(); i++)
+		jobs.append(threads.at(i)->getJob());
+	jobs += pending;
+	jobs += failed;
+
+	QString fn = getQueueFile();
+
+	if (jobs.isEmpty()) {
+		QFile::remove(fn);
+		return;
+	}
+
+	QFile file(fn);
+	if (!file.open(QIODevice::WriteOnly | QIODevice::Text)) {
+		debug(QString("Can't open '%1' for saving the transcode queue").arg(fn));
+		return;
+	}
+
+	QTextStream out(&file);
+	out.setCodec("UTF-8");
+
+	for (int i = 0; i < jobs.size(); i++) {
+		const TranscodeJob &job = jobs.at(i);
+		out << escape(job.spoolName) << '\t' << escape(job.baseName) << '\t' << job.outputs.join(",") << '\t'
+			<< (job.saveTags ? "yes" : "no") << '\t' << job.time.toTime_t() << '\t'
+			<< escape(job.comment) << '\t' << escape(job.manifestBase) << '\n';
+	}
+}
@@ -0,0 +1,115 @@
+/*
+	Skype Call Recorder
+	Copyright 2008 - 2009 by jlh (jlh at gmx dot ch)
+
+	This program is free software; you can redistribute it and/or modify it
+	under the terms of the GNU General Public License as published by the
+	Free Software Foundation; either version 2 of the License, version 3 of
+	the License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful, but
+	WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+	General Public License for more details.
+
+	You should have received a copy of the GNU General Public License along
+	with this program; if not, write to the Free Software Foundation, Inc.,
+	51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+	The GNU General Public License version 2 is included with the source of
+	this program under the file name COPYING.  You can also get a copy on
+	http://www.fsf.org/
+*/
+
+
+#ifndef TRANSCODER_H
+#define TRANSCODER_H
+
+#include <QObject>
+#include <QThread>
+#include <QString>
+#include <QDateTime>
+#include <QList>
+#include <QStringList>
+
+#include "common.h"
+
+class AudioFileWriter;
+class AudioFileReader;
+
+// a recording that has been spooled to a file during the call and still needs
+// to be encoded to its final format
+
+struct TranscodeJob {
+	TranscodeJob() : saveTags(false) { }
+
+	QString spoolName;
+	QString baseName;
+	// for segments of a longer recording, the base name of the manifest
+	// listing them, otherwise empty
+	QString manifestBase;
+	// output specs as understood by parseOutputSpec()
+	QStringList outputs;
+	bool saveTags;
+	QString comment;
+	QDateTime time;
+};
+
+class TranscodeThread : public QThread {
+public:
+	TranscodeThread(const TranscodeJob &, AudioFileReader *, const QList<AudioFileWriter *> &);
+	~TranscodeThread();
+
+	void abort() { aborted = true; }
+	const TranscodeJob &getJob() const { return job; }
+	bool getSuccess() const { return success; }
+	bool getAborted() const { return aborted; }
+
+protected:
+	void run();
+
+private:
+	TranscodeJob job;
+	AudioFileReader *reader;
+	QList<AudioFileWriter *> writers;
+	volatile bool aborted;
+	bool success;
+
+	DISABLE_COPY_AND_ASSIGNMENT(TranscodeThread);
+};
+
+// the transcode queue runs jobs in low priority background threads.  the
+// queue is saved to disk, so that jobs that haven't finished when the program
+// quits are picked up again on the next start
+
+class TranscodeQueue : public QObject {
+	Q_OBJECT
+public:
+	TranscodeQueue(QObject *);
+	~TranscodeQueue();
+
+	void add(const TranscodeJob &);
+	void cancel(const QString &);
+
+private slots:
+	void threadFinished();
+
+private:
+	void startJobs();
+	void load();
+	void save();
+	QString getQueueFile() const;
+
+private:
+	QList<TranscodeJob> pending;
+	QList<TranscodeThread *> threads;
+	// jobs that couldn't be done in this run.  they stay in the queue file
+	// and are tried again on the next start, so their spools aren't lost
+	QList<TranscodeJob> failed;
+	int maxThreads;
+
+	DISABLE_COPY_AND_ASSIGNMENT(TranscodeQueue);
+};
+
+#endif
+
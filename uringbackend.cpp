@@ -0,0 +1,286 @@
+/*
+	Skype Call Recorder
+	Copyright 2008 - 2009 by jlh (jlh at gmx dot ch)
+
+	This program is free software; you can redistribute it and/or modify it
+	under the terms of the GNU General Public License as published by the
+	Free Software Foundation; either version 2 of the License, version 3 of
+	the License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful, but
+	WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+	General Public License for more details.
+
+	You should have received a copy of the GNU General Public License along
+	with this program; if not, write to the Free Software Foundation, Inc.,
+	51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+	The GNU General Public License version 2 is included with the source of
+	this program under the file name COPYING.  You can also get a copy on
+	http://www.fsf.org/
+*/
+
+
+#include <cstddef>
+
+#include "uringbackend.h"
+
+#ifndef HAVE_LIBURING
+
+OutputBackend *createUringBackend() {
+	return NULL;
+}
+
+#else
+
+#include <QByteArray>
+#include <QFile>
+#include <QVector>
+#include <QList>
+#include <liburing.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "outputfile.h"
+#include "common.h"
+
+namespace {
+// the maximum number of operations in flight per file
+const unsigned queueDepth = 64;
+// submissions are batched, to save system calls
+const int submitBatchSize = 8;
+// user data of operations that don't carry a buffer
+const __u64 syncTag = ~(__u64)0;
+
+// keeps several writes in flight at once.  the data of each write is kept
+// alive until its completion has been reaped
+
+class UringBackend : public OutputBackend {
+public:
+	UringBackend() : fd(-1), queued(0), inFlight(0), failed(false), ringReady(false) { }
+	~UringBackend() { close(); }
+
+	static bool isAvailable();
+
+	bool open(const QString &fn) {
+		return openFile(fn, O_CREAT | O_TRUNC);
+	}
+
+	bool reopen(const QString &fn) {
+		return openFile(fn, 0);
+	}
+
+	bool write(qint64 pos, const QByteArray &data, bool overwrite) {
+		reap(false);
+
+		// wait for a slot to become free if all are in use
+		while (freeSlots.isEmpty() && !failed) {
+			submit();
+			reap(true);
+		}
+		if (failed)
+			return false;
+
+		io_uring_sqe *sqe = getSqe();
+		if (!sqe)
+			return false;
+
+		int slot = freeSlots.takeFirst();
+		buffers[slot] = data;
+		offsets[slot] = pos;
+
+		io_uring_prep_write(sqe, fd, buffers[slot].constData(), buffers[slot].size(), pos);
+		io_uring_sqe_set_data(sqe, (void *)(quintptr)slot);
+		// writes to the same place must not be reordered.  this only
+		// happens for header updates, so draining the queue is cheap
+		if (overwrite)
+			sqe->flags |= IOSQE_IO_DRAIN;
+
+		if (++queued >= submitBatchSize || overwrite)
+			submit();
+
+		return true;
+	}
+
+	bool sync() {
+		io_uring_sqe *sqe = getSqe();
+		if (!sqe)
+			return false;
+		io_uring_prep_fsync(sqe, fd, IORING_FSYNC_DATASYNC);
+		io_uring_sqe_set_data(sqe, (void *)(quintptr)syncTag);
+		// only starts after all earlier writes have completed
+		sqe->flags |= IOSQE_IO_DRAIN;
+		queued++;
+		submit();
+		return !failed;
+	}
+
+	bool reserve(qint64 offset, qint64 length) {
+		return reserveRange(fd, offset, length);
+	}
+
+	bool truncate(qint64 size) {
+		drain();
+		if (ftruncate(fd, size) != 0)
+			failed = true;
+		return !failed;
+	}
+
+	bool close() {
+		if (ringReady) {
+			if (fd >= 0)
+				drain();
+			io_uring_queue_exit(&ring);
+			ringReady = false;
+		}
+
+		if (fd < 0)
+			return true;
+		if (::close(fd) != 0)
+			failed = true;
+		fd = -1;
+		return !failed;
+	}
+
+private:
+	bool openFile(const QString &fn, int flags) {
+		if (io_uring_queue_init(queueDepth, &ring, 0) < 0)
+			return false;
+		ringReady = true;
+
+		fd = ::open(QFile::encodeName(fn).constData(), O_WRONLY | flags | O_CLOEXEC, 0666);
+		if (fd < 0)
+			return false;
+
+		buffers.resize(queueDepth);
+		offsets.resize(queueDepth);
+		for (unsigned i = 0; i < queueDepth; i++)
+			freeSlots.append(i);
+
+		return true;
+	}
+
+	io_uring_sqe *getSqe() {
+		io_uring_sqe *sqe = io_uring_get_sqe(&ring);
+		while (!sqe && !failed) {
+			// the submission queue is full
+			submit();
+			reap(true);
+			sqe = io_uring_get_sqe(&ring);
+		}
+		return sqe;
+	}
+
+	void submit() {
+		if (queued == 0)
+			return;
+		int ret = io_uring_submit(&ring);
+		if (ret < 0) {
+			debug(QString("io_uring_submit() failed, code = %1").arg(ret));
+			failed = true;
+			return;
+		}
+		inFlight += ret;
+		queued -= ret;
+	}
+
+	// returns false if waiting failed
+	bool reap(bool wait) {
+		io_uring_cqe *cqe;
+
+		while (inFlight > 0) {
+			int ret = wait ? io_uring_wait_cqe(&ring, &cqe) : io_uring_peek_cqe(&ring, &cqe);
+			if (ret == -EINTR)
+				continue;
+			if (ret == -EAGAIN && !wait)
+				break;
+			if (ret < 0) {
+				debug(QString("io_uring_wait_cqe() failed, code = %1").arg(ret));
+				failed = true;
+				return false;
+			}
+
+			complete((__u64)(quintptr)io_uring_cqe_get_data(cqe), cqe->res);
+			io_uring_cqe_seen(&ring, cqe);
+			inFlight--;
+			// only wait for a single completion
+			wait = false;
+		}
+
+		return true;
+	}
+
+	void complete(__u64 tag, int res) {
+		if (tag == syncTag) {
+			if (res < 0)
+				failed = true;
+			return;
+		}
+
+		int slot = (int)tag;
+		const QByteArray &data = buffers.at(slot);
+
+		if (res < 0) {
+			failed = true;
+		} else if (res < data.size()) {
+			// short writes are rare enough to finish them synchronously
+			if (!writeFully(fd, offsets.at(slot) + res, data.constData() + res, data.size() - res))
+				failed = true;
+		}
+
+		buffers[slot] = QByteArray();
+		freeSlots.append(slot);
+	}
+
+	void drain() {
+		submit();
+		// even after a write failed, everything must complete before
+		// the buffers can go away
+		while (inFlight > 0)
+			if (!reap(true))
+				break;
+	}
+
+private:
+	io_uring ring;
+	int fd;
+	QVector<QByteArray> buffers;
+	QVector<qint64> offsets;
+	QList<int> freeSlots;
+	int queued;
+	int inFlight;
+	bool failed;
+	bool ringReady;
+
+	DISABLE_COPY_AND_ASSIGNMENT(UringBackend);
+};
+
+bool UringBackend::isAvailable() {
+	static int available = -1;
+
+	if (available < 0) {
+		// IORING_OP_WRITE needs Linux 5.6
+		io_uring_probe *probe = io_uring_get_probe();
+		available = probe && io_uring_opcode_supported(probe, IORING_OP_WRITE) &&
+			io_uring_opcode_supported(probe, IORING_OP_FSYNC);
+		if (probe)
+			io_uring_free_probe(probe);
+		debug(QString("io_uring is %1").arg(available ? "available" : "not available"));
+	}
+
+	return available;
+}
+}
+
+OutputBackend *createUringBackend() {
+	if (!UringBackend::isAvailable())
+		return NULL;
+	return new UringBackend;
+}
+
+#endif
+
@@ -25,19 +25,86 @@
 // files.  it is mostly based on the examples/encoder_example.c from the vorbis
 // library, so have a look there if you're curious about how this works.
 
-// TODO: currently, this only writes tags while opening the file, but doesn't
-// update them if they've been changed before close().  for now this is ok, as
-// it never happens.
+// unlike the example, the comment header is padded and put on a page of its
+// own.  this way, tags can be updated at close() by overwriting that page,
+// without touching the rest of the file.
 
 #include <QByteArray>
+#include <QFile>
 #include <QString>
+#include <QStringList>
+#include <QVector>
+#include <QtEndian>
+#include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <ctime>
 #include <vorbis/vorbisenc.h>
 
 #include "vorbiswriter.h"
 #include "common.h"
 #include "preferences.h"
+#include "encoderpool.h"
+#include "codeclibrary.h"
+
+namespace {
+// the functions of libvorbisenc used here, see codeclibrary.h.  those of
+// libvorbis and libogg are found through it, as it depends on them
+#define VORBIS_FUNCTIONS(X) \
+	X(vorbis_info_init) X(vorbis_info_clear) X(vorbis_comment_init) \
+	X(vorbis_comment_add_tag) X(vorbis_comment_clear) \
+	X(vorbis_commentheader_out) X(vorbis_encode_init_vbr) \
+	X(vorbis_encode_ctl) X(vorbis_analysis_init) \
+	X(vorbis_analysis_headerout) X(vorbis_analysis_buffer) \
+	X(vorbis_analysis_wrote) X(vorbis_analysis_blockout) \
+	X(vorbis_analysis) X(vorbis_bitrate_addblock) \
+	X(vorbis_bitrate_flushpacket) X(vorbis_block_init) \
+	X(vorbis_block_clear) X(vorbis_dsp_clear) X(ogg_stream_init) \
+	X(ogg_stream_clear) X(ogg_stream_packetin) X(ogg_stream_pageout) \
+	X(ogg_stream_flush) X(ogg_page_eos) X(ogg_page_granulepos) \
+	X(ogg_page_checksum_set) X(ogg_packet_clear)
+
+const int vorbisVersions[] = { 2, -1 };
+CodecLibrary vorbisLibrary("vorbisenc", vorbisVersions);
+VORBIS_FUNCTIONS(CODEC_FUNCTION_POINTER)
+
+bool resolveVorbis(CodecLibrary *library) {
+	Q_UNUSED(library);
+	VORBIS_FUNCTIONS(CODEC_FUNCTION_RESOLVE)
+	return true;
+}
+}
+
+#ifdef DLOPEN_CODECS
+#define vorbis_info_init (*vorbis_info_init_ptr)
+#define vorbis_info_clear (*vorbis_info_clear_ptr)
+#define vorbis_comment_init (*vorbis_comment_init_ptr)
+#define vorbis_comment_add_tag (*vorbis_comment_add_tag_ptr)
+#define vorbis_comment_clear (*vorbis_comment_clear_ptr)
+#define vorbis_commentheader_out (*vorbis_commentheader_out_ptr)
+#define vorbis_encode_init_vbr (*vorbis_encode_init_vbr_ptr)
+#define vorbis_encode_ctl (*vorbis_encode_ctl_ptr)
+#define vorbis_analysis_init (*vorbis_analysis_init_ptr)
+#define vorbis_analysis_headerout (*vorbis_analysis_headerout_ptr)
+#define vorbis_analysis_buffer (*vorbis_analysis_buffer_ptr)
+#define vorbis_analysis_wrote (*vorbis_analysis_wrote_ptr)
+#define vorbis_analysis_blockout (*vorbis_analysis_blockout_ptr)
+#define vorbis_analysis (*vorbis_analysis_ptr)
+#define vorbis_bitrate_addblock (*vorbis_bitrate_addblock_ptr)
+#define vorbis_bitrate_flushpacket (*vorbis_bitrate_flushpacket_ptr)
+#define vorbis_block_init (*vorbis_block_init_ptr)
+#define vorbis_block_clear (*vorbis_block_clear_ptr)
+#define vorbis_dsp_clear (*vorbis_dsp_clear_ptr)
+#define ogg_stream_init (*ogg_stream_init_ptr)
+#define ogg_stream_clear (*ogg_stream_clear_ptr)
+#define ogg_stream_packetin (*ogg_stream_packetin_ptr)
+#define ogg_stream_pageout (*ogg_stream_pageout_ptr)
+#define ogg_stream_flush (*ogg_stream_flush_ptr)
+#define ogg_page_eos (*ogg_page_eos_ptr)
+#define ogg_page_granulepos (*ogg_page_granulepos_ptr)
+#define ogg_page_checksum_set (*ogg_page_checksum_set_ptr)
+#define ogg_packet_clear (*ogg_packet_clear_ptr)
+#endif
 
 struct VorbisWriterPrivateData {
 	ogg_stream_state os;
@@ -47,11 +114,115 @@ struct VorbisWriterPrivateData {
 	vorbis_comment vc;
 	vorbis_dsp_state vd;
 	vorbis_block vb;
+	// the page holding the comment header.  the offset is -1 if the
+	// comments were too big to be padded
+	qint64 commentPageOffset;
+	QByteArray commentPageHeader;
+	long commentPacketSize;
+	// added to the granule positions of the encoder, when continuing a
+	// stream written by an earlier run
+	qint64 granuleOffset;
+	// granule position and file offset of every audio page
+	QVector<qint64> indexGranules;
+	QVector<qint64> indexOffsets;
+};
+
+namespace {
+// the largest packet that still fits on a single page
+const long maxCommentPacketSize = 255 * 255 - 1;
+
+void setComments(vorbis_comment *vc, const QString &comment, const QDateTime &time) {
+	// vorbis_comment_add_tag() in libvorbis up to version 1.2.0
+	// incorrectly takes a char * instead of a const char *.  to prevent
+	// compiler warnings we use const_cast<>(), since it's known that
+	// libvorbis does not change the arguments.
+	vorbis_comment_add_tag(vc, const_cast<char *>("COMMENT"), const_cast<char *>(comment.toUtf8().constData()));
+	vorbis_comment_add_tag(vc, const_cast<char *>("DATE"), const_cast<char *>(time.toString("yyyy-MM-dd hh:mm").toAscii().constData()));
+	vorbis_comment_add_tag(vc, const_cast<char *>("GENRE"), const_cast<char *>("Speech (Skype Call)"));
+}
+
+// the comment packet ends with a framing bit.  decoders stop reading there,
+// so anything appended to it is padding that can later be used by more tags
+bool padPacket(QByteArray &packet, long size) {
+	if (packet.size() > size)
+		return false;
+	packet.append(QByteArray(size - packet.size(), '\0'));
+	return true;
+}
+
+// holds the part of VorbisWriterPrivateData that is set up ahead of time
+class PreparedVorbis : public PreparedEncoder {
+public:
+	PreparedVorbis(VorbisWriterPrivateData *p) : pd(p) { }
+	~PreparedVorbis() {
+		if (pd) {
+			vorbis_block_clear(&pd->vb);
+			vorbis_dsp_clear(&pd->vd);
+			vorbis_info_clear(&pd->vi);
+			delete pd;
+		}
+	}
+
+	VorbisWriterPrivateData *take() {
+		VorbisWriterPrivateData *p = pd;
+		pd = NULL;
+		return p;
+	}
+
+private:
+	VorbisWriterPrivateData *pd;
 };
 
+// computes the checksum of the page at the given position into its header
+void setChecksum(uchar *data, int headerLength, int bodyLength) {
+	ogg_page page;
+	page.header = data;
+	page.header_len = headerLength;
+	page.body = data + headerLength;
+	page.body_len = bodyLength;
+	ogg_page_checksum_set(&page);
+}
+
+// returns the length of the complete and intact Ogg page at the given
+// position, or 0 if there is none
+int pageLength(const uchar *data, int available) {
+	if (available < 27 || memcmp(data, "OggS", 4) != 0)
+		return 0;
+	int headerLength = 27 + data[26];
+	if (available < headerLength)
+		return 0;
+	int bodyLength = 0;
+	for (int i = 27; i < headerLength; i++)
+		bodyLength += data[i];
+	if (available < headerLength + bodyLength)
+		return 0;
+
+	QByteArray copy(reinterpret_cast<const char *>(data), headerLength + bodyLength);
+	uchar *c = reinterpret_cast<uchar *>(copy.data());
+	setChecksum(c, headerLength, bodyLength);
+	if (memcmp(c + 22, data + 22, 4) != 0)
+		return 0;
+
+	return headerLength + bodyLength;
+}
+
+// returns the offset of the first intact page in the given data, which is
+// the size of the data if there is none
+int firstPage(const uchar *data, int size) {
+	int p = 0;
+	while (p < size && pageLength(data + p, size - p) == 0)
+		p++;
+	return p;
+}
+
+// the largest possible page
+const int maxPageSize = 27 + 255 + 255 * 255;
+}
+
 VorbisWriter::VorbisWriter() :
 	pd(NULL),
-	hasFlushed(false)
+	hasFlushed(false),
+	writeSeekIndex(false)
 {
 }
 
@@ -72,36 +243,30 @@ VorbisWriter::~VorbisWriter() {
 }
 
 bool VorbisWriter::open(const QString &fn, long sr, bool s) {
+	if (!vorbisLibrary.load(resolveVorbis)) {
+		error = vorbisLibrary.errorString();
+		return false;
+	}
+
 	bool b = AudioFileWriter::open(fn + ".ogg", sr, s);
 
 	if (!b)
 		return false;
 
-	int quality = preferences.get(Pref::OutputFormatVorbisQuality).toInt();
+	writeSeekIndex = preferences.get(Pref::OutputFormatVorbisSeekIndex).toBool();
 
-	pd = new VorbisWriterPrivateData;
-	vorbis_info_init(&pd->vi);
-
-	if (vorbis_encode_init_vbr(&pd->vi, stereo ? 2 : 1, sampleRate, (float)quality / 10.0f) != 0) {
-		delete pd;
-		pd = NULL;
+	// the encoder setup takes a while, so use one that has been prepared
+	// in the background if possible
+	PreparedEncoder *prepared = takePreparedEncoder("vorbis", sampleRate, stereo);
+	if (!prepared)
+		prepared = prepareEncoder(sampleRate, stereo, currentEncoderSettings());
+	if (!prepared)
 		return false;
-	}
-
-	// TODO: the docs vaguely mention that stereo coupling can be disabled
-	// with vorbis_encode_ctl(), but I didn't find anything concrete
+	pd = static_cast<PreparedVorbis *>(prepared)->take();
+	delete prepared;
 
 	vorbis_comment_init(&pd->vc);
-	// vorbis_comment_add_tag() in libvorbis up to version 1.2.0
-	// incorrectly takes a char * instead of a const char *.  to prevent
-	// compiler warnings we use const_cast<>(), since it's known that
-	// libvorbis does not change the arguments.
-	vorbis_comment_add_tag(&pd->vc, const_cast<char *>("COMMENT"), const_cast<char *>(tagComment.toUtf8().constData()));
-	vorbis_comment_add_tag(&pd->vc, const_cast<char *>("DATE"), const_cast<char *>(tagTime.toString("yyyy-MM-dd hh:mm").toAscii().constData()));
-	vorbis_comment_add_tag(&pd->vc, const_cast<char *>("GENRE"), const_cast<char *>("Speech (Skype Call)"));
-
-	vorbis_analysis_init(&pd->vd, &pd->vi);
-	vorbis_block_init(&pd->vd, &pd->vb);
+	setComments(&pd->vc, tagComment, tagTime);
 
 	std::srand(std::time(NULL));
 	ogg_stream_init(&pd->os, std::rand());
@@ -111,18 +276,386 @@ bool VorbisWriter::open(const QString &fn, long sr, bool s) {
 	ogg_packet header_code;
 
 	vorbis_analysis_headerout(&pd->vd, &pd->vc, &header, &header_comm, &header_code);
+
+	// the identification header must be alone on the first page
 	ogg_stream_packetin(&pd->os, &header);
-	ogg_stream_packetin(&pd->os, &header_comm);
-	ogg_stream_packetin(&pd->os, &header_code);
+	while (ogg_stream_flush(&pd->os, &pd->og) != 0) {
+		file.write((const char *)pd->og.header, pd->og.header_len);
+		file.write((const char *)pd->og.body, pd->og.body_len);
+	}
+
+	// leave at least 1 KB for tags that change later on
+	QByteArray comm((const char *)header_comm.packet, header_comm.bytes);
+	pd->commentPacketSize = 4096;
+	while (pd->commentPacketSize < comm.size() + 1024 && pd->commentPacketSize < maxCommentPacketSize)
+		pd->commentPacketSize *= 2;
+	if (pd->commentPacketSize > maxCommentPacketSize)
+		pd->commentPacketSize = maxCommentPacketSize;
+
+	if (padPacket(comm, pd->commentPacketSize)) {
+		ogg_packet padded = header_comm;
+		padded.packet = (unsigned char *)comm.data();
+		padded.bytes = comm.size();
+		ogg_stream_packetin(&pd->os, &padded);
+
+		// this puts the comment header on a page of its own
+		pd->commentPageOffset = file.pos();
+		if (ogg_stream_flush(&pd->os, &pd->og) != 0) {
+			pd->commentPageHeader = QByteArray((const char *)pd->og.header, pd->og.header_len);
+			file.write((const char *)pd->og.header, pd->og.header_len);
+			file.write((const char *)pd->og.body, pd->og.body_len);
+		} else {
+			pd->commentPageOffset = -1;
+		}
+	} else {
+		ogg_stream_packetin(&pd->os, &header_comm);
+		pd->commentPageOffset = -1;
+	}
 
+	ogg_stream_packetin(&pd->os, &header_code);
 	while (ogg_stream_flush(&pd->os, &pd->og) != 0) {
 		file.write((const char *)pd->og.header, pd->og.header_len);
 		file.write((const char *)pd->og.body, pd->og.body_len);
 	}
 
+	mustWriteTags = false;
+
+	return true;
+}
+
+bool VorbisWriter::resume(const QString &fn, long sr, bool s) {
+	if (!vorbisLibrary.load(resolveVorbis)) {
+		error = vorbisLibrary.errorString();
+		return false;
+	}
+
+	if (!reopen(fn + ".ogg", sr, s))
+		return false;
+
+	writeSeekIndex = preferences.get(Pref::OutputFormatVorbisSeekIndex).toBool();
+
+	PreparedEncoder *prepared = takePreparedEncoder("vorbis", sampleRate, stereo);
+	if (!prepared)
+		prepared = prepareEncoder(sampleRate, stereo, currentEncoderSettings());
+	if (!prepared) {
+		file.close();
+		return false;
+	}
+	pd = static_cast<PreparedVorbis *>(prepared)->take();
+	delete prepared;
+
+	vorbis_comment_init(&pd->vc);
+	setComments(&pd->vc, tagComment, tagTime);
+
+	// the new packets continue the logical stream of the file, with the
+	// same serial number, page sequence and granule positions, so that
+	// it stays one stream.  see open() for the layout of the headers
+	QByteArray head = readBack(0, 2 * maxPageSize);
+	const uchar *h = reinterpret_cast<const uchar *>(head.constData());
+	int firstLength = pageLength(h, head.size());
+	ogg_stream_init(&pd->os, firstLength ? qFromLittleEndian<quint32>(h + 14) : 0);
+
+	// this can only be done if the new encoder would write the same
+	// headers.  the setup header follows from the identification header,
+	// which has the sample rate, the channels and the quality
+	ogg_packet header;
+	ogg_packet header_comm;
+	ogg_packet header_code;
+	vorbis_analysis_headerout(&pd->vd, &pd->vc, &header, &header_comm, &header_code);
+
+	// the last page on which a packet is completed.  pages after it only
+	// have the beginning of a packet, which the new packets can't continue
+	qint64 size = file.size();
+	qint64 tailStart = qMax<qint64>(0, size - 2 * maxPageSize);
+	QByteArray tail = readBack(tailStart, size - tailStart);
+	uchar *t = reinterpret_cast<uchar *>(tail.data());
+	int n = tail.size();
+	int last = -1;
+	int end = 0;
+	for (int p = firstPage(t, n), len; (len = pageLength(t + p, n - p)) != 0; p += len) {
+		if (t[p + 26 + t[p + 26]] != 255) {
+			last = p;
+			end = p + len;
+		}
+	}
+
+	if (firstLength == 0 || !(h[5] & 0x02) || firstLength != 28 + (int)header.bytes || memcmp(h + 28, header.packet, header.bytes) != 0 ||
+			last < 0 || memcmp(t + last + 14, h + 14, 4) != 0) {
+		debug(QString("'%1' doesn't match this recording, not continuing it").arg(file.fileName()));
+		file.close();
+		return false;
+	}
+
+	if (tailStart + end != size && !file.truncate(tailStart + end)) {
+		file.close();
+		return false;
+	}
+
+	// the end of the stream has been marked when closing the file, or
+	// by recovery.  it goes on now
+	if (t[last + 5] & 0x04) {
+		int headerLength = 27 + t[last + 26];
+		t[last + 5] &= ~0x04;
+		setChecksum(t + last, headerLength, end - last - headerLength);
+		if (!writeAt(tailStart + last, QByteArray(reinterpret_cast<const char *>(t + last), headerLength))) {
+			file.close();
+			return false;
+		}
+	}
+
+	pd->os.b_o_s = 1;
+	pd->os.pageno = qFromLittleEndian<quint32>(t + last + 18) + 1;
+	pd->granuleOffset = qFromLittleEndian<qint64>(t + last + 6);
+	samplesWritten = pd->granuleOffset;
+
+	// the comment header can be updated on close if it has a page of its
+	// own, holding only that packet
+	pd->commentPageOffset = -1;
+	const uchar *c = h + firstLength;
+	int commentLength = pageLength(c, head.size() - firstLength);
+	if (commentLength && c[27 + c[26]] == 0x03 && c[26 + c[26]] != 255) {
+		pd->commentPageOffset = firstLength;
+		pd->commentPageHeader = QByteArray(reinterpret_cast<const char *>(c), 27 + c[26]);
+		pd->commentPacketSize = commentLength - (27 + c[26]);
+		for (int i = 0; i < c[26] - 1; i++)
+			if (c[27 + i] != 255)
+				pd->commentPageOffset = -1;
+	}
+
+	if (writeSeekIndex)
+		rebuildSeekIndex(tailStart + end);
+
 	return true;
 }
 
+void VorbisWriter::rebuildSeekIndex(qint64 end) {
+	// the index is only written on close, so the entries of the pages
+	// written before have to be found again.  only the page headers are
+	// read
+	QFile f(OutputFile::temporaryName(fileName()));
+	if (!f.open(QIODevice::ReadOnly))
+		return;
+
+	qint64 pos = 0;
+	while (pos < end) {
+		if (!f.seek(pos))
+			break;
+		QByteArray header = f.read(27 + 255);
+		const uchar *h = reinterpret_cast<const uchar *>(header.constData());
+		if (header.size() < 27 || memcmp(h, "OggS", 4) != 0 || header.size() < 27 + h[26])
+			break;
+
+		// the header pages have a granule position of 0
+		qint64 granule = qFromLittleEndian<qint64>(h + 6);
+		if (granule > 0) {
+			pd->indexGranules.append(granule);
+			pd->indexOffsets.append(pos);
+		}
+
+		qint64 length = 27 + h[26];
+		for (int i = 0; i < h[26]; i++)
+			length += h[27 + i];
+		pos += length;
+	}
+
+	debug(QString("Found %1 seek index entries in '%2'").arg(pd->indexGranules.size()).arg(fileName()));
+}
+
+QStringList VorbisWriter::fileNames() const {
+	QStringList list = AudioFileWriter::fileNames();
+	if (writeSeekIndex)
+		list.append(seekIndexFileName());
+	return list;
+}
+
+PreparedEncoder *VorbisWriter::prepareEncoder(long sampleRate, bool stereo, const EncoderSettings &settings) {
+	if (!vorbisLibrary.load(resolveVorbis))
+		return NULL;
+
+	// lower quality modes are cheaper to encode
+	int quality = settings.vorbisQuality - settings.loadStep;
+	if (quality < 0)
+		quality = 0;
+
+	VorbisWriterPrivateData *pd = new VorbisWriterPrivateData;
+	vorbis_info_init(&pd->vi);
+
+	if (vorbis_encode_init_vbr(&pd->vi, stereo ? 2 : 1, sampleRate, (float)quality / 10.0f) != 0) {
+		vorbis_info_clear(&pd->vi);
+		delete pd;
+		return NULL;
+	}
+
+	// TODO: the docs vaguely mention that stereo coupling can be disabled
+	// with vorbis_encode_ctl(), but I didn't find anything concrete
+
+	vorbis_analysis_init(&pd->vd, &pd->vi);
+	vorbis_block_init(&pd->vd, &pd->vb);
+	pd->granuleOffset = 0;
+
+	return new PreparedVorbis(pd);
+}
+
+namespace {
+AudioFileWriter *createVorbisWriter() {
+	return new VorbisWriter;
+}
+}
+
+WriterFormat VorbisWriter::writerFormat() {
+	WriterFormat format;
+	format.name = "vorbis";
+	format.description = "Ogg Vorbis";
+	format.extension = ".ogg";
+	format.capabilities = WriterStereo | WriterTags | WriterSeekable | WriterSegmentable;
+	format.cost = 15;
+	format.create = createVorbisWriter;
+	format.prepare = VorbisWriter::prepareEncoder;
+	format.recover = VorbisWriter::recover;
+	format.createReader = NULL;
+	return format;
+}
+
+bool VorbisWriter::recover(const QString &fn) {
+	// for the checksums
+	if (!vorbisLibrary.load(resolveVorbis))
+		return false;
+
+	QFile f(fn);
+	if (!f.open(QIODevice::ReadWrite))
+		return false;
+
+	// the last complete page starts within the last two maximum page
+	// sizes.  a seek index is only written on close, so there is none
+	qint64 size = f.size();
+	qint64 tailStart = qMax<qint64>(0, size - 2 * maxPageSize);
+	if (!f.seek(tailStart))
+		return false;
+	QByteArray tail = f.read(size - tailStart);
+	uchar *t = reinterpret_cast<uchar *>(tail.data());
+	int n = tail.size();
+
+	// find the first intact page, then follow the pages up to the end
+	int p = firstPage(t, n);
+	if (p == n)
+		return false;
+
+	int last = p;
+	for (;;) {
+		int len = pageLength(t + p, n - p);
+		if (len == 0)
+			break;
+		last = p;
+		p += len;
+	}
+
+	if (p < n) {
+		debug(QString("Cutting off %1 bytes of an incomplete page from '%2'").arg(n - p).arg(fn));
+		if (!f.resize(tailStart + p))
+			return false;
+	}
+
+	// mark the last page as the end of the stream, which the encoder
+	// would have done on close
+	if (t[last + 5] & 0x04)
+		return true;
+
+	int headerLength = 27 + t[last + 26];
+	t[last + 5] |= 0x04;
+	setChecksum(t + last, headerLength, p - last - headerLength);
+	return f.seek(tailStart + last) && f.write(reinterpret_cast<const char *>(t + last), headerLength) == headerLength;
+}
+
+void VorbisWriter::saveSeekIndex() {
+	// all numbers are little endian:
+	//   8 bytes  magic "OGGSEEKX"
+	//   4 bytes  format version, currently 1
+	//   4 bytes  sample rate
+	//   8 bytes  number of entries
+	// followed by that many entries of:
+	//   8 bytes  granule position, i.e. the number of samples up to and
+	//            including the last packet ending on the page
+	//   8 bytes  file offset of the page
+	// to seek to a sample, start decoding at the page preceding the first
+	// entry with a granule position past it
+
+	// this runs in close(), which may be on any thread, so it can't use an
+	// OutputFile, whose open() reads the preferences.  the index is
+	// written under its temporary name all the same
+	QString fn = seekIndexFileName();
+	QString tmp = OutputFile::temporaryName(fn);
+	QFile index(tmp);
+	if (!index.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+		debug(QString("Can't open seek index '%1'").arg(fn));
+		return;
+	}
+
+	int count = pd->indexGranules.size();
+	QByteArray data(24 + count * 16, '\0');
+	uchar *p = reinterpret_cast<uchar *>(data.data());
+
+	memcpy(p, "OGGSEEKX", 8);
+	qToLittleEndian<quint32>(1, p + 8);
+	qToLittleEndian<quint32>(sampleRate, p + 12);
+	qToLittleEndian<quint64>(count, p + 16);
+	p += 24;
+
+	for (int i = 0; i < count; i++) {
+		qToLittleEndian<quint64>(pd->indexGranules.at(i), p);
+		qToLittleEndian<quint64>(pd->indexOffsets.at(i), p + 8);
+		p += 16;
+	}
+
+	bool ok = index.write(data) == data.size() && index.flush();
+	index.close();
+	if (!ok || ::rename(QFile::encodeName(tmp).constData(), QFile::encodeName(fn).constData()) != 0) {
+		debug(QString("Error while writing seek index '%1'").arg(fn));
+		QFile::remove(tmp);
+	} else {
+		debug(QString("Wrote seek index with %1 entries to '%2'").arg(count).arg(fn));
+	}
+}
+
+void VorbisWriter::writeTags() {
+	if (!mustWriteTags)
+		return;
+
+	if (pd->commentPageOffset < 0) {
+		debug("WARNING: No room for updating the tags of the Ogg Vorbis file");
+		return;
+	}
+
+	debug("Updating tags of Ogg Vorbis file");
+
+	vorbis_comment vc;
+	vorbis_comment_init(&vc);
+	setComments(&vc, tagComment, tagTime);
+
+	ogg_packet op;
+	vorbis_commentheader_out(&vc, &op);
+	QByteArray body((const char *)op.packet, op.bytes);
+	ogg_packet_clear(&op);
+	vorbis_comment_clear(&vc);
+
+	if (!padPacket(body, pd->commentPacketSize)) {
+		debug("WARNING: Tags have grown beyond the space reserved for them, not updating them");
+		return;
+	}
+
+	// since the packet has the same size, the page header stays the same,
+	// except for its checksum
+	QByteArray header = pd->commentPageHeader;
+	ogg_page page;
+	page.header = (unsigned char *)header.data();
+	page.header_len = header.size();
+	page.body = (unsigned char *)body.data();
+	page.body_len = body.size();
+	ogg_page_checksum_set(&page);
+
+	if (writeAt(pd->commentPageOffset, header + body))
+		mustWriteTags = false;
+}
+
 void VorbisWriter::close() {
 	if (!file.isOpen()) {
 		debug("WARNING: VorbisWriter::close() called, but file not open");
@@ -135,6 +668,10 @@ void VorbisWriter::close() {
 		write(dummy1, dummy2, 0, true);
 	}
 
+	// only needed if the tags have changed since open()
+	writeTags();
+	if (writeSeekIndex)
+		saveSeekIndex();
 	AudioFileWriter::close();
 }
 
@@ -177,9 +714,17 @@ bool VorbisWriter::write(QByteArray &left, QByteArray &right, long samples, bool
 			vorbis_bitrate_addblock(&pd->vb);
 
 			while (vorbis_bitrate_flushpacket(&pd->vd, &pd->op)) {
+				pd->op.granulepos += pd->granuleOffset;
 				ogg_stream_packetin(&pd->os, &pd->op);
 
 				while (!eos && ogg_stream_pageout(&pd->os, &pd->og) != 0) {
+					// pages on which no packet ends have no granule
+					// position, and are useless as seek targets
+					if (writeSeekIndex && ogg_page_granulepos(&pd->og) >= 0) {
+						pd->indexGranules.append(ogg_page_granulepos(&pd->og));
+						pd->indexOffsets.append(file.pos());
+					}
+
 					file.write((const char *)pd->og.header, pd->og.header_len);
 					file.write((const char *)pd->og.body, pd->og.body_len);
 
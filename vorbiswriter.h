@@ -29,6 +29,8 @@
 
 class QString;
 class QByteArray;
+class PreparedEncoder;
+struct EncoderSettings;
 struct VorbisWriterPrivateData;
 
 class VorbisWriter : public AudioFileWriter {
@@ -37,12 +39,29 @@ public:
 	virtual ~VorbisWriter();
 
 	virtual bool open(const QString &, long, bool);
+	virtual bool resume(const QString &, long, bool);
 	virtual void close();
 	virtual bool write(QByteArray &, QByteArray &, long, bool = false);
+	virtual QStringList fileNames() const;
+
+	// repairs a file that has been left unfinished by a crash, looking
+	// only at its beginning and its end
+	static bool recover(const QString &);
+	// sets up an encoder with the current preferences, for the pool
+	static PreparedEncoder *prepareEncoder(long, bool, const EncoderSettings &);
+	// describes this writer for the format registry, see writer.h
+	static WriterFormat writerFormat();
+
+private:
+	void writeTags();
+	void saveSeekIndex();
+	void rebuildSeekIndex(qint64);
+	QString seekIndexFileName() const { return fileName() + ".idx"; }
 
 private:
 	VorbisWriterPrivateData *pd;
 	bool hasFlushed;
+	bool writeSeekIndex;
 
 	DISABLE_COPY_AND_ASSIGNMENT(VorbisWriter);
 };
@@ -23,9 +23,12 @@
 
 #include <QByteArray>
 #include <QString>
+#include <cstring>
 
 #include "wavewriter.h"
 #include "common.h"
+#include "preferences.h"
+#include "encryptingbackend.h"
 
 // little-endian helper class
 
@@ -36,17 +39,47 @@ public:
 		append((char)(i >> 8));
 	}
 
-	void appendUInt32(long i) {
+	void appendUInt32(quint32 i) {
 		append((char)i);
 		append((char)(i >> 8));
 		append((char)(i >> 16));
 		append((char)(i >> 24));
 	}
+
+	void appendUInt64(quint64 i) {
+		appendUInt32((quint32)i);
+		appendUInt32((quint32)(i >> 32));
+	}
 };
 
+namespace {
+// the largest size a RIFF size field can hold.  in RF64 files, the 32 bit
+// size fields are set to this value and the real sizes are in the ds64 chunk
+const qint64 maxRiffSize = 0xffffffffLL;
+const int ds64Size = 28;
+
+// checks the header of a file written by WaveWriter and returns its number
+// of channels, or 0 if it isn't one.  its size fields are not looked at, as
+// they are up to a second behind if the file hasn't been closed
+int parseHeader(const QByteArray &header, long &sampleRate) {
+	if (header.size() != 80 || !(header.startsWith("RIFF") || header.startsWith("RF64")) ||
+			header.mid(8, 4) != "WAVE" || header.mid(48, 4) != "fmt " || header.mid(72, 4) != "data")
+		return 0;
+
+	const uchar *h = reinterpret_cast<const uchar *>(header.constData());
+	int channels = h[58] | (h[59] << 8);
+	if (channels != 1 && channels != 2)
+		return 0;
+
+	sampleRate = h[60] | (h[61] << 8) | (h[62] << 16) | (h[63] << 24);
+	return channels;
+}
+}
+
 // WaveWriter
 
 WaveWriter::WaveWriter() :
+	isRf64(false),
 	hasFlushed(false)
 {
 }
@@ -59,6 +92,10 @@ WaveWriter::~WaveWriter() {
 }
 
 bool WaveWriter::open(const QString &fn, long sr, bool s) {
+	// PCM data can be interleaved straight into a mapping of the file
+	if (preferences.get(Pref::OutputFormatWaveMmap).toBool())
+		file.setBackendName("mmap");
+
 	bool b = AudioFileWriter::open(fn + ".wav", sr, s);
 
 	if (!b)
@@ -67,43 +104,58 @@ bool WaveWriter::open(const QString &fn, long sr, bool s) {
 	updateHeaderInterval = sampleRate; // update header every second
 	nextUpdateHeader = sampleRate;
 
-	int channels = stereo ? 2 : 1;
-	LittleEndianArray array;
-	array.reserve(44);
-
-	// main header
-	array.append("RIFF");             // RIFF signature
-	fileSizeOffset = array.size();
-	array.appendUInt32(0);            // file size excluding signature and this size
-	array.append("WAVE");             // RIFF type
-	// format chunk
-	array.append("fmt ");             // chunk name
-	array.appendUInt32(16);           // chunk size excluding name and this size
-	array.appendUInt16(1);            // compression code, 1 == PCM uncompressed
-	array.appendUInt16(channels);     // number of channels
-	array.appendUInt32(sampleRate);   // sample rate
-	array.appendUInt32(channels * 2 * sampleRate); // average bytes per second, block align * sample rate
-	array.appendUInt16(channels * 2); // block align for each sample group, (usually) significant bits / 8 * number of channels
-	array.appendUInt16(16);           // significant bits per sample
-	// data chunk
-	array.append("data");             // chunk name
-	dataSizeOffset = array.size();
-	array.appendUInt32(0);            // chunk size excluding name and this size
-	// PCM data follows
+	fileSize = 80 - 8;
+	dataSize = 0;
+	isRf64 = false;
 
-	qint64 w = file.write(array);
+	// the data rate is known exactly, so disk space can be reserved in
+	// large extents ahead of time
+	preallocate(stereo ? sampleRate * 4 : sampleRate * 2);
 
-	fileSize = array.size() - 8;
-	dataSize = 0;
+	qint64 w = file.write(makeHeader());
 
 	if (w < 0)
 		return false;
 
 	// Note: the file size field and the "data" chunk size field can't be
-	// filled in yet, which is why we put zero in there for now.  some
-	// players can play those files anyway, but we'll seek back and update
-	// these fields every now and then, so that even if we crash, we'll
-	// have a valid wav file (with potentially trailing data)
+	// filled in yet, which is why they only cover the header for now.
+	// some players can play those files anyway, but we'll rewrite the
+	// header every now and then, so that even if we crash, we'll have a
+	// valid wav file (with potentially trailing data).  once the file
+	// grows beyond what these fields can hold, it is turned into an RF64
+	// file
+
+	return true;
+}
+
+bool WaveWriter::resume(const QString &fn, long sr, bool s) {
+	if (preferences.get(Pref::OutputFormatWaveMmap).toBool())
+		file.setBackendName("mmap");
+
+	if (!reopen(fn + ".wav", sr, s))
+		return false;
+
+	long rate;
+	int channels = parseHeader(readBack(0, 80), rate);
+	if (channels != (stereo ? 2 : 1) || rate != sampleRate) {
+		debug(QString("'%1' doesn't match this recording, not continuing it").arg(file.fileName()));
+		file.close();
+		return false;
+	}
+
+	// as in recover(), a partial sample group at the end is cut off
+	dataSize = (file.size() - 80) / (channels * 2) * (channels * 2);
+	fileSize = 80 - 8 + dataSize;
+	samplesWritten = dataSize / (channels * 2);
+	isRf64 = fileSize > maxRiffSize;
+	if (file.size() != 80 + dataSize && !file.truncate(80 + dataSize)) {
+		file.close();
+		return false;
+	}
+
+	updateHeaderInterval = sampleRate;
+	nextUpdateHeader = sampleRate;
+	preallocate(stereo ? sampleRate * 4 : sampleRate * 2);
 
 	return true;
 }
@@ -124,14 +176,17 @@ void WaveWriter::close() {
 }
 
 bool WaveWriter::write(QByteArray &left, QByteArray &right, long samples, bool flush) {
-	QByteArray output;
+	qint64 size = samples * (stereo ? 4 : 2);
 
-	if (stereo) {
+	growPreallocation();
+	// in mmap mode, this is the file itself
+	char *output = file.buffer(size);
+
+	if (output && stereo) {
 		// interleave data... TODO: is this something that advanced
 		// processors instructions can handle faster?
 
-		output.resize(samples * 4);
-		qint16 *outputData = reinterpret_cast<qint16 *>(output.data());
+		qint16 *outputData = reinterpret_cast<qint16 *>(output);
 		qint16 *leftData = reinterpret_cast<qint16 *>(left.data());
 		qint16 *rightData = reinterpret_cast<qint16 *>(right.data());
 
@@ -139,15 +194,14 @@ bool WaveWriter::write(QByteArray &left, QByteArray &right, long samples, bool f
 			outputData[i * 2] = leftData[i];
 			outputData[i * 2 + 1] = rightData[i];
 		}
-	} else {
-		output = left;
-		output.truncate(samples * 2);
+	} else if (output) {
+		memcpy(output, left.constData(), size);
 	}
 
-	bool ret = file.write(output);
+	bool ret = output && file.commitBuffer(size);
 
-	fileSize += output.size();
-	dataSize += output.size();
+	fileSize += size;
+	dataSize += size;
 	samplesWritten += samples;
 
 	left.remove(0, samples * 2);
@@ -169,19 +223,199 @@ bool WaveWriter::write(QByteArray &left, QByteArray &right, long samples, bool f
 	return true;
 }
 
+QByteArray WaveWriter::makeHeader() const {
+	int channels = stereo ? 2 : 1;
+	LittleEndianArray array;
+	array.reserve(80);
+
+	// main header
+	array.append(isRf64 ? "RF64" : "RIFF"); // RIFF signature
+	array.appendUInt32(isRf64 ? maxRiffSize : fileSize); // file size excluding signature and this size
+	array.append("WAVE");             // RIFF type
+	// junk chunk, which becomes the ds64 chunk in case we exceed 4 GB.
+	// see EBU Tech 3306
+	array.append(isRf64 ? "ds64" : "JUNK"); // chunk name
+	array.appendUInt32(ds64Size);     // chunk size excluding name and this size
+	array.appendUInt64(isRf64 ? fileSize : 0); // ds64: RIFF size
+	array.appendUInt64(isRf64 ? dataSize : 0); // ds64: data chunk size
+	array.appendUInt64(isRf64 ? samplesWritten : 0); // ds64: sample count
+	array.appendUInt32(0);            // ds64: table length
+	// format chunk
+	array.append("fmt ");             // chunk name
+	array.appendUInt32(16);           // chunk size excluding name and this size
+	array.appendUInt16(1);            // compression code, 1 == PCM uncompressed
+	array.appendUInt16(channels);     // number of channels
+	array.appendUInt32(sampleRate);   // sample rate
+	array.appendUInt32(channels * 2 * sampleRate); // average bytes per second, block align * sample rate
+	array.appendUInt16(channels * 2); // block align for each sample group, (usually) significant bits / 8 * number of channels
+	array.appendUInt16(16);           // significant bits per sample
+	// data chunk
+	array.append("data");             // chunk name
+	array.appendUInt32(isRf64 ? maxRiffSize : dataSize); // chunk size excluding name and this size
+	// PCM data follows
+
+	return array;
+}
+
 void WaveWriter::updateHeader() {
-	qint64 pos = file.pos();
-	LittleEndianArray tmp;
+	if (!isRf64 && fileSize > maxRiffSize) {
+		debug(QString("'%1' has grown beyond 4 GB, switching to RF64").arg(file.fileName()));
+		isRf64 = true;
+	}
+
+	// a positional write leaves the current position at the end of the
+	// file alone, so no seeking back and forth is needed
+	writeAt(0, makeHeader());
+}
+
+namespace {
+AudioFileWriter *createWaveWriter() {
+	return new WaveWriter;
+}
+
+AudioFileReader *createWaveReader() {
+	return new WaveReader;
+}
+}
+
+WriterFormat WaveWriter::writerFormat() {
+	WriterFormat format;
+	format.name = "wav";
+	format.description = "WAV PCM";
+	format.extension = ".wav";
+	format.capabilities = WriterStereo | WriterSeekable | WriterSegmentable;
+	format.cost = 1;
+	format.create = createWaveWriter;
+	format.prepare = NULL;
+	format.recover = WaveWriter::recover;
+	format.createReader = createWaveReader;
+	return format;
+}
+
+bool WaveWriter::recover(const QString &fn) {
+	QFile f(fn);
+	if (!f.open(QIODevice::ReadWrite))
+		return false;
+
+	// only the header is needed.  the sizes are derived from the file
+	// size instead
+	WaveWriter w;
+	int channels = parseHeader(f.read(80), w.sampleRate);
+	if (channels == 0)
+		return false;
+
+	w.stereo = channels == 2;
+	// a partial sample group at the end is cut off
+	w.dataSize = (f.size() - 80) / (channels * 2) * (channels * 2);
+	w.fileSize = 80 - 8 + w.dataSize;
+	w.samplesWritten = w.dataSize / (channels * 2);
+	w.isRf64 = w.fileSize > maxRiffSize;
+
+	if (f.size() != 80 + w.dataSize && !f.resize(80 + w.dataSize))
+		return false;
+
+	QByteArray fixed = w.makeHeader();
+	return f.seek(0) && f.write(fixed) == fixed.size();
+}
+
+// WaveReader
+
+WaveReader::WaveReader() :
+	dataStart(0),
+	sampleRate(0),
+	stereo(false)
+{
+}
+
+bool WaveReader::open(const QString &fn) {
+	// spool files are encrypted along with everything else
+	if (!file.open(fn))
+		return false;
+
+	// this only understands the 16 bit PCM files written by WaveWriter.
+	// the size fields of the data chunk and the RIFF header are ignored,
+	// as they may be stale if we crashed while writing the file, and all
+	// data up to the end of the file is read instead
+	QByteArray header = file.read(12);
+	int channels = 0;
+	bool hasData = false;
+
+	if (header.size() == 12 && (header.startsWith("RIFF") || header.startsWith("RF64")) && header.mid(8, 4) == "WAVE") {
+		for (;;) {
+			QByteArray chunk = file.read(8);
+			if (chunk.size() != 8)
+				break;
+			const uchar *h = reinterpret_cast<const uchar *>(chunk.constData());
+			qint64 size = h[4] | (h[5] << 8) | (h[6] << 16) | ((qint64)h[7] << 24);
+
+			if (chunk.startsWith("data")) {
+				hasData = true;
+				break;
+			}
+
+			QByteArray body = file.read(size);
+			if (body.size() != size) {
+				channels = 0;
+				break;
+			}
+
+			if (chunk.startsWith("fmt ") && size >= 16) {
+				const uchar *f = reinterpret_cast<const uchar *>(body.constData());
+				channels = f[2] | (f[3] << 8);
+				sampleRate = f[4] | (f[5] << 8) | (f[6] << 16) | (f[7] << 24);
+			}
+
+			// chunks are word aligned
+			if (size & 1)
+				file.read(1);
+		}
+	}
+
+	if (!hasData || (channels != 1 && channels != 2)) {
+		debug(QString("WaveReader: '%1' is not a WAV file written by us").arg(fn));
+		close();
+		return false;
+	}
 
-	tmp.appendUInt32(fileSize);
-	file.seek(fileSizeOffset);
-	file.write(tmp);
+	stereo = channels == 2;
+	dataStart = file.pos();
 
-	tmp.clear();
-	tmp.appendUInt32(dataSize);
-	file.seek(dataSizeOffset);
-	file.write(tmp);
+	return true;
+}
 
-	file.seek(pos);
+void WaveReader::close() {
+	file.close();
 }
 
+bool WaveReader::seek(qint64 sample) {
+	qint64 pos = dataStart + sample * (stereo ? 4 : 2);
+	// seeking alone succeeds past the end of a file
+	return file.seek(pos) && !file.read(1).isEmpty() && file.seek(pos);
+}
+
+long WaveReader::read(QByteArray &left, QByteArray &right, long samples) {
+	QByteArray input = file.read(samples * (stereo ? 4 : 2));
+	samples = input.size() / (stereo ? 4 : 2);
+
+	if (!stereo) {
+		input.truncate(samples * 2);
+		left += input;
+		return samples;
+	}
+
+	int l = left.size();
+	int r = right.size();
+	left.resize(l + samples * 2);
+	right.resize(r + samples * 2);
+
+	const qint16 *inputData = reinterpret_cast<const qint16 *>(input.constData());
+	qint16 *leftData = reinterpret_cast<qint16 *>(left.data() + l);
+	qint16 *rightData = reinterpret_cast<qint16 *>(right.data() + r);
+
+	for (long i = 0; i < samples; i++) {
+		leftData[i] = inputData[i * 2];
+		rightData[i] = inputData[i * 2 + 1];
+	}
+
+	return samples;
+}
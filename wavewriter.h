@@ -26,6 +26,7 @@
 
 #include "common.h"
 #include "writer.h"
+#include "encryptingbackend.h"
 
 class QString;
 class QByteArray;
@@ -36,23 +37,52 @@ public:
 	virtual ~WaveWriter();
 
 	virtual bool open(const QString &, long, bool);
+	virtual bool resume(const QString &, long, bool);
 	virtual void close();
 	virtual bool write(QByteArray &, QByteArray &, long, bool = false);
 
+	// repairs a file that has been left unfinished by a crash, looking
+	// only at its beginning and its end
+	static bool recover(const QString &);
+	// describes this writer for the format registry, see writer.h
+	static WriterFormat writerFormat();
+
 private:
+	QByteArray makeHeader() const;
 	void updateHeader();
 
 private:
 	long updateHeaderInterval;
 	long nextUpdateHeader;
-	int fileSizeOffset;
-	int dataSizeOffset;
 	qint64 fileSize;
 	qint64 dataSize;
+	bool isRf64;
 	bool hasFlushed;
 
 	DISABLE_COPY_AND_ASSIGNMENT(WaveWriter);
 };
 
+// reads back files written by WaveWriter, used for transcoding spool files
+
+class WaveReader : public AudioFileReader {
+public:
+	WaveReader();
+
+	virtual bool open(const QString &);
+	virtual void close();
+	virtual long read(QByteArray &, QByteArray &, long);
+	virtual bool seek(qint64);
+	virtual long getSampleRate() const { return sampleRate; }
+	virtual bool isStereo() const { return stereo; }
+
+private:
+	InputFile file;
+	qint64 dataStart;
+	long sampleRate;
+	bool stereo;
+
+	DISABLE_COPY_AND_ASSIGNMENT(WaveReader);
+};
+
 #endif
 
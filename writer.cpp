@@ -21,17 +21,33 @@
 	http://www.fsf.org/
 */
 
+#include <QFile>
 #include <QFileInfo>
 #include <QDir>
+#include <QStringList>
+#include <QAtomicInt>
+#include <QTime>
+#include <time.h>
 
 #include "writer.h"
 #include "common.h"
+#include "wavewriter.h"
+#include "mp3writer.h"
+#include "vorbiswriter.h"
+#include "flacwriter.h"
+#include "pipewriter.h"
+#include "packedspool.h"
+#include "encoderpool.h"
 
 AudioFileWriter::AudioFileWriter() :
 	sampleRate(0),
 	stereo(false),
 	samplesWritten(0),
-	mustWriteTags(true)
+	mustWriteTags(true),
+	mayWait(false),
+	preallocationExtent(0),
+	preallocatedUntil(0),
+	rtf(0.0)
 {
 }
 
@@ -59,7 +75,25 @@ bool AudioFileWriter::open(const QString &fn, long sr, bool s) {
 
 	debug(QString("Opening '%1'").arg(file.fileName()));
 
-	return file.open(QIODevice::WriteOnly);
+	return file.open();
+}
+
+bool AudioFileWriter::reopen(const QString &fn, long sr, bool s) {
+	file.setFileName(fn);
+	sampleRate = sr;
+	stereo = s;
+
+	debug(QString("Continuing '%1'").arg(file.fileName()));
+
+	return file.reopen();
+}
+
+QByteArray AudioFileWriter::readBack(qint64 pos, qint64 size) const {
+	// nothing is buffered yet when this is used
+	QFile f(OutputFile::temporaryName(file.fileName()));
+	if (!f.open(QIODevice::ReadOnly) || !f.seek(pos))
+		return QByteArray();
+	return f.read(size);
 }
 
 void AudioFileWriter::close() {
@@ -69,6 +103,239 @@ void AudioFileWriter::close() {
 	}
 
 	debug(QString("Closing '%1', wrote %2 samples, %3 seconds").arg(file.fileName()).arg(samplesWritten).arg(samplesWritten / sampleRate));
-	return file.close();
+
+	if (preallocatedUntil > 0) {
+		// give back the space that has been reserved but not used.
+		// truncating to the current size drops blocks past the end
+		if (!file.truncate(file.size()))
+			debug(QString("Could not release preallocated space of '%1'").arg(file.fileName()));
+		preallocatedUntil = 0;
+	}
+
+	file.close();
+}
+
+void AudioFileWriter::preallocate(qint64 bytesPerSecond) {
+	// one minute at a time, but at least 1 MB
+	preallocationExtent = bytesPerSecond * 60;
+	if (preallocationExtent < 1024 * 1024)
+		preallocationExtent = 1024 * 1024;
+	// a resumed file already has data up to here
+	preallocatedUntil = file.pos();
+	growPreallocation();
+}
+
+void AudioFileWriter::growPreallocation() {
+	if (preallocationExtent <= 0)
+		return;
+
+	// stay half an extent ahead
+	if (file.pos() + preallocationExtent / 2 < preallocatedUntil)
+		return;
+
+	if (file.reserve(preallocatedUntil, preallocationExtent)) {
+		preallocatedUntil += preallocationExtent;
+		return;
+	}
+
+	// not supported by the file system.  don't try again
+	debug(QString("Cannot preallocate space for '%1'").arg(file.fileName()));
+	preallocationExtent = 0;
+}
+
+bool AudioFileWriter::writeAt(qint64 pos, const QByteArray &data) {
+	if (!file.writeAt(pos, data)) {
+		debug(QString("Error while updating '%1' at offset %2").arg(file.fileName()).arg(pos));
+		return false;
+	}
+
+	return true;
+}
+
+namespace {
+qint64 microseconds() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (qint64)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+QAtomicInt loadStep(0);
+}
+
+bool AudioFileWriter::timedWrite(QByteArray &left, QByteArray &right, long samples, bool flush) {
+	qint64 start = microseconds();
+	bool b = write(left, right, samples, flush);
+
+	if (samples > 0 && sampleRate > 0) {
+		double spent = (microseconds() - start) / 1000000.0;
+		double duration = (double)samples / sampleRate;
+		// a moving average over about a second, at 10 writes per second
+		rtf = rtf * 0.9 + spent / duration * 0.1;
+	}
+
+	return b;
+}
+
+int encoderLoadStep() {
+	return loadStep;
+}
+
+void adaptEncoderLoad(const QList<AudioFileWriter *> &writers, long backlog) {
+	// wait a bit after each step, so that it can take effect before the
+	// next one.  going back up is done much more carefully
+	static QTime lastChange = QTime::currentTime();
+	const int stepDownDelay = 5000;
+	const int stepUpDelay = 60000;
+
+	double worst = 0.0;
+	for (int i = 0; i < writers.size(); i++)
+		worst = qMax(worst, writers.at(i)->realTimeFactor());
+
+	int step = loadStep;
+	// if more than a second of audio has piled up, the writers aren't
+	// keeping up, whatever their real-time factor says
+	bool behind = backlog > skypeSamplingRate;
+
+	if ((worst > 0.7 || behind) && step < maxEncoderLoadStep && lastChange.elapsed() > stepDownDelay)
+		step++;
+	else if (worst < 0.2 && !behind && step > 0 && lastChange.elapsed() > stepUpDelay)
+		step--;
+	else
+		return;
+
+	debug(QString("Encoders at %1 times real time%2, setting encoder load step to %3")
+		.arg(worst, 0, 'f', 2).arg(behind ? " and falling behind" : "").arg(step));
+	loadStep.fetchAndStoreOrdered(step);
+	lastChange.restart();
+	// prepared encoders have been set up for the old step
+	warmUpEncoderPool();
+}
+
+namespace {
+QList<WriterFormat> builtinFormats() {
+	QList<WriterFormat> list;
+	// in the order they are offered to the user
+	list.append(WaveWriter::writerFormat());
+	list.append(Mp3Writer::writerFormat());
+	list.append(VorbisWriter::writerFormat());
+	list.append(FlacWriter::writerFormat());
+	list.append(PipeWriter::writerFormat());
+	list.append(PackedSpoolWriter::writerFormat());
+	return list;
+}
+
+// the built-in formats are registered on first use, which may happen from
+// any thread.  function-local statics are initialized safely for that
+QList<WriterFormat> &registry() {
+	static QList<WriterFormat> list = builtinFormats();
+	return list;
+}
+}
+
+void registerWriterFormat(const WriterFormat &format) {
+	QList<WriterFormat> &list = registry();
+	for (int i = 0; i < list.size(); i++) {
+		if (list.at(i).name == format.name) {
+			debug(QString("Replacing the writer for format '%1'").arg(format.name));
+			list[i] = format;
+			return;
+		}
+	}
+
+	debug(QString("Registering the writer for format '%1'").arg(format.name));
+	list.append(format);
+}
+
+const WriterFormat *findWriterFormat(const QString &name) {
+	const QList<WriterFormat> &list = registry();
+	for (int i = 0; i < list.size(); i++)
+		if (list.at(i).name == name)
+			return &list.at(i);
+	return NULL;
+}
+
+const WriterFormat *findWriterFormatByExtension(const QString &fn) {
+	const QList<WriterFormat> &list = registry();
+	for (int i = 0; i < list.size(); i++)
+		if (!list.at(i).extension.isEmpty() && fn.endsWith(list.at(i).extension))
+			return &list.at(i);
+	return NULL;
+}
+
+QList<const WriterFormat *> writerFormats() {
+	const QList<WriterFormat> &list = registry();
+	QList<const WriterFormat *> out;
+	for (int i = 0; i < list.size(); i++)
+		out.append(&list.at(i));
+	return out;
+}
+
+AudioFileWriter *createAudioFileWriter(const QString &name) {
+	const WriterFormat *format = findWriterFormat(name);
+	return format ? format->create() : NULL;
 }
 
+AudioFileReader *createAudioFileReader(const QString &fn) {
+	const WriterFormat *format = findWriterFormatByExtension(fn);
+	return format && format->createReader ? format->createReader() : NULL;
+}
+
+PreparedEncoder *prepareEncoder(const QString &name, long sampleRate, bool stereo, const EncoderSettings &settings) {
+	const WriterFormat *format = findWriterFormat(name);
+	if (!format || !format->prepare)
+		return NULL;
+	return format->prepare(sampleRate, stereo, settings);
+}
+
+bool parseOutputSpec(const QString &spec, QString &format, bool &stereo, bool defaultStereo) {
+	QStringList parts = spec.trimmed().split(':');
+	if (parts.size() > 2)
+		return false;
+
+	format = parts.at(0).trimmed();
+	const WriterFormat *f = findWriterFormat(format);
+	if (!f)
+		return false;
+
+	stereo = defaultStereo;
+	if (parts.size() == 2) {
+		QString layout = parts.at(1).trimmed();
+		if (layout == "mono")
+			stereo = false;
+		else if (layout == "stereo")
+			stereo = true;
+		else
+			return false;
+	}
+
+	if (!(f->capabilities & WriterStereo))
+		stereo = false;
+
+	return true;
+}
+
+void downmixToMono(const QByteArray &left, const QByteArray &right, QByteArray &mono, long samples) {
+	mono.resize(samples * 2);
+
+	const qint16 *leftData = reinterpret_cast<const qint16 *>(left.constData());
+	const qint16 *rightData = reinterpret_cast<const qint16 *>(right.constData());
+	qint16 *monoData = reinterpret_cast<qint16 *>(mono.data());
+
+	for (long i = 0; i < samples; i++)
+		monoData[i] = ((qint32)leftData[i] + (qint32)rightData[i]) / (qint32)2;
+}
+
+void mixToStereo(QByteArray &local, QByteArray &remote, long samples, int pan) {
+	qint16 *localData = reinterpret_cast<qint16 *>(local.data());
+	qint16 *remoteData = reinterpret_cast<qint16 *>(remote.data());
+
+	qint32 fl = 100 - pan;
+	qint32 fr = pan;
+
+	for (long i = 0; i < samples; i++) {
+		qint16 newLocal = ((qint32)localData[i] * fl + (qint32)remoteData[i] * fr + (qint32)50) / (qint32)100;
+		qint16 newRemote = ((qint32)localData[i] * fr + (qint32)remoteData[i] * fl + (qint32)50) / (qint32)100;
+		localData[i] = newLocal;
+		remoteData[i] = newRemote;
+	}
+}
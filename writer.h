@@ -24,13 +24,17 @@
 #ifndef WRITER_H
 #define WRITER_H
 
-#include <QFile>
 #include <QDateTime>
+#include <QList>
 #include <QString>
+#include <QStringList>
 
 #include "common.h"
+#include "outputfile.h"
 
 class QByteArray;
+class PreparedEncoder;
+struct EncoderSettings;
 
 class AudioFileWriter {
 public:
@@ -43,24 +47,183 @@ public:
 	// however, if a writer doesn't support tags at all, they are silently
 	// ignored.
 	virtual void setTags(const QString &, const QDateTime &);
+	// writers on the capture path must never wait for anything.  the
+	// transcoder and the remix tool feed them faster than real time
+	// instead, and let them wait for outputs that can't keep up.  must be
+	// set before open()
+	void setMayWait(bool b) { mayWait = b; }
 
 	// Note: you're not supposed to reopen after a close
 	virtual bool open(const QString &, long, bool);
+	// like open(), but continues a file written by an earlier run of this
+	// program, which may have been closed or cut off by a crash.  returns
+	// false if the writer can't do that or the file doesn't match the
+	// given parameters, in which case the file is left as it was
+	virtual bool resume(const QString &, long, bool) { return false; }
 	virtual void close();
 	virtual bool write(QByteArray &, QByteArray &, long, bool = false) = 0;
+	// opens whatever the next write() of the given number of samples will
+	// need, like the next file of a segmented recording.  opening reads the
+	// preferences, so callers that write() on another thread call this on
+	// the GUI thread first
+	virtual bool prepareWrite(long) { return true; }
 	QString fileName() const { return file.fileName(); }
+	// all files created by this writer, which may be more than one
+	virtual QStringList fileNames() const { return QStringList(fileName()); }
+	qint64 bytesWritten() const { return file.pos(); }
+	bool isStereo() const { return stereo; }
+	// write(), but measures how long it takes.  this is what
+	// realTimeFactor() is based on
+	bool timedWrite(QByteArray &, QByteArray &, long, bool = false);
+	// the time write() takes relative to the duration of the audio it is
+	// given, averaged over the last few seconds.  an encoder that gets
+	// close to 1 won't keep up with the call much longer
+	double realTimeFactor() const { return rtf; }
+	// why open() failed, if there's more to say than that the file could
+	// not be created
+	QString errorString() const { return error; }
 
 protected:
-	QFile file;
+	// overwrites data that has already been written, without moving the
+	// current position.  this is meant for patching headers in place
+	bool writeAt(qint64, const QByteArray &);
+	// the part of resume() common to all writers.  the position is at the
+	// end of the file, and what has been written can be read back
+	bool reopen(const QString &, long, bool);
+	QByteArray readBack(qint64, qint64) const;
+	// reserves disk space ahead of the current position in large extents,
+	// given the expected number of bytes per second.  this keeps long
+	// recordings from getting fragmented.  writers call growPreallocation()
+	// before appending data, and close() releases what hasn't been used
+	void preallocate(qint64);
+	void growPreallocation();
+
+protected:
+	OutputFile file;
 	long sampleRate;
 	bool stereo;
 	qint64 samplesWritten;
 	QString tagComment;
 	QDateTime tagTime;
 	bool mustWriteTags;
+	bool mayWait;
+	QString error;
+
+private:
+	qint64 preallocationExtent;
+	qint64 preallocatedUntil;
+	double rtf;
 
 	DISABLE_COPY_AND_ASSIGNMENT(AudioFileWriter);
 };
 
+// reads back files written by some of the writers, used for transcoding
+// spool files.  read() appends the given number of samples to the arrays,
+// the second one only for stereo files, and returns how many it has read,
+// which is less than requested at the end of the file
+
+class AudioFileReader {
+public:
+	AudioFileReader() { }
+	virtual ~AudioFileReader() { }
+
+	virtual bool open(const QString &) = 0;
+	virtual void close() = 0;
+	virtual long read(QByteArray &, QByteArray &, long) = 0;
+	// positions the reader at the given sample.  returns false if it is
+	// past the end of the file
+	virtual bool seek(qint64) = 0;
+	virtual long getSampleRate() const = 0;
+	virtual bool isStereo() const = 0;
+
+private:
+	DISABLE_COPY_AND_ASSIGNMENT(AudioFileReader);
+};
+
+// the registry of output formats.  each writer describes itself with a
+// WriterFormat, and everything that deals with format names goes through
+// the registry, so a new writer only needs to be registered to be usable.
+// the built-in writers are always registered.  registerWriterFormat() must
+// be called from the main thread, before the format is first used
+
+enum WriterCapability {
+	WriterStereo      = 0x01, // can write two channels
+	WriterTags        = 0x02, // stores the tags given by setTags()
+	WriterSeekable    = 0x04, // patches what it has written, so it needs a
+	                          // regular file as output
+	WriterSegmentable = 0x08, // may be split by SegmentedWriter
+	WriterSpool       = 0x10  // only meant for spool files, see
+	                          // Pref::OutputSpoolFormat.  not offered as an
+	                          // output format
+};
+
+struct WriterFormat {
+	QString name;        // as used by Pref::OutputFormat
+	QString description; // as shown to the user
+	QString extension;   // of the files written, including the dot, if fixed
+	int capabilities;    // WriterCapability flags
+	int cost;            // rough CPU time per second of audio, WAV is 1
+	AudioFileWriter *(*create)();
+	// may be NULL, see prepareEncoder() below
+	PreparedEncoder *(*prepare)(long, bool, const EncoderSettings &);
+	// may be NULL, see recovery.h
+	bool (*recover)(const QString &);
+	// may be NULL.  spool formats must have a reader
+	AudioFileReader *(*createReader)();
+};
+
+void registerWriterFormat(const WriterFormat &);
+// returns NULL for unknown formats
+const WriterFormat *findWriterFormat(const QString &);
+const WriterFormat *findWriterFormatByExtension(const QString &);
+QList<const WriterFormat *> writerFormats();
+
+// creates a writer for the given format name, as used by Pref::OutputFormat.
+// returns NULL for unknown formats
+
+AudioFileWriter *createAudioFileWriter(const QString &);
+
+// creates a reader for the given file, based on its extension.  returns NULL
+// for files that can't be read back
+
+AudioFileReader *createAudioFileReader(const QString &);
+
+// sets up an encoder for the given format, sample rate and channel layout
+// ahead of time, see encoderpool.h.  returns NULL for formats that don't
+// support this.  doesn't use the preferences, so it may run on any thread
+
+PreparedEncoder *prepareEncoder(const QString &, long, bool, const EncoderSettings &);
+
+// parses an output specification of the form "format", "format:mono" or
+// "format:stereo", as used by Pref::OutputExtraFormats.  the third argument
+// is the channel layout used if none is given
+
+bool parseOutputSpec(const QString &, QString &, bool &, bool);
+
+// under CPU pressure, encoders are set up with less complexity than
+// configured, one step at a time.  0 means as configured, and steps are
+// taken back when the pressure is gone.  writers apply this when setting up
+// their encoder, which happens for each call and each segment
+
+const int maxEncoderLoadStep = 3;
+int encoderLoadStep();
+
+// watches the real-time factors of the writers of a call and how far the
+// call is behind, and adjusts the encoder load step accordingly
+
+void adaptEncoderLoad(const QList<AudioFileWriter *> &, long);
+
+// averages two channels into one, used by everything that needs to derive a
+// mono output from two streams
+
+void downmixToMono(const QByteArray &, const QByteArray &, QByteArray &, long);
+
+// turns the local and remote streams, given as first and second array, into
+// the left and right channels of a stereo output, in place.  the last
+// argument is the stereo mix, from 0 for local left and remote right, to 100
+// for the opposite
+
+void mixToStereo(QByteArray &, QByteArray &, long, int);
+
 #endif
 